@@ -796,8 +796,9 @@ static void bdrv_temp_snapshot_options(int *child_flags, QDict *child_options,
     qdict_copy_default(child_options, parent_options, BDRV_OPT_READ_ONLY);
 
     /* aio=native doesn't work for cache.direct=off, so disable it for the
-     * temporary snapshot */
-    *child_flags &= ~BDRV_O_NATIVE_AIO;
+     * temporary snapshot.  Use the thread pool for aio=io_uring as well,
+     * the overlay is a throwaway file. */
+    *child_flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
 }
 
 /*
@@ -3201,7 +3202,8 @@ static void bdrv_delete(BlockDriverState *bs)
  * free of errors) or -errno when an internal error occurred. The results of the
  * check are stored in res.
  */
-int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
+int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix,
+               BlockDriverAmendStatusCB *status_cb, void *cb_opaque)
 {
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
@@ -3211,7 +3213,7 @@ int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_check(bs, res, fix);
+    return bs->drv->bdrv_check(bs, res, fix, status_cb, cb_opaque);
 }
 
 /*
@@ -3805,6 +3807,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -32,6 +32,17 @@
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+/* 1-2-5 steps from 10 microseconds to 5 seconds */
+static const uint64_t default_histogram_boundaries[] = {
+    10 * SCALE_US, 20 * SCALE_US, 50 * SCALE_US,
+    100 * SCALE_US, 200 * SCALE_US, 500 * SCALE_US,
+    1 * SCALE_MS, 2 * SCALE_MS, 5 * SCALE_MS,
+    10 * SCALE_MS, 20 * SCALE_MS, 50 * SCALE_MS,
+    100 * SCALE_MS, 200 * SCALE_MS, 500 * SCALE_MS,
+    1 * NANOSECONDS_PER_SECOND, 2 * NANOSECONDS_PER_SECOND,
+    5 * NANOSECONDS_PER_SECOND,
+};
+
 void block_acct_init(BlockAcctStats *stats, bool account_invalid,
                      bool account_failed)
 {
@@ -46,9 +57,14 @@ void block_acct_init(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    unsigned i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_clear(stats, i);
+    }
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -86,6 +102,32 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->type = type;
 }
 
+static void block_latency_histogram_account(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            uint64_t latency_ns)
+{
+    BlockLatencyHistogram *hist;
+    int lo, hi;
+
+    rcu_read_lock();
+    hist = atomic_rcu_read(&stats->latency_histogram[type]);
+    if (hist) {
+        /* Find the number of boundaries that are <= latency_ns */
+        lo = 0;
+        hi = hist->nbins - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (hist->boundaries[mid] <= latency_ns) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        hist->bins[lo]++;
+    }
+    rcu_read_unlock();
+}
+
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
     BlockAcctTimedStats *s;
@@ -106,6 +148,7 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+    block_latency_histogram_account(stats, cookie->type, latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +172,7 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+        block_latency_histogram_account(stats, cookie->type, latency_ns);
     }
 }
 
@@ -171,3 +215,73 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+static void block_latency_histogram_replace(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogram *old = stats->latency_histogram[type];
+
+    atomic_rcu_set(&stats->latency_histogram[type], hist);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+static BlockLatencyHistogram *block_latency_histogram_new(
+    const uint64_t *boundaries, int nboundaries)
+{
+    BlockLatencyHistogram *hist;
+    int i;
+
+    for (i = 0; i < nboundaries; i++) {
+        assert(boundaries[i] > (i ? boundaries[i - 1] : 0));
+    }
+
+    hist = g_malloc0(sizeof(*hist) +
+                     (2 * nboundaries + 1) * sizeof(hist->boundaries[0]));
+    hist->nbins = nboundaries + 1;
+    hist->bins = hist->boundaries + nboundaries;
+    memcpy(hist->boundaries, boundaries,
+           nboundaries * sizeof(hist->boundaries[0]));
+    return hist;
+}
+
+void block_latency_histogram_set(BlockAcctStats *stats,
+                                 enum BlockAcctType type,
+                                 const uint64_t *boundaries,
+                                 int nboundaries)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    if (!boundaries) {
+        boundaries = default_histogram_boundaries;
+        nboundaries = ARRAY_SIZE(default_histogram_boundaries);
+    }
+    block_latency_histogram_replace(
+        stats, type, block_latency_histogram_new(boundaries, nboundaries));
+}
+
+void block_latency_histogram_reset(BlockAcctStats *stats,
+                                   enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    /* The bins are not zeroed in place, because a concurrent request
+     * could be adding to them.  */
+    hist = stats->latency_histogram[type];
+    if (hist) {
+        block_latency_histogram_replace(
+            stats, type,
+            block_latency_histogram_new(hist->boundaries, hist->nbins - 1));
+    }
+}
+
+void block_latency_histogram_clear(BlockAcctStats *stats,
+                                   enum BlockAcctType type)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+    block_latency_histogram_replace(stats, type, NULL);
+}
@@ -153,6 +153,7 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -440,9 +441,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
     aio = qapi_enum_parse(BlockdevAioOptions_lookup, qemu_opt_get(opts, "aio"),
                           BLOCKDEV_AIO_OPTIONS__MAX, aio_default, &local_err);
     if (local_err) {
@@ -451,6 +456,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
 
     locking = qapi_enum_parse(OnOffAuto_lookup, qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO__MAX, ON_OFF_AUTO_AUTO, &local_err);
@@ -530,6 +536,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring handles both O_DIRECT and buffered I/O */
+    if (s->use_linux_io_uring &&
+        aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp) < 0) {
+        error_prepend(errp, "Unable to use io_uring: ");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (s->use_linux_io_uring) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -1552,16 +1575,20 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_linux_aio) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-            assert(qiov->size == bytes);
-            return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+    } else if (s->needs_alignment && s->use_linux_aio) {
+        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
-        }
     }
 
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
@@ -1584,35 +1611,80 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_io_plug(bs, aio);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_io_unplug(bs, aio);
+    }
+#endif
 }
 
-static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
-        BlockCompletionFunc *cb, void *opaque)
+static void raw_aio_attach_aio_context(BlockDriverState *bs,
+                                       AioContext *new_context)
 {
+#ifdef CONFIG_LINUX_IO_URING
     BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (aio_setup_linux_io_uring(new_context, &local_err) < 0) {
+            error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        }
+    }
+#endif
+}
 
-    if (fd_open(bs) < 0)
-        return NULL;
+static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+        /* Same semantics as handle_aiocb_flush() */
+        if (s->page_cache_inconsistent) {
+            return -EIO;
+        }
+        ret = luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        if (ret < 0 && (s->open_flags & O_DIRECT) == 0) {
+            s->page_cache_inconsistent = true;
+        }
+        return ret;
+    }
+#endif
+    return paio_submit_co(bs, s->fd, 0, NULL, 0, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -2113,14 +2185,82 @@ static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
     return ret | BDRV_BLOCK_OFFSET_VALID | start;
 }
 
-static coroutine_fn BlockAIOCB *raw_aio_pdiscard(BlockDriverState *bs,
-    int64_t offset, int count,
-    BlockCompletionFunc *cb, void *opaque)
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Queue the fallocate() behind a write zeroes or discard request on a regular
+ * file to the io_uring ring.  Returns -ENOTSUP if the request must be handled
+ * by the thread pool instead, e.g. because XFS ioctls are used or the kernel
+ * cannot run fallocate() from the ring.
+ */
+static int coroutine_fn raw_co_luring_fallocate(BlockDriverState *bs,
+                                                int64_t offset, int count,
+                                                int type)
 {
     BDRVRawState *s = bs->opaque;
+    LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    int mode, ret;
 
-    return paio_submit(bs, s->fd, offset, NULL, count,
-                       cb, opaque, QEMU_AIO_DISCARD);
+#ifdef CONFIG_XFS
+    if (s->is_xfs) {
+        return -ENOTSUP;
+    }
+#endif
+
+    switch (type) {
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    case QEMU_AIO_WRITE_ZEROES:
+        if (!s->has_write_zeroes) {
+            return -ENOTSUP;
+        }
+        mode = FALLOC_FL_ZERO_RANGE;
+        break;
+#endif
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    case QEMU_AIO_DISCARD:
+        if (!s->has_discard) {
+            return -ENOTSUP;
+        }
+        mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        break;
+#endif
+    default:
+        return -ENOTSUP;
+    }
+
+    ret = luring_co_fallocate(bs, aio, s->fd, mode, offset, count);
+    if (ret == -ENOTSUP) {
+        /* The ring cannot do fallocate(), not the file system */
+        return ret;
+    }
+
+    ret = translate_err(ret);
+    if (ret == -ENOTSUP) {
+        /* Let the thread pool try the remaining fallbacks */
+        if (type == QEMU_AIO_WRITE_ZEROES) {
+            s->has_write_zeroes = false;
+        } else {
+            s->has_discard = false;
+        }
+    }
+    return ret;
+}
+#endif
+
+static coroutine_fn int raw_co_pdiscard(BlockDriverState *bs,
+                                        int64_t offset, int count)
+{
+    BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        int ret = raw_co_luring_fallocate(bs, offset, count,
+                                          QEMU_AIO_DISCARD);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+    return paio_submit_co(bs, s->fd, offset, NULL, count, QEMU_AIO_DISCARD);
 }
 
 static int coroutine_fn raw_co_pwrite_zeroes(
@@ -2130,11 +2270,19 @@ static int coroutine_fn raw_co_pwrite_zeroes(
     BDRVRawState *s = bs->opaque;
 
     if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_linux_io_uring) {
+            int ret = raw_co_luring_fallocate(bs, offset, count,
+                                              QEMU_AIO_WRITE_ZEROES);
+            if (ret != -ENOTSUP) {
+                return ret;
+            }
+        }
+#endif
         return paio_submit_co(bs, s->fd, offset, NULL, count,
                               QEMU_AIO_WRITE_ZEROES);
     } else if (s->discard_zeroes) {
-        return paio_submit_co(bs, s->fd, offset, NULL, count,
-                              QEMU_AIO_DISCARD);
+        return raw_co_pdiscard(bs, offset, count);
     }
     return -ENOTSUP;
 }
@@ -2209,11 +2357,12 @@ BlockDriver bdrv_file = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush = raw_aio_flush,
-    .bdrv_aio_pdiscard = raw_aio_pdiscard,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
+    .bdrv_co_pdiscard = raw_co_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -2670,11 +2819,12 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_aio_pdiscard   = hdev_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -2795,10 +2945,11 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -2925,10 +3076,11 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
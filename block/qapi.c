@@ -357,6 +357,38 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockLatencyHistogramInfo *info;
+    BlockLatencyHistogram *hist;
+    uint64List **boundaries, **bins;
+    int i;
+
+    rcu_read_lock();
+    hist = atomic_rcu_read(&stats->latency_histogram[type]);
+    if (!hist) {
+        rcu_read_unlock();
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries = &info->boundaries;
+    bins = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+    }
+    rcu_read_unlock();
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -391,6 +423,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    ds->rd_latency_histogram =
+        bdrv_latency_histogram_info(stats, BLOCK_ACCT_READ);
+    ds->has_rd_latency_histogram = ds->rd_latency_histogram != NULL;
+    ds->wr_latency_histogram =
+        bdrv_latency_histogram_info(stats, BLOCK_ACCT_WRITE);
+    ds->has_wr_latency_histogram = ds->wr_latency_histogram != NULL;
+    ds->flush_latency_histogram =
+        bdrv_latency_histogram_info(stats, BLOCK_ACCT_FLUSH);
+    ds->has_flush_latency_histogram = ds->flush_latency_histogram != NULL;
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -424,7 +466,7 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     }
 }
 
-static BlockStats *bdrv_query_bds_stats(const BlockDriverState *bs,
+static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
                                  bool query_backing)
 {
     BlockStats *s = NULL;
@@ -443,6 +485,11 @@ static BlockStats *bdrv_query_bds_stats(const BlockDriverState *bs,
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    if (s->driver_specific) {
+        s->has_driver_specific = true;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, query_backing);
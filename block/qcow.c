@@ -930,8 +930,8 @@ static int qcow_make_empty(BlockDriverState *bs)
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
-qcow_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
-                           uint64_t bytes, QEMUIOVector *qiov)
+qcow_co_pwrite_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes, QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
     QEMUIOVector hd_qiov;
@@ -1016,6 +1016,37 @@ fail:
     return ret;
 }
 
+static coroutine_fn int
+qcow_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
+                           uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    QEMUIOVector cluster_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    if (offset & (s->cluster_size - 1)) {
+        return -EINVAL;
+    }
+
+    qemu_iovec_init(&cluster_qiov, qiov->niov);
+    while (bytes_done < bytes) {
+        uint64_t cur_bytes = MIN(bytes - bytes_done, s->cluster_size);
+
+        qemu_iovec_reset(&cluster_qiov);
+        qemu_iovec_concat(&cluster_qiov, qiov, bytes_done, cur_bytes);
+        ret = qcow_co_pwrite_compressed_cluster(bs, offset + bytes_done,
+                                                cur_bytes, &cluster_qiov);
+        if (ret < 0) {
+            break;
+        }
+        bytes_done += cur_bytes;
+    }
+    qemu_iovec_destroy(&cluster_qiov);
+
+    return ret;
+}
+
 static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
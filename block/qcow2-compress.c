@@ -0,0 +1,253 @@
+/*
+ * Cluster compression for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qcow2.h"
+
+/*
+ * The compression functions return the compressed size, -ENOMEM if the
+ * result does not fit in dest_size bytes, or -EIO on any other error.
+ * They only touch their arguments and may be called from any thread.
+ */
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR) ? -ENOMEM : -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static int qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                 const void *src, size_t src_size)
+{
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled,
+         * but @src buffer may be processed partly (because of the sector
+         * padding after the compressed data) */
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    ZSTD_outBuffer output = { .dst = dest, .size = dest_size, .pos = 0 };
+    ZSTD_inBuffer input = { .src = src, .size = src_size, .pos = 0 };
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    size_t zstd_ret;
+    ssize_t ret;
+
+    if (!cctx) {
+        return -EIO;
+    }
+
+    do {
+        zstd_ret = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(zstd_ret)) {
+            ret = ZSTD_getErrorCode(zstd_ret) == ZSTD_error_dstSize_tooSmall
+                  ? -ENOMEM : -EIO;
+            goto out;
+        }
+        /* More to flush, but no room left */
+        if (zstd_ret && output.pos == output.size) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    } while (zstd_ret);
+
+    ret = output.pos;
+
+out:
+    ZSTD_freeCCtx(cctx);
+    return ret;
+}
+
+static int qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                 const void *src, size_t src_size)
+{
+    ZSTD_outBuffer output = { .dst = dest, .size = dest_size, .pos = 0 };
+    ZSTD_inBuffer input = { .src = src, .size = src_size, .pos = 0 };
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    size_t zstd_ret;
+    int ret = 0;
+
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /* As with zlib, @src may be followed by the sector padding, so stop as
+     * soon as @dest is full instead of looking for the end of the input */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret)) {
+            ret = -EIO;
+            break;
+        }
+        /* The frame ended early, or the input is truncated */
+        if ((zstd_ret == 0 && output.pos < output.size) ||
+            (input.pos == last_in_pos && output.pos == last_out_pos)) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+#endif
+
+static Qcow2CompressFunc *qcow2_compress_func(BDRVQcow2State *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_compress;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_compress;
+#endif
+    default:
+        /* Rejected when opening the image */
+        abort();
+    }
+}
+
+int qcow2_decompress(BDRVQcow2State *s, void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress(dest, dest_size, src, src_size);
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress(dest, dest_size, src, src_size);
+#endif
+    default:
+        abort();
+    }
+}
+
+typedef struct Qcow2CompressData {
+    Qcow2CompressFunc *func;
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Compresses @src into @dest in a worker thread, so that several clusters
+ * can be compressed at the same time while the coroutine that submitted
+ * them keeps the AioContext free for I/O.
+ *
+ * Returns the compressed size, -ENOMEM if it would not fit in @dest_size
+ * bytes, or another negative errno value on error.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData data = {
+        .func       = qcow2_compress_func(s),
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    while (s->nb_compress_threads >= QCOW2_MAX_COMPRESS_THREADS) {
+        qemu_co_queue_wait(&s->compress_wait_queue, NULL);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_wait_queue);
+
+    return data.ret;
+}
@@ -928,6 +928,78 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocates up to *nb_clusters contiguous clusters for guest data, starting at
+ * offset unless that is 0.  The clusters are taken from a reservation whose
+ * refcounts are increased in one go, so that most allocations need not touch
+ * the refcount blocks.
+ *
+ * On success, *nb_clusters is set to the number of clusters allocated.  This
+ * is 0 if offset is given and the cluster there is in use.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t n = *nb_clusters;
+    int64_t ret;
+
+    assert(n > 0);
+
+    if (offset && s->reserved_clusters && offset != s->reserved_offset) {
+        /* The reservation does not extend this allocation */
+        ret = qcow2_alloc_clusters_at(bs, offset, n);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (!s->reserved_clusters) {
+        uint64_t count = MAX(n, s->alloc_reserve);
+
+        if (offset) {
+            ret = qcow2_alloc_clusters_at(bs, offset, count);
+            if (ret <= 0) {
+                *nb_clusters = 0;
+                return ret < 0 ? ret : offset;
+            }
+            count = ret;
+        } else {
+            ret = qcow2_alloc_clusters(bs, count << s->cluster_bits);
+            if (ret < 0) {
+                return ret;
+            }
+            offset = ret;
+        }
+        s->reserved_offset = offset;
+        s->reserved_clusters = count;
+    }
+
+    offset = s->reserved_offset;
+    n = MIN(n, s->reserved_clusters);
+    s->reserved_offset += n << s->cluster_bits;
+    s->reserved_clusters -= n;
+
+    *nb_clusters = n;
+    return offset;
+}
+
+/* Frees the clusters that qcow2_alloc_data_clusters() has reserved but not
+ * handed out yet */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->reserved_clusters) {
+        qcow2_free_clusters(bs, s->reserved_offset,
+                            s->reserved_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->reserved_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1058,17 +1130,20 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, entry, l1_size2, refcount;
+    uint64_t *l1_table, *l2_slice, l2_offset, entry, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_entry, old_l2_offset;
+    unsigned slice, slice_size2, n_slices;
     int i, j, l1_modified = 0, nb_csectors;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_table = NULL;
+    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1111,91 +1186,95 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_slice);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for (j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-                uint64_t offset;
-
-                entry = be64_to_cpu(l2_table[j]);
-                old_entry = entry;
-                entry &= ~QCOW_OFLAG_COPIED;
-                offset = entry & L2E_OFFSET_MASK;
-
-                switch (qcow2_get_cluster_type(entry)) {
-                case QCOW2_CLUSTER_COMPRESSED:
-                    nb_csectors = ((entry >> s->csize_shift) &
-                                   s->csize_mask) + 1;
-                    if (addend != 0) {
-                        ret = update_refcount(bs,
-                                (entry & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                        if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+                    uint64_t offset;
+
+                    entry = get_l2_entry(s, l2_slice, j);
+                    old_entry = entry;
+                    entry &= ~QCOW_OFLAG_COPIED;
+                    offset = entry & L2E_OFFSET_MASK;
+
+                    switch (qcow2_get_cluster_type(entry)) {
+                    case QCOW2_CLUSTER_COMPRESSED:
+                        nb_csectors = ((entry >> s->csize_shift) &
+                                       s->csize_mask) + 1;
+                        if (addend != 0) {
+                            ret = update_refcount(bs,
+                                    (entry & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                            if (ret < 0) {
+                                goto fail;
+                            }
+                        }
+                        /* compressed clusters are never modified */
+                        refcount = 2;
+                        break;
+
+                    case QCOW2_CLUSTER_NORMAL:
+                    case QCOW2_CLUSTER_ZERO_ALLOC:
+                        if (offset_into_cluster(s, offset)) {
+                            int l2_index = slice * s->l2_slice_size + j;
+                            qcow2_signal_corruption(
+                                bs, true, -1, -1, "Cluster allocation offset "
+                                "%#" PRIx64 " unaligned (L2 offset: %#"
+                                PRIx64 ", L2 index: %#x)",
+                                offset, l2_offset, l2_index);
+                            ret = -EIO;
                             goto fail;
                         }
-                    }
-                    /* compressed clusters are never modified */
-                    refcount = 2;
-                    break;
-
-                case QCOW2_CLUSTER_NORMAL:
-                case QCOW2_CLUSTER_ZERO_ALLOC:
-                    if (offset_into_cluster(s, offset)) {
-                        qcow2_signal_corruption(bs, true, -1, -1, "Cluster "
-                                                "allocation offset %#" PRIx64
-                                                " unaligned (L2 offset: %#"
-                                                PRIx64 ", L2 index: %#x)",
-                                                offset, l2_offset, j);
-                        ret = -EIO;
-                        goto fail;
-                    }
 
-                    cluster_index = offset >> s->cluster_bits;
-                    assert(cluster_index);
-                    if (addend != 0) {
-                        ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                        cluster_index = offset >> s->cluster_bits;
+                        assert(cluster_index);
+                        if (addend != 0) {
+                            ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                            if (ret < 0) {
+                                goto fail;
+                            }
+                        }
+
+                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
                         if (ret < 0) {
                             goto fail;
                         }
-                    }
-
-                    ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                    if (ret < 0) {
-                        goto fail;
-                    }
-                    break;
+                        break;
 
-                case QCOW2_CLUSTER_ZERO_PLAIN:
-                case QCOW2_CLUSTER_UNALLOCATED:
-                    refcount = 0;
-                    break;
+                    case QCOW2_CLUSTER_ZERO_PLAIN:
+                    case QCOW2_CLUSTER_UNALLOCATED:
+                        refcount = 0;
+                        break;
 
-                default:
-                    abort();
-                }
+                    default:
+                        abort();
+                    }
 
-                if (refcount == 1) {
-                    entry |= QCOW_OFLAG_COPIED;
-                }
-                if (entry != old_entry) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        entry |= QCOW_OFLAG_COPIED;
+                    }
+                    if (entry != old_entry) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        set_l2_entry(s, l2_slice, j, entry);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_slice);
                     }
-                    l2_table[j] = cpu_to_be64(entry);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1222,8 +1301,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     }
 
     s->cache_discards = false;
@@ -1372,6 +1451,146 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Number of L2 tables that are read in parallel while checking an image */
+#define CHECK_L2_COROUTINES 16
+
+/* Progress of qcow2_check_refcounts(), counted in L1 table entries */
+typedef struct CheckProgress {
+    BlockDriverAmendStatusCB *status_cb;
+    void *cb_opaque;
+    int64_t done;
+    int64_t total;
+} CheckProgress;
+
+static void check_progress(BlockDriverState *bs, CheckProgress *progress,
+                           int64_t done)
+{
+    if (progress->status_cb && progress->total) {
+        progress->status_cb(bs, done, progress->total, progress->cb_opaque);
+    }
+}
+
+typedef struct L2TableWalk L2TableWalk;
+
+/*
+ * Called for each non-zero L1 entry.  l2_table contains
+ * the L2 table in on-disk byte order, unless reading it failed, in which case
+ * read_ret is the (negative) return value of bdrv_pread().
+ *
+ * Returns 0 to continue the walk, or -errno to stop it.
+ */
+typedef int coroutine_fn L2TableWalkFunc(L2TableWalk *w, int l1_index,
+                                         uint64_t *l2_table, int read_ret);
+
+/*
+ * Walks the L2 tables referenced by an L1 table.  Up to CHECK_L2_COROUTINES
+ * L2 tables are read in parallel, but func is called for one L1 entry at a
+ * time and in the order of the L1 table, so it observes exactly what a
+ * sequential loop would.
+ */
+struct L2TableWalk {
+    BlockDriverState *bs;
+    BdrvCheckResult *res;
+    CheckProgress *progress;
+    const uint64_t *l1_table;       /* in CPU byte order */
+    int l1_size;
+    L2TableWalkFunc *func;
+    void *opaque;
+
+    /* func must increment this whenever it writes to the image file, so that
+     * L2 tables which have been read before are read again */
+    unsigned write_gen;
+
+    int next_read;
+    int next_func;
+    CoQueue turn;
+    int running_coroutines;
+    Coroutine *caller;
+    int ret;
+};
+
+/* Returns the first L1 index >= i with a non-zero entry */
+static int l2_table_walk_next(L2TableWalk *w, int i)
+{
+    while (i < w->l1_size && !w->l1_table[i]) {
+        i++;
+    }
+    return i;
+}
+
+static void coroutine_fn l2_table_walk_co(void *opaque)
+{
+    L2TableWalk *w = opaque;
+    BDRVQcow2State *s = w->bs->opaque;
+    int l2_size = s->l2_size * l2_entry_size(s);
+    uint64_t *l2_table = qemu_blockalign(w->bs, l2_size);
+
+    while (w->ret == 0 && w->next_read < w->l1_size) {
+        int l1_index = w->next_read;
+        uint64_t l2_offset = w->l1_table[l1_index] & L1E_OFFSET_MASK;
+        unsigned write_gen = w->write_gen;
+        int read_ret;
+
+        w->next_read = l2_table_walk_next(w, l1_index + 1);
+        read_ret = bdrv_pread(w->bs->file, l2_offset, l2_table, l2_size);
+
+        while (w->next_func != l1_index) {
+            qemu_co_queue_wait(&w->turn, NULL);
+        }
+
+        if (w->ret == 0) {
+            if (read_ret >= 0 && write_gen != w->write_gen) {
+                read_ret = bdrv_pread(w->bs->file, l2_offset, l2_table,
+                                      l2_size);
+            }
+            w->ret = w->func(w, l1_index, l2_table, read_ret);
+            check_progress(w->bs, w->progress,
+                           w->progress->done + l1_index + 1);
+        }
+
+        w->next_func = l2_table_walk_next(w, l1_index + 1);
+        qemu_co_queue_restart_all(&w->turn);
+    }
+
+    qemu_vfree(l2_table);
+    w->running_coroutines--;
+    if (!w->running_coroutines && w->caller) {
+        aio_co_wake(w->caller);
+    }
+}
+
+static int l2_table_walk(L2TableWalk *w)
+{
+    int i;
+
+    qemu_co_queue_init(&w->turn);
+    w->next_read = w->next_func = l2_table_walk_next(w, 0);
+    w->running_coroutines = 0;
+    w->caller = NULL;
+    w->ret = 0;
+
+    for (i = 0; i < CHECK_L2_COROUTINES; i++) {
+        Coroutine *co = qemu_coroutine_create(l2_table_walk_co, w);
+        w->running_coroutines++;
+        bdrv_coroutine_enter(w->bs, co);
+    }
+
+    if (qemu_in_coroutine()) {
+        while (w->running_coroutines) {
+            w->caller = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            w->caller = NULL;
+        }
+    } else {
+        BDRV_POLL_WHILE(w->bs->file->bs, w->running_coroutines > 0);
+    }
+
+    w->progress->done += w->l1_size;
+    check_progress(w->bs, w->progress, w->progress->done);
+
+    return w->ret;
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
@@ -1383,27 +1602,26 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+                              uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        if (has_subclusters(s) &&
+            qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, 0) ==
+            QCOW2_SUBCLUSTER_INVALID) {
+            fprintf(stderr, "ERROR: invalid L2 entry %#" PRIx64 " with "
+                    "subcluster bitmap %#" PRIx64 " (L2 offset %#" PRIx64
+                    ", L2 index %#x)\n", l2_entry, l2_bitmap, l2_offset, i);
+            res->corruptions++;
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1478,12 +1696,48 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+typedef struct CheckRefcountsL1 {
+    void **refcount_table;
+    int64_t *refcount_table_size;
+    int flags;
+} CheckRefcountsL1;
+
+static int coroutine_fn check_refcounts_l1_entry(L2TableWalk *w, int l1_index,
+                                                 uint64_t *l2_table,
+                                                 int read_ret)
+{
+    BDRVQcow2State *s = w->bs->opaque;
+    CheckRefcountsL1 *c = w->opaque;
+    uint64_t l2_offset = w->l1_table[l1_index] & L1E_OFFSET_MASK;
+    int ret;
+
+    /* Mark L2 table as used */
+    ret = inc_refcounts(w->bs, w->res, c->refcount_table,
+                        c->refcount_table_size, l2_offset, s->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* L2 tables are cluster aligned */
+    if (offset_into_cluster(s, l2_offset)) {
+        fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+            "cluster aligned; L1 entry corrupted\n", l2_offset);
+        w->res->corruptions++;
+    }
+
+    if (read_ret < 0) {
+        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+        w->res->check_errors++;
+        return read_ret;
+    }
+
+    /* Process and check L2 entries */
+    return check_refcounts_l2(w->bs, w->res, c->refcount_table,
+                              c->refcount_table_size, l2_offset, l2_table,
+                              c->flags);
 }
 
 /*
@@ -1499,10 +1753,22 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags)
+                              int flags, CheckProgress *progress)
 {
-    BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table = NULL, l2_offset, l1_size2;
+    uint64_t *l1_table = NULL, l1_size2;
+    CheckRefcountsL1 c = {
+        .refcount_table         = refcount_table,
+        .refcount_table_size    = refcount_table_size,
+        .flags                  = flags,
+    };
+    L2TableWalk w = {
+        .bs         = bs,
+        .res        = res,
+        .progress   = progress,
+        .l1_size    = l1_size,
+        .func       = check_refcounts_l1_entry,
+        .opaque     = &c,
+    };
     int i, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -1533,32 +1799,12 @@ static int check_refcounts_l1(BlockDriverState *bs,
     }
 
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
-
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
-                goto fail;
-            }
-        }
+    w.l1_table = l1_table;
+    ret = l2_table_walk(&w);
+    if (ret < 0) {
+        goto fail;
     }
+
     g_free(l1_table);
     return 0;
 
@@ -1575,119 +1821,140 @@ fail:
  * have been already detected and sufficiently signaled by the calling function
  * (qcow2_check_refcounts) by the time this function is called).
  */
-static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
-                              BdrvCheckMode fix)
+static int coroutine_fn check_oflag_copied_l1_entry(L2TableWalk *w,
+                                                    int l1_index,
+                                                    uint64_t *l2_table,
+                                                    int read_ret)
 {
+    BlockDriverState *bs = w->bs;
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
-    int ret;
+    BdrvCheckResult *res = w->res;
+    BdrvCheckMode fix = *(BdrvCheckMode *)w->opaque;
+    uint64_t l1_entry = s->l1_table[l1_index];
+    uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
+    bool l2_dirty = false;
     uint64_t refcount;
-    int i, j;
-
-    for (i = 0; i < s->l1_size; i++) {
-        uint64_t l1_entry = s->l1_table[i];
-        uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
+    int ret, j;
 
-        if (!l2_offset) {
-            continue;
-        }
+    if (!l2_offset) {
+        return 0;
+    }
 
-        ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                 &refcount);
-        if (ret < 0) {
-            /* don't print message nor increment check_errors */
-            continue;
-        }
-        if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
-            fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
-                    "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                    fix & BDRV_FIX_ERRORS ? "Repairing" :
-                                            "ERROR",
-                    i, l1_entry, refcount);
-            if (fix & BDRV_FIX_ERRORS) {
-                s->l1_table[i] = refcount == 1
-                               ? l1_entry |  QCOW_OFLAG_COPIED
-                               : l1_entry & ~QCOW_OFLAG_COPIED;
-                ret = qcow2_write_l1_entry(bs, i);
-                if (ret < 0) {
-                    res->check_errors++;
-                    goto fail;
-                }
-                res->corruptions_fixed++;
-            } else {
-                res->corruptions++;
+    ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                             &refcount);
+    if (ret < 0) {
+        /* don't print message nor increment check_errors */
+        return 0;
+    }
+    if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
+        fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
+                "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                fix & BDRV_FIX_ERRORS ? "Repairing" :
+                                        "ERROR",
+                l1_index, l1_entry, refcount);
+        if (fix & BDRV_FIX_ERRORS) {
+            s->l1_table[l1_index] = refcount == 1
+                                  ? l1_entry |  QCOW_OFLAG_COPIED
+                                  : l1_entry & ~QCOW_OFLAG_COPIED;
+            w->write_gen++;
+            ret = qcow2_write_l1_entry(bs, l1_index);
+            if (ret < 0) {
+                res->check_errors++;
+                return ret;
             }
+            res->corruptions_fixed++;
+        } else {
+            res->corruptions++;
         }
+    }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
-        if (ret < 0) {
-            fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
-                    strerror(-ret));
-            res->check_errors++;
-            goto fail;
-        }
+    if (read_ret < 0) {
+        fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
+                strerror(-read_ret));
+        res->check_errors++;
+        return read_ret;
+    }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
-            QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
+    for (j = 0; j < s->l2_size; j++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+        uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
+        QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
 
-            if (cluster_type == QCOW2_CLUSTER_NORMAL ||
-                cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) {
-                ret = qcow2_get_refcount(bs,
-                                         data_offset >> s->cluster_bits,
-                                         &refcount);
-                if (ret < 0) {
-                    /* don't print message nor increment check_errors */
-                    continue;
-                }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
-                    fprintf(stderr, "%s OFLAG_COPIED data cluster: "
-                            "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                            fix & BDRV_FIX_ERRORS ? "Repairing" :
-                                                    "ERROR",
-                            l2_entry, refcount);
-                    if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
-                        l2_dirty = true;
-                        res->corruptions_fixed++;
-                    } else {
-                        res->corruptions++;
-                    }
+        if (cluster_type == QCOW2_CLUSTER_NORMAL ||
+            cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) {
+            ret = qcow2_get_refcount(bs,
+                                     data_offset >> s->cluster_bits,
+                                     &refcount);
+            if (ret < 0) {
+                /* don't print message nor increment check_errors */
+                continue;
+            }
+            if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
+                fprintf(stderr, "%s OFLAG_COPIED data cluster: "
+                        "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                        fix & BDRV_FIX_ERRORS ? "Repairing" :
+                                                "ERROR",
+                        l2_entry, refcount);
+                if (fix & BDRV_FIX_ERRORS) {
+                    set_l2_entry(s, l2_table, j, refcount == 1
+                                 ? l2_entry |  QCOW_OFLAG_COPIED
+                                 : l2_entry & ~QCOW_OFLAG_COPIED);
+                    l2_dirty = true;
+                    res->corruptions_fixed++;
+                } else {
+                    res->corruptions++;
                 }
             }
         }
+    }
 
-        if (l2_dirty) {
-            ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                                                l2_offset, s->cluster_size);
-            if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table; metadata "
-                        "overlap check failed: %s\n", strerror(-ret));
-                res->check_errors++;
-                goto fail;
-            }
+    if (l2_dirty) {
+        ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
+                                            l2_offset, s->cluster_size);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write L2 table; metadata "
+                    "overlap check failed: %s\n", strerror(-ret));
+            res->check_errors++;
+            return ret;
+        }
 
-            ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
-                              s->cluster_size);
-            if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
-                        strerror(-ret));
-                res->check_errors++;
-                goto fail;
-            }
+        w->write_gen++;
+        ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
+                          s->cluster_size);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
+                    strerror(-ret));
+            res->check_errors++;
+            return ret;
         }
     }
 
-    ret = 0;
+    return 0;
+}
 
-fail:
-    qemu_vfree(l2_table);
-    return ret;
+/*
+ * Checks the OFLAG_COPIED flag for all L1 and L2 entries.
+ *
+ * This function does not print an error message nor does it increment
+ * check_errors if qcow2_get_refcount fails (this is because such an error will
+ * have been already detected and sufficiently signaled by the calling function
+ * (qcow2_check_refcounts) by the time this function is called).
+ */
+static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
+                              BdrvCheckMode fix, CheckProgress *progress)
+{
+    BDRVQcow2State *s = bs->opaque;
+    L2TableWalk w = {
+        .bs         = bs,
+        .res        = res,
+        .progress   = progress,
+        .l1_table   = s->l1_table,
+        .l1_size    = s->l1_size,
+        .func       = check_oflag_copied_l1_entry,
+        .opaque     = &fix,
+    };
+
+    return l2_table_walk(&w);
 }
 
 /*
@@ -1797,12 +2064,28 @@ resize_fail:
     return 0;
 }
 
+/*
+ * Returns the work done by calculate_refcounts() in the units of
+ * CheckProgress.
+ */
+static int64_t calculate_refcounts_work(BDRVQcow2State *s)
+{
+    int64_t work = s->l1_size;
+    int i;
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        work += s->snapshots[i].l1_size;
+    }
+    return work;
+}
+
 /*
  * Calculates an in-memory refcount table.
  */
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
-                               void **refcount_table, int64_t *nb_clusters)
+                               void **refcount_table, int64_t *nb_clusters,
+                               CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -1828,7 +2111,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
+                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
+                             progress);
     if (ret < 0) {
         return ret;
     }
@@ -1837,7 +2121,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     for (i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                                 sn->l1_table_offset, sn->l1_size, 0);
+                                 sn->l1_table_offset, sn->l1_size, 0,
+                                 progress);
         if (ret < 0) {
             return ret;
         }
@@ -2196,13 +2481,25 @@ fail:
 /*
  * Checks an image for refcount consistency.
  *
+ * L2 tables are read in parallel, but they are checked in the same order as
+ * they appear in the L1 tables, so messages and repairs do not depend on the
+ * timing of the reads.  If status_cb is not NULL, it is called to report the
+ * progress of the check.
+ *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix)
+                          BdrvCheckMode fix,
+                          BlockDriverAmendStatusCB *status_cb,
+                          void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
+    CheckProgress progress = {
+        .status_cb  = status_cb,
+        .cb_opaque  = cb_opaque,
+        .total      = calculate_refcounts_work(s) + s->l1_size,
+    };
     BdrvCheckResult pre_compare_res;
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
@@ -2225,7 +2522,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, &progress);
     if (ret < 0) {
         goto fail;
     }
@@ -2255,8 +2552,9 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
          * references have to be recalculated */
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
+        progress.total += calculate_refcounts_work(s);
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, &progress);
         if (ret < 0) {
             goto fail;
         }
@@ -2305,7 +2603,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* check OFLAG_COPIED */
-    ret = check_oflag_copied(bs, res, fix);
+    ret = check_oflag_copied(bs, res, fix, &progress);
     if (ret < 0) {
         goto fail;
     }
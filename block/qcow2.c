@@ -25,7 +25,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -320,9 +319,10 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 }
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
-                       BdrvCheckMode fix)
+                       BdrvCheckMode fix,
+                       BlockDriverAmendStatusCB *status_cb, void *cb_opaque)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret = qcow2_check_refcounts(bs, result, fix, status_cb, cb_opaque);
     if (ret < 0) {
         return ret;
     }
@@ -456,11 +456,21 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_RESERVE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve clusters for guest data in batches of this size",
+        },
         { /* end of list */ }
     },
 };
@@ -521,6 +531,7 @@ static void qcow2_attach_aio_context(BlockDriverState *bs,
 
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_entry_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -536,6 +547,18 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
 
+    *l2_cache_entry_size = qemu_opt_get_size(
+        opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE, s->cluster_size);
+
+    if (*l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        *l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(*l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        return;
+    }
+
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
             error_setg(errp, QCOW2_OPT_CACHE_SIZE ", " QCOW2_OPT_L2_CACHE_SIZE
@@ -581,10 +604,12 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t alloc_reserve;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -596,7 +621,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -610,15 +635,15 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* get L2 table/refcount block cache size from command line options */
-    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
-                     &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &l2_cache_entry_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -638,6 +663,18 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->alloc_reserve = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_RESERVE,
+                                         DEFAULT_ALLOC_RESERVE_BYTE_SIZE);
+    r->alloc_reserve = DIV_ROUND_UP(r->alloc_reserve, s->cluster_size);
+    if (r->alloc_reserve > INT_MAX) {
+        error_setg(errp, "Allocation reserve too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* the reserved clusters are freed through the old refcount cache */
+    qcow2_release_reserved_clusters(bs);
+
     /* alloc new L2 table/refcount block cache, flush old one */
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -656,8 +693,11 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -772,9 +812,11 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->alloc_reserve = r->alloc_reserve;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -897,6 +939,11 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* The compression type was added after the other version 3 fields */
+    if (header.header_length <= offsetof(QCowHeader, compression_type)) {
+        header.compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+
     if (header.header_length > sizeof(header)) {
         s->unknown_header_fields_size = header.header_length - sizeof(header);
         s->unknown_header_fields = g_malloc(s->unknown_header_fields_size);
@@ -992,7 +1039,40 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (header.compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "qcow2: Compression type %d does not match the "
+                   "compression type feature bit", header.compression_type);
+        ret = -EINVAL;
+        goto fail;
+    }
+    switch (header.compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+        s->compression_type = header.compression_type;
+        break;
+    default:
+        error_setg(errp, "qcow2: Unsupported compression type %d",
+                   header.compression_type);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
+    if (has_subclusters(s) && s->cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries require a cluster size of at "
+                   "least %d bytes", 1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1163,6 +1243,7 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_wait_queue);
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
 
     /* Repair image if dirty */
@@ -1170,7 +1251,8 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
-        ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS,
+                          NULL, NULL);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not repair dirty image");
             goto fail;
@@ -1180,7 +1262,7 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
+        qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
     return ret;
@@ -1724,6 +1806,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
 
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -1866,7 +1950,14 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    /* Images using zlib keep the shorter header unless there are unknown
+     * fields to preserve after the compression type */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !s->unknown_header_fields_size) {
+        header_length = offsetof(QCowHeader, compression_type);
+    } else {
+        header_length = sizeof(*header) + s->unknown_header_fields_size;
+    }
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -1892,6 +1983,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -1900,7 +1992,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = header_length - s->unknown_header_fields_size;
         break;
     default:
         ret = -EINVAL;
@@ -1950,6 +2042,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2100,7 +2202,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         Qcow2CompressionType compression_type, Error **errp)
 {
     int cluster_bits;
     QDict *options;
@@ -2115,6 +2217,14 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         return -EINVAL;
     }
 
+    if ((flags & BLOCK_FLAG_EXTL2) &&
+        cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries are only supported with cluster "
+                   "sizes of at least %d bytes",
+                   1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+        return -EINVAL;
+    }
+
     /*
      * Open the image file and write a minimal qcow2 header.
      *
@@ -2145,6 +2255,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         int refblock_bits, refblock_size;
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
+        /* L2 entry size in bytes */
+        size_t l2es = (flags & BLOCK_FLAG_EXTL2) ? 2 * sizeof(uint64_t)
+                                                 : sizeof(uint64_t);
 
         /* see qcow2_open() */
         refblock_bits = cluster_bits - (refcount_order - 3);
@@ -2155,11 +2268,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2es);
+        meta_size += nl2e * l2es;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2es / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2227,8 +2340,17 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         .header_length              = cpu_to_be32(sizeof(*header)),
+        .compression_type           = compression_type,
     };
 
+    if (compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->header_length =
+            cpu_to_be32(offsetof(QCowHeader, compression_type));
+    } else {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    }
+
     if (flags & BLOCK_FLAG_ENCRYPT) {
         header->crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
@@ -2240,6 +2362,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header->incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
     if (ret < 0) {
@@ -2358,6 +2484,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    Qcow2CompressionType compression_type;
     Error *local_err = NULL;
     int ret;
 
@@ -2398,6 +2525,29 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTL2;
+    }
+
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE__MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+#ifndef CONFIG_ZSTD
+    if (compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "zstd compression is not supported by this build");
+        ret = -ENOTSUP;
+        goto finish;
+    }
+#endif
+
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
                    "the same time");
@@ -2412,6 +2562,22 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_EXTL2)) {
+        error_setg(errp, "Extended L2 entries only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib are only "
+                   "supported with compatibility level 1.1 and above (use "
+                   "compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2433,7 +2599,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, &local_err);
     error_propagate(errp, local_err);
 
 finish:
@@ -2499,9 +2665,11 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         count = s->cluster_size;
         nr = s->cluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
-        if (ret != QCOW2_CLUSTER_UNALLOCATED &&
-            ret != QCOW2_CLUSTER_ZERO_PLAIN &&
-            ret != QCOW2_CLUSTER_ZERO_ALLOC) {
+        /* With subclusters, the whole cluster must have the same type */
+        if ((ret != QCOW2_CLUSTER_UNALLOCATED &&
+             ret != QCOW2_CLUSTER_ZERO_PLAIN &&
+             ret != QCOW2_CLUSTER_ZERO_ALLOC) ||
+            (has_subclusters(s) && nr != s->cluster_size)) {
             qemu_co_mutex_unlock(&s->lock);
             return -ENOTSUP;
         }
@@ -2584,74 +2752,45 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset, Error **errp)
     return 0;
 }
 
+typedef struct Qcow2CompressedWrite {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+
+    int nb_clusters;
+    int next_cluster;   /* next cluster to be compressed */
+    int next_write;     /* the only cluster that may be written now */
+    CoQueue turn;
+
+    int running_workers;
+    Coroutine *caller;
+    int ret;
+} Qcow2CompressedWrite;
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static coroutine_fn int
-qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
-                            uint64_t bytes, QEMUIOVector *qiov)
+static int coroutine_fn
+qcow2_co_pwrite_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t bytes, uint8_t *buf,
+                                   uint8_t *out_buf, ssize_t out_len)
 {
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector hd_qiov;
     struct iovec iov;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    int ret;
 
-    if (bytes == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file->bs);
-        return bdrv_truncate(bs->file, cluster_offset, NULL);
-    }
-
-    buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes != s->cluster_size) {
-        if (bytes > s->cluster_size ||
-            offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS)
-        {
-            qemu_vfree(buf);
-            return -EINVAL;
-        }
-        /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
-    }
-    qemu_iovec_to_buf(qiov, 0, buf, bytes);
-
-    out_buf = g_malloc(s->cluster_size);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
-        if (ret < 0) {
-            goto fail;
-        }
-        goto success;
+        iov = (struct iovec) {
+            .iov_base   = buf,
+            .iov_len    = bytes,
+        };
+        qemu_iovec_init_external(&hd_qiov, &iov, 1);
+        return qcow2_co_pwritev(bs, offset, bytes, &hd_qiov, 0);
+    } else if (out_len < 0) {
+        return out_len;
     }
 
     qemu_co_mutex_lock(&s->lock);
@@ -2659,15 +2798,14 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
         qcow2_alloc_compressed_cluster_offset(bs, offset, out_len);
     if (!cluster_offset) {
         qemu_co_mutex_unlock(&s->lock);
-        ret = -EIO;
-        goto fail;
+        return -EIO;
     }
     cluster_offset &= s->cluster_offset_mask;
 
     ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
     qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
-        goto fail;
+        return ret;
     }
 
     iov = (struct iovec) {
@@ -2677,16 +2815,105 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     qemu_iovec_init_external(&hd_qiov, &iov, 1);
 
     BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwritev(bs->file, cluster_offset, out_len, &hd_qiov, 0);
-    if (ret < 0) {
-        goto fail;
+    return bdrv_co_pwritev(bs->file, cluster_offset, out_len, &hd_qiov, 0);
+}
+
+/*
+ * Compresses the clusters of a request in the thread pool, several at a time,
+ * and writes them in order so that the compressed clusters are laid out in
+ * the image file the same way as with one cluster per request.
+ */
+static void coroutine_fn qcow2_compressed_write_co(void *opaque)
+{
+    Qcow2CompressedWrite *w = opaque;
+    BlockDriverState *bs = w->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *buf = qemu_blockalign(bs, s->cluster_size);
+    uint8_t *out_buf = g_malloc(s->cluster_size);
+
+    while (w->ret == 0 && w->next_cluster < w->nb_clusters) {
+        int i = w->next_cluster++;
+        uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+        uint64_t cluster_bytes = MIN(s->cluster_size, w->bytes - cluster_start);
+        ssize_t out_len;
+
+        qemu_iovec_to_buf(w->qiov, cluster_start, buf, cluster_bytes);
+        /* Zero-pad last write if image size is not cluster aligned */
+        memset(buf + cluster_bytes, 0, s->cluster_size - cluster_bytes);
+
+        /* Anything that does not save at least a byte is stored as is */
+        out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                    buf, s->cluster_size);
+
+        while (w->next_write != i) {
+            qemu_co_queue_wait(&w->turn, NULL);
+        }
+
+        if (w->ret == 0) {
+            w->ret = qcow2_co_pwrite_compressed_cluster(
+                bs, w->offset + cluster_start, cluster_bytes,
+                buf, out_buf, out_len);
+        }
+
+        w->next_write++;
+        qemu_co_queue_restart_all(&w->turn);
     }
-success:
-    ret = 0;
-fail:
+
     qemu_vfree(buf);
     g_free(out_buf);
-    return ret;
+    w->running_workers--;
+    if (!w->running_workers && w->caller) {
+        aio_co_wake(w->caller);
+    }
+}
+
+static coroutine_fn int
+qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
+                            uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedWrite w;
+    uint64_t cluster_offset;
+    int i, nb_workers;
+
+    if (bytes == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file->bs);
+        return bdrv_truncate(bs->file, cluster_offset, NULL);
+    }
+
+    /* Whole clusters only, except for the end of the image */
+    if (offset_into_cluster(s, offset) ||
+        (offset_into_cluster(s, bytes) &&
+         offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS))
+    {
+        return -EINVAL;
+    }
+
+    w = (Qcow2CompressedWrite) {
+        .bs             = bs,
+        .offset         = offset,
+        .bytes          = bytes,
+        .qiov           = qiov,
+        .nb_clusters    = size_to_clusters(s, bytes),
+    };
+    qemu_co_queue_init(&w.turn);
+
+    nb_workers = MIN(w.nb_clusters, QCOW2_MAX_COMPRESS_THREADS);
+    for (i = 0; i < nb_workers; i++) {
+        Coroutine *co = qemu_coroutine_create(qcow2_compressed_write_co, &w);
+        w.running_workers++;
+        bdrv_coroutine_enter(bs, co);
+    }
+
+    while (w.running_workers) {
+        w.caller = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        w.caller = NULL;
+    }
+
+    return w.ret;
 }
 
 static int make_completely_empty(BlockDriverState *bs)
@@ -2849,6 +3076,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
+    qcow2_release_reserved_clusters(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
@@ -2935,7 +3164,12 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .corrupt            = s->incompatible_features &
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
             .refcount_bits      = s->refcount_bits,
+            .compression_type   = s->compression_type,
+            .has_compression_type =
+                s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -2946,6 +3180,28 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificQcow2 *qcow2_stats = g_new(BlockStatsSpecificQcow2, 1);
+
+    *qcow2_stats = (BlockStatsSpecificQcow2){
+        .l2_cache       = g_new0(Qcow2CacheStats, 1),
+        .refcount_cache = g_new0(Qcow2CacheStats, 1),
+    };
+    qcow2_cache_get_stats(s->l2_table_cache, qcow2_stats->l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          qcow2_stats->refcount_cache);
+
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        .u.qcow2.data = qcow2_stats,
+    };
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -3011,6 +3267,17 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_report("Cannot downgrade an image with extended L2 entries");
+        return -ENOTSUP;
+    }
+
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_report("Cannot downgrade an image with a compression type "
+                     "other than zlib");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3194,6 +3461,20 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                              "not exceed 64 bits");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, false) !=
+                has_subclusters(s)) {
+                error_report("Changing the L2 entry format is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            const char *cur = Qcow2CompressionType_lookup[s->compression_type];
+
+            if (type && strcmp(type, cur)) {
+                error_report("Changing the compression type is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -3415,6 +3696,18 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables with subcluster allocation",
+            .def_value_str = "off"
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster compression "
+                    "(allowed values: zlib, zstd)"
+        },
         { /* end of list */ }
     }
 };
@@ -3452,6 +3745,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
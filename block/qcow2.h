@@ -59,11 +59,34 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* With extended L2 entries, every cluster is split in 32 subclusters and the
+ * second 64-bit word of its L2 entry is a bitmap: bit X says that subcluster
+ * X is allocated in the host cluster, bit 32 + X that it reads as zeros.
+ * QCOW_OFLAG_ZERO is not used then. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+
+/* The subcluster X [0..31] is allocated */
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+/* The subcluster X [0..31] reads as zeroes */
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Subclusters [X, Y) (0 <= X <= Y <= 32) are allocated */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+/* Subclusters [X, Y) (0 <= X <= Y <= 32) read as zeroes */
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+
+#define QCOW_L2_BITMAP_ALL_ALLOC  (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
+/* Subclusters must not be smaller than a sector */
+#define QCOW_EXTL2_MIN_CLUSTER_BITS 14
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -76,8 +99,16 @@
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
 
+/* Clusters for guest data are only reserved in batches on request, because
+ * reserved clusters that are not used yet leak if QEMU crashes */
+#define DEFAULT_ALLOC_RESERVE_BYTE_SIZE 0 /* bytes */
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Clusters handed to the thread pool for compression at once, per image; the
+ * rest of the pool (64 threads) is left to I/O requests */
+#define QCOW2_MAX_COMPRESS_THREADS 32
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -96,7 +127,9 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_RESERVE "alloc-reserve"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -120,6 +153,10 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Only present if header_length > 104 */
+    uint8_t compression_type;
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
@@ -180,11 +217,17 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -226,8 +269,12 @@ typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subclusters_per_cluster;
+    int subcluster_size;
+    int subcluster_bits;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* L2 entries per L2 table cache entry */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -246,6 +293,9 @@ typedef struct BDRVQcow2State {
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    Qcow2CompressionType compression_type;
+    int nb_compress_threads;
+    CoQueue compress_wait_queue;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -255,6 +305,12 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Contiguous clusters whose refcount is already 1 but which are not
+     * referenced yet; new guest data clusters are taken from here */
+    uint64_t reserved_offset;
+    uint64_t reserved_clusters;
+    uint64_t alloc_reserve; /* clusters reserved at once */
+
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
@@ -357,6 +413,18 @@ typedef enum QCow2ClusterType {
     QCOW2_CLUSTER_COMPRESSED,
 } QCow2ClusterType;
 
+/* Type of a subcluster.  Without extended L2 entries, every cluster has a
+ * single subcluster of the same type as the cluster. */
+typedef enum QCow2SubclusterType {
+    QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN,
+    QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC,
+    QCOW2_SUBCLUSTER_ZERO_PLAIN,
+    QCOW2_SUBCLUSTER_ZERO_ALLOC,
+    QCOW2_SUBCLUSTER_NORMAL,
+    QCOW2_SUBCLUSTER_COMPRESSED,
+    QCOW2_SUBCLUSTER_INVALID,
+} QCow2SubclusterType;
+
 typedef enum QCow2MetadataOverlap {
     QCOW2_OL_MAIN_HEADER_BITNR    = 0,
     QCOW2_OL_ACTIVE_L1_BITNR      = 1,
@@ -417,6 +485,60 @@ static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
 }
 
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+static inline uint64_t size_to_subclusters(BDRVQcow2State *s, uint64_t size)
+{
+    return (size + (s->subcluster_size - 1)) >> s->subcluster_bits;
+}
+
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Size of an L2 entry in bytes, including the subcluster bitmap */
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int64_t size_to_l1(BDRVQcow2State *s, int64_t size)
 {
     int shift = s->cluster_bits + s->l2_bits;
@@ -428,6 +550,11 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -460,6 +587,62 @@ static inline QCow2ClusterType qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * In an image without subclusters @l2_bitmap is ignored and
+ * @sc_index must be 0.
+ */
+static inline QCow2SubclusterType qcow2_get_subcluster_type(
+    BDRVQcow2State *s, uint64_t l2_entry, uint64_t l2_bitmap, int sc_index)
+{
+    QCow2ClusterType type = qcow2_get_cluster_type(l2_entry);
+
+    assert(sc_index < s->subclusters_per_cluster);
+
+    if (!has_subclusters(s)) {
+        switch (type) {
+        case QCOW2_CLUSTER_COMPRESSED:
+            return QCOW2_SUBCLUSTER_COMPRESSED;
+        case QCOW2_CLUSTER_ZERO_PLAIN:
+            return QCOW2_SUBCLUSTER_ZERO_PLAIN;
+        case QCOW2_CLUSTER_ZERO_ALLOC:
+            return QCOW2_SUBCLUSTER_ZERO_ALLOC;
+        case QCOW2_CLUSTER_NORMAL:
+            return QCOW2_SUBCLUSTER_NORMAL;
+        case QCOW2_CLUSTER_UNALLOCATED:
+            return QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        default:
+            abort();
+        }
+    }
+
+    switch (type) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        return l2_bitmap ? QCOW2_SUBCLUSTER_INVALID
+                         : QCOW2_SUBCLUSTER_COMPRESSED;
+    case QCOW2_CLUSTER_NORMAL:
+        if ((l2_bitmap >> 32) & l2_bitmap) {
+            return QCOW2_SUBCLUSTER_INVALID;
+        } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+            return QCOW2_SUBCLUSTER_ZERO_ALLOC;
+        } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+            return QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            return QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC;
+        }
+    case QCOW2_CLUSTER_UNALLOCATED:
+        if (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) {
+            return QCOW2_SUBCLUSTER_INVALID;
+        } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+            return QCOW2_SUBCLUSTER_ZERO_PLAIN;
+        } else {
+            return QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        }
+    default:
+        /* QCOW_OFLAG_ZERO is reserved with extended L2 entries */
+        return QCOW2_SUBCLUSTER_INVALID;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -508,6 +691,9 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs, int64_t cluster_index,
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -519,7 +705,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix);
+                          BdrvCheckMode fix,
+                          BlockDriverAmendStatusCB *status_cb,
+                          void *cb_opaque);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -561,6 +749,13 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
                                void *cb_opaque);
 
+/* qcow2-compress.c functions */
+int qcow2_decompress(BDRVQcow2State *s, void *dest, size_t dest_size,
+                     const void *src, size_t src_size);
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
@@ -578,7 +773,8 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -597,5 +793,6 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 #endif
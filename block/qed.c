@@ -1656,7 +1656,9 @@ static void bdrv_qed_invalidate_cache(BlockDriverState *bs, Error **errp)
 }
 
 static int bdrv_qed_check(BlockDriverState *bs, BdrvCheckResult *result,
-                          BdrvCheckMode fix)
+                          BdrvCheckMode fix,
+                          BlockDriverAmendStatusCB *status_cb,
+                          void *cb_opaque)
 {
     BDRVQEDState *s = bs->opaque;
 
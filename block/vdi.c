@@ -259,7 +259,8 @@ static void vdi_header_print(VdiHeader *header)
 #endif
 
 static int vdi_check(BlockDriverState *bs, BdrvCheckResult *res,
-                     BdrvCheckMode fix)
+                     BdrvCheckMode fix, BlockDriverAmendStatusCB *status_cb,
+                     void *cb_opaque)
 {
     /* TODO: additional checks possible. */
     BDRVVdiState *s = (BDRVVdiState *)bs->opaque;
@@ -1939,7 +1939,8 @@ exit:
  * for us to do here
  */
 static int vhdx_check(BlockDriverState *bs, BdrvCheckResult *result,
-                       BdrvCheckMode fix)
+                       BdrvCheckMode fix, BlockDriverAmendStatusCB *status_cb,
+                       void *cb_opaque)
 {
     BDRVVHDXState *s = bs->opaque;
 
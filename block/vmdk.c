@@ -2193,7 +2193,8 @@ static ImageInfo *vmdk_get_extent_info(VmdkExtent *extent)
 }
 
 static int vmdk_check(BlockDriverState *bs, BdrvCheckResult *result,
-                      BdrvCheckMode fix)
+                      BdrvCheckMode fix, BlockDriverAmendStatusCB *status_cb,
+                      void *cb_opaque)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
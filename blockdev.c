@@ -371,6 +371,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -2725,6 +2727,122 @@ out:
     aio_context_release(aio_context);
 }
 
+/* Convert boundaries given to block-latency-histogram-set to an array */
+static uint64_t *latency_histogram_boundaries(uint64List *list, int *count,
+                                              Error **errp)
+{
+    uint64List *entry;
+    uint64_t *boundaries;
+    uint64_t prev = 0;
+    int n = 0;
+
+    if (!list) {
+        error_setg(errp, "At least one histogram boundary is required");
+        return NULL;
+    }
+    for (entry = list; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            error_setg(errp, "Histogram boundaries must be greater than zero "
+                       "and in ascending order");
+            return NULL;
+        }
+        prev = entry->value;
+        n++;
+    }
+
+    boundaries = g_new(uint64_t, n);
+    for (entry = list, n = 0; entry; entry = entry->next) {
+        boundaries[n++] = entry->value;
+    }
+    *count = n;
+    return boundaries;
+}
+
+void qmp_block_latency_histogram_set(bool has_device, const char *device,
+                                     bool has_id, const char *id,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    bool has_list[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ] = has_boundaries_read || has_boundaries,
+        [BLOCK_ACCT_WRITE] = has_boundaries_write || has_boundaries,
+        [BLOCK_ACCT_FLUSH] = has_boundaries_flush || has_boundaries,
+    };
+    uint64List *list[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ] = has_boundaries_read ? boundaries_read : boundaries,
+        [BLOCK_ACCT_WRITE] = has_boundaries_write ? boundaries_write
+                                                  : boundaries,
+        [BLOCK_ACCT_FLUSH] = has_boundaries_flush ? boundaries_flush
+                                                  : boundaries,
+    };
+    uint64_t *array[BLOCK_MAX_IOTYPE] = { NULL };
+    int count[BLOCK_MAX_IOTYPE] = { 0 };
+    bool use_default;
+    BlockBackend *blk;
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    use_default = !has_list[BLOCK_ACCT_READ] && !has_list[BLOCK_ACCT_WRITE] &&
+                  !has_list[BLOCK_ACCT_FLUSH];
+
+    /* Check everything before changing any histogram */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (has_list[i]) {
+            array[i] = latency_histogram_boundaries(list[i], &count[i], errp);
+            if (!array[i]) {
+                goto out;
+            }
+        }
+    }
+
+    /* The histograms are replaced under RCU, so the AioContext that
+     * completes requests need not be stopped.  */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (use_default || has_list[i]) {
+            block_latency_histogram_set(blk_get_stats(blk), i,
+                                        array[i], count[i]);
+        }
+    }
+
+out:
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        g_free(array[i]);
+    }
+}
+
+void qmp_block_latency_histogram_reset(bool has_device, const char *device,
+                                       bool has_id, const char *id,
+                                       bool has_disable, bool disable,
+                                       Error **errp)
+{
+    BlockBackend *blk;
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (has_disable && disable) {
+            block_latency_histogram_clear(blk_get_stats(blk), i);
+        } else {
+            block_latency_histogram_reset(blk_get_stats(blk), i);
+        }
+    }
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 Error **errp)
@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# Measure the packet rate of vhost-user-switch between two QEMU instances.
+#
+# Both guests boot the same kernel and initrd.  The kernel command line of
+# the first guest contains "vus_bench=tx peer=52:54:00:00:00:02", that of
+# the second one "vus_bench=rx"; the initrd is expected to bring up eth0
+# and, in the first guest, start a packet generator (for example the
+# kernel's pktgen) towards the peer MAC address.
+#
+# The switch prints its packet rates every second; after a warm-up the
+# "total" lines are averaged and printed in Mpps.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or
+# later.  See the COPYING file in the top-level directory.
+
+set -e
+
+qemu=${QEMU:-qemu-system-x86_64}
+switch=${SWITCH:-./vhost-user-switch}
+kernel=
+initrd=
+duration=30
+warmup=10
+workers=1
+mem=1G
+dir=$(mktemp -d /tmp/vus-bench.XXXXXX)
+
+usage() {
+    echo "Usage: $0 -k kernel -i initrd [-d seconds] [-w seconds] [-t workers] [-m mem]"
+    echo "  QEMU and SWITCH in the environment override the binaries used"
+    echo "  (default: $qemu and $switch)"
+    exit 1
+}
+
+while getopts "k:i:d:w:t:m:h" opt; do
+    case $opt in
+    k) kernel=$OPTARG ;;
+    i) initrd=$OPTARG ;;
+    d) duration=$OPTARG ;;
+    w) warmup=$OPTARG ;;
+    t) workers=$OPTARG ;;
+    m) mem=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+test -n "$kernel" && test -n "$initrd" || usage
+
+pids=
+cleanup() {
+    for pid in $pids; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+"$switch" -t "$workers" -s 1 -u "$dir/port0.sock" -u "$dir/port1.sock" \
+    > "$dir/stats" 2> "$dir/switch.log" &
+pids="$pids $!"
+
+# wait for the switch to listen
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    test -S "$dir/port1.sock" && break
+    sleep 0.5
+done
+
+start_guest() {
+    n=$1
+    append=$2
+    "$qemu" -enable-kvm -cpu host -smp 2 -m "$mem" -nographic \
+        -object memory-backend-file,id=mem,size="$mem",mem-path=/dev/shm,share=on \
+        -numa node,memdev=mem \
+        -chardev socket,id=chr0,path="$dir/port$n.sock" \
+        -netdev vhost-user,id=net0,chardev=chr0 \
+        -device virtio-net-pci,netdev=net0,mac=52:54:00:00:00:0$((n + 1)) \
+        -kernel "$kernel" -initrd "$initrd" \
+        -append "console=ttyS0 $append" \
+        > "$dir/guest$n.log" 2>&1 < /dev/null &
+    pids="$pids $!"
+}
+
+start_guest 0 "vus_bench=tx peer=52:54:00:00:00:02"
+start_guest 1 "vus_bench=rx"
+
+sleep $((warmup + duration))
+
+awk -v skip="$warmup" '
+/^total:/ {
+    if (++n > skip) {
+        sum += $2
+        samples++
+    }
+}
+END {
+    if (!samples) {
+        print "no samples collected"
+        exit 1
+    }
+    printf "%.3f Mpps average over %d seconds\n", sum / samples, samples
+}' "$dir/stats"
@@ -0,0 +1,794 @@
+/*
+ * Vhost User Switch
+ *
+ * A learning Ethernet switch between several vhost-user-net ports.
+ * Frames are copied straight from the transmitting guest's buffers into
+ * the receiving guest's buffers; the TX rings are busy-polled by worker
+ * threads, so guests never have to kick.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/processor.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+
+#define VUS_MAX_PORTS           16
+#define VUS_MAX_WORKERS         16
+#define VUS_TX_BURST            64
+#define VUS_MAX_RX_BUFS         64
+#define VUS_FDB_SIZE            4096    /* must be a power of two */
+
+#define VUS_FDB_MAC_MASK        ((1ULL << 48) - 1)
+
+#define VUS_RX_QUEUE            0
+#define VUS_TX_QUEUE            1
+
+typedef void (*CallbackFunc)(int sock, void *ctx);
+
+typedef struct Event {
+    void *ctx;
+    CallbackFunc callback;
+} Event;
+
+typedef struct Dispatcher {
+    int max_sock;
+    fd_set fdset;
+    Event events[FD_SETSIZE];
+} Dispatcher;
+
+typedef struct VusSwitch VusSwitch;
+
+typedef struct VusPort {
+    VuDev vudev;
+    VusSwitch *sw;
+    int index;
+    const char *path;
+    int listen_sock;
+    bool connected;
+    int hdrlen;
+    bool mergeable;
+
+    /* The RX ring is filled by whichever worker owns the source port */
+    QemuSpin rx_lock;
+
+    /* Updated by the owning worker or under rx_lock, read by main */
+    uint64_t tx_packets;
+    uint64_t rx_packets;
+    uint64_t drops;
+} VusPort;
+
+typedef struct VusWorker {
+    VusSwitch *sw;
+    int index;
+    QemuThread thread;
+    /* Held while polling; the main thread takes it to pause the worker */
+    QemuMutex lock;
+} VusWorker;
+
+struct VusSwitch {
+    Dispatcher dispatcher;
+    VusPort ports[VUS_MAX_PORTS];
+    int nports;
+    VusWorker workers[VUS_MAX_WORKERS];
+    int nworkers;
+    int pause;
+    int quit;
+
+    /*
+     * MAC address table.  Each entry packs the 48-bit address with the
+     * port index plus one in the top 16 bits, so that lookups and updates
+     * are single loads and stores.
+     */
+    uint64_t fdb[VUS_FDB_SIZE];
+};
+
+static void
+vus_die(const char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+static int
+dispatcher_add(Dispatcher *dispr, int sock, void *ctx, CallbackFunc cb)
+{
+    if (sock >= FD_SETSIZE) {
+        fprintf(stderr,
+                "Error: Failed to add new event. sock %d should be less than %d\n",
+                sock, FD_SETSIZE);
+        return -1;
+    }
+
+    dispr->events[sock].ctx = ctx;
+    dispr->events[sock].callback = cb;
+
+    FD_SET(sock, &dispr->fdset);
+    if (sock > dispr->max_sock) {
+        dispr->max_sock = sock;
+    }
+    return 0;
+}
+
+static void
+dispatcher_remove(Dispatcher *dispr, int sock)
+{
+    if (sock < FD_SETSIZE) {
+        FD_CLR(sock, &dispr->fdset);
+    }
+}
+
+/* timeout in us */
+static void
+dispatcher_wait(Dispatcher *dispr, uint32_t timeout)
+{
+    struct timeval tv = {
+        .tv_sec = timeout / 1000000,
+        .tv_usec = timeout % 1000000,
+    };
+    fd_set fdset = dispr->fdset;
+    int rc, sock;
+
+    rc = select(dispr->max_sock + 1, &fdset, 0, 0, &tv);
+    if (rc == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        vus_die("select");
+    }
+
+    for (sock = 0; rc > 0 && sock < dispr->max_sock + 1; sock++) {
+        /* A callback may remove other sockets from the dispatcher */
+        if (FD_ISSET(sock, &fdset) && FD_ISSET(sock, &dispr->fdset)) {
+            Event *e = &dispr->events[sock];
+            e->callback(sock, e->ctx);
+        }
+    }
+}
+
+/*
+ * Control messages may remap guest memory or move the rings, so every
+ * worker is stopped while the main thread handles them.
+ */
+static void
+vus_pause_workers(VusSwitch *sw)
+{
+    int i;
+
+    atomic_inc(&sw->pause);
+    for (i = 0; i < sw->nworkers; i++) {
+        qemu_mutex_lock(&sw->workers[i].lock);
+    }
+}
+
+static void
+vus_resume_workers(VusSwitch *sw)
+{
+    int i;
+
+    for (i = 0; i < sw->nworkers; i++) {
+        qemu_mutex_unlock(&sw->workers[i].lock);
+    }
+    atomic_dec(&sw->pause);
+}
+
+/* MAC learning */
+
+static inline uint64_t
+vus_mac(const uint8_t *mac)
+{
+    return (uint64_t)mac[0] << 40 | (uint64_t)mac[1] << 32 |
+           (uint64_t)mac[2] << 24 | (uint64_t)mac[3] << 16 |
+           (uint64_t)mac[4] << 8 | mac[5];
+}
+
+static inline uint64_t *
+vus_fdb_entry(VusSwitch *sw, uint64_t mac)
+{
+    uint64_t hash = mac * 0x9e3779b97f4a7c15ULL;
+
+    return &sw->fdb[(hash >> 32) & (VUS_FDB_SIZE - 1)];
+}
+
+/*
+ * The table is shared by all workers without locking.  On 32-bit hosts
+ * an entry can be read torn; the worst outcome is one frame delivered to
+ * the wrong port, just as after a station moves.
+ */
+static void
+vus_fdb_learn(VusSwitch *sw, uint64_t mac, int port)
+{
+    uint64_t *entry = vus_fdb_entry(sw, mac);
+    uint64_t val = mac | (uint64_t)(port + 1) << 48;
+
+    if (atomic_read__nocheck(entry) != val) {
+        atomic_set__nocheck(entry, val);
+    }
+}
+
+static int
+vus_fdb_lookup(VusSwitch *sw, uint64_t mac)
+{
+    uint64_t val = atomic_read__nocheck(vus_fdb_entry(sw, mac));
+
+    if ((val & VUS_FDB_MAC_MASK) != mac || !(val >> 48)) {
+        return -1;
+    }
+    return (val >> 48) - 1;
+}
+
+/* Called with the workers paused */
+static void
+vus_fdb_flush_port(VusSwitch *sw, int port)
+{
+    int i;
+
+    for (i = 0; i < VUS_FDB_SIZE; i++) {
+        if ((sw->fdb[i] >> 48) == port + 1) {
+            sw->fdb[i] = 0;
+        }
+    }
+}
+
+/* Data path */
+
+/* Copy @bytes from guest buffers to guest buffers, with no bounce buffer. */
+static size_t
+vus_iov_copy(const struct iovec *dst, unsigned dst_cnt, size_t dst_off,
+             const struct iovec *src, unsigned src_cnt, size_t src_off,
+             size_t bytes)
+{
+    unsigned i = 0, j = 0;
+    size_t done = 0;
+
+    while (i < dst_cnt && dst_off >= dst[i].iov_len) {
+        dst_off -= dst[i++].iov_len;
+    }
+    while (j < src_cnt && src_off >= src[j].iov_len) {
+        src_off -= src[j++].iov_len;
+    }
+
+    while (done < bytes && i < dst_cnt && j < src_cnt) {
+        size_t len = MIN(dst[i].iov_len - dst_off, src[j].iov_len - src_off);
+
+        len = MIN(len, bytes - done);
+        memcpy((uint8_t *)dst[i].iov_base + dst_off,
+               (uint8_t *)src[j].iov_base + src_off, len);
+        done += len;
+        dst_off += len;
+        src_off += len;
+        if (dst_off == dst[i].iov_len) {
+            i++;
+            dst_off = 0;
+        }
+        if (src_off == src[j].iov_len) {
+            j++;
+            src_off = 0;
+        }
+    }
+    return done;
+}
+
+static bool
+vus_port_ready(VusPort *port, int qidx)
+{
+    VuVirtq *vq;
+
+    if (!port->connected || port->vudev.broken) {
+        return false;
+    }
+    vq = vu_get_queue(&port->vudev, qidx);
+    return vq->started && vu_queue_enabled(&port->vudev, vq);
+}
+
+/*
+ * Copy one frame into @dst's RX ring.  Returns true if @dst has to be
+ * notified.  Must be called with @dst->rx_lock held.
+ */
+static bool
+vus_port_deliver(VusPort *dst, const struct iovec *sg, unsigned num,
+                 size_t off, size_t size)
+{
+    VuDev *dev = &dst->vudev;
+    VuVirtq *vq = vu_get_queue(dev, VUS_RX_QUEUE);
+    VuVirtqElement *elems[VUS_MAX_RX_BUFS];
+    size_t lens[VUS_MAX_RX_BUFS];
+    struct virtio_net_hdr_mrg_rxbuf mhdr = {
+        .hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+    size_t copied = 0;
+    unsigned i, n = 0;
+
+    if (!vus_port_ready(dst, VUS_RX_QUEUE)) {
+        dst->drops++;
+        return false;
+    }
+
+    while (copied < size || n == 0) {
+        VuVirtqElement *elem;
+        size_t hdr = n == 0 ? dst->hdrlen : 0;
+        size_t len;
+
+        if (n == VUS_MAX_RX_BUFS || (n && !dst->mergeable)) {
+            goto drop;
+        }
+        elem = vu_queue_pop(dev, vq, sizeof(VuVirtqElement));
+        if (!elem) {
+            goto drop;
+        }
+        elems[n++] = elem;
+        if (iov_size(elem->in_sg, elem->in_num) < hdr) {
+            goto drop;
+        }
+        len = vus_iov_copy(elem->in_sg, elem->in_num, hdr,
+                           sg, num, off + copied, size - copied);
+        copied += len;
+        lens[n - 1] = hdr + len;
+    }
+
+    mhdr.num_buffers = n;
+    iov_from_buf(elems[0]->in_sg, elems[0]->in_num, 0, &mhdr, dst->hdrlen);
+
+    for (i = 0; i < n; i++) {
+        vu_queue_fill(dev, vq, elems[i], lens[i], i);
+        free(elems[i]);
+    }
+    vu_queue_flush(dev, vq, n);
+    dst->rx_packets++;
+    return true;
+
+drop:
+    vu_queue_rewind(dev, vq, n);
+    for (i = 0; i < n; i++) {
+        free(elems[i]);
+    }
+    dst->drops++;
+    return false;
+}
+
+static void
+vus_forward(VusPort *src, VuVirtqElement *elem, uint32_t *notify)
+{
+    VusSwitch *sw = src->sw;
+    size_t size = iov_size(elem->out_sg, elem->out_num);
+    uint8_t eth[12];
+    uint64_t dmac, smac;
+    int dst, i;
+
+    if (size < src->hdrlen + ETH_ALEN * 2 ||
+        iov_to_buf(elem->out_sg, elem->out_num, src->hdrlen,
+                   eth, sizeof(eth)) != sizeof(eth)) {
+        src->drops++;
+        return;
+    }
+    size -= src->hdrlen;
+
+    dmac = vus_mac(eth);
+    smac = vus_mac(eth + ETH_ALEN);
+    if (!(eth[ETH_ALEN] & 1)) {
+        vus_fdb_learn(sw, smac, src->index);
+    }
+
+    dst = (eth[0] & 1) ? -1 : vus_fdb_lookup(sw, dmac);
+    if (dst == src->index) {
+        return;
+    }
+
+    for (i = 0; i < sw->nports; i++) {
+        VusPort *port = &sw->ports[i];
+
+        if (i == src->index || (dst >= 0 && i != dst)) {
+            continue;
+        }
+        qemu_spin_lock(&port->rx_lock);
+        if (vus_port_deliver(port, elem->out_sg, elem->out_num,
+                             src->hdrlen, size)) {
+            *notify |= 1u << i;
+        }
+        qemu_spin_unlock(&port->rx_lock);
+    }
+}
+
+static bool
+vus_port_poll_tx(VusPort *port)
+{
+    VusSwitch *sw = port->sw;
+    VuDev *dev = &port->vudev;
+    VuVirtq *vq = vu_get_queue(dev, VUS_TX_QUEUE);
+    VuVirtqElement *elem;
+    uint32_t notify = 0;
+    int i, n = 0;
+
+    if (!vus_port_ready(port, VUS_TX_QUEUE)) {
+        return false;
+    }
+
+    while (n < VUS_TX_BURST &&
+           (elem = vu_queue_pop(dev, vq, sizeof(VuVirtqElement)))) {
+        vus_forward(port, elem, &notify);
+        vu_queue_fill(dev, vq, elem, 0, n++);
+        free(elem);
+    }
+    if (!n) {
+        return false;
+    }
+
+    vu_queue_flush(dev, vq, n);
+    vu_queue_notify(dev, vq);
+    port->tx_packets += n;
+
+    /* One interrupt per destination for the whole burst */
+    for (i = 0; notify; i++, notify >>= 1) {
+        if (notify & 1) {
+            VusPort *dst = &sw->ports[i];
+
+            qemu_spin_lock(&dst->rx_lock);
+            vu_queue_notify(&dst->vudev, vu_get_queue(&dst->vudev,
+                                                      VUS_RX_QUEUE));
+            qemu_spin_unlock(&dst->rx_lock);
+        }
+    }
+    return true;
+}
+
+static void *
+vus_worker_thread(void *opaque)
+{
+    VusWorker *w = opaque;
+    VusSwitch *sw = w->sw;
+
+    while (!atomic_read(&sw->quit)) {
+        bool busy = false;
+        int i;
+
+        qemu_mutex_lock(&w->lock);
+        for (i = w->index; i < sw->nports; i += sw->nworkers) {
+            busy |= vus_port_poll_tx(&sw->ports[i]);
+        }
+        qemu_mutex_unlock(&w->lock);
+
+        while (atomic_read(&sw->pause)) {
+            cpu_relax();
+        }
+        if (!busy) {
+            cpu_relax();
+        }
+    }
+    return NULL;
+}
+
+/* Control path */
+
+static void vus_port_listen(VusPort *port);
+
+static void
+vus_port_disconnect(VusPort *port)
+{
+    VusSwitch *sw = port->sw;
+
+    dispatcher_remove(&sw->dispatcher, port->vudev.sock);
+    vus_pause_workers(sw);
+    port->connected = false;
+    vu_deinit(&port->vudev);
+    vus_fdb_flush_port(sw, port->index);
+    vus_resume_workers(sw);
+
+    fprintf(stderr, "port %d: disconnected\n", port->index);
+    vus_port_listen(port);
+}
+
+static void
+vus_receive_cb(int sock, void *ctx)
+{
+    VusPort *port = ctx;
+    bool ok;
+
+    vus_pause_workers(port->sw);
+    ok = vu_dispatch(&port->vudev);
+    vus_resume_workers(port->sw);
+
+    if (!ok || port->vudev.broken) {
+        vus_port_disconnect(port);
+    }
+}
+
+typedef struct WatchData {
+    VuDev *dev;
+    vu_watch_cb cb;
+    void *data;
+} WatchData;
+
+static WatchData watches[FD_SETSIZE];
+
+static void
+watch_cb(int sock, void *ctx)
+{
+    struct WatchData *wd = ctx;
+    VusPort *port = container_of(wd->dev, VusPort, vudev);
+
+    vus_pause_workers(port->sw);
+    wd->cb(wd->dev, VU_WATCH_IN, wd->data);
+    vus_resume_workers(port->sw);
+}
+
+static void
+vus_set_watch(VuDev *dev, int fd, int condition,
+              vu_watch_cb cb, void *data)
+{
+    VusPort *port = container_of(dev, VusPort, vudev);
+    struct WatchData *wd;
+
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "port %d: fd %d out of range\n", port->index, fd);
+        return;
+    }
+    wd = &watches[fd];
+    wd->cb = cb;
+    wd->data = data;
+    wd->dev = dev;
+    dispatcher_add(&port->sw->dispatcher, fd, wd, watch_cb);
+}
+
+static void
+vus_remove_watch(VuDev *dev, int fd)
+{
+    VusPort *port = container_of(dev, VusPort, vudev);
+
+    dispatcher_remove(&port->sw->dispatcher, fd);
+}
+
+static void
+vus_panic(VuDev *dev, const char *msg)
+{
+    VusPort *port = container_of(dev, VusPort, vudev);
+
+    fprintf(stderr, "port %d: PANIC: %s\n", port->index, msg);
+}
+
+static void
+vus_set_features(VuDev *dev, uint64_t features)
+{
+    VusPort *port = container_of(dev, VusPort, vudev);
+
+    port->mergeable = !!(features & (1ULL << VIRTIO_NET_F_MRG_RXBUF));
+    if ((features & (1ULL << VIRTIO_F_VERSION_1)) || port->mergeable) {
+        port->hdrlen = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    } else {
+        port->hdrlen = sizeof(struct virtio_net_hdr);
+    }
+}
+
+static uint64_t
+vus_get_features(VuDev *dev)
+{
+    return 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+}
+
+static void
+vus_queue_set_started(VuDev *dev, int qidx, bool started)
+{
+    /* TX rings are polled, the guest need not kick them */
+    if (qidx % 2 == VUS_TX_QUEUE && started) {
+        vu_queue_set_notification(dev, vu_get_queue(dev, qidx), 0);
+    }
+}
+
+static const VuDevIface vuiface = {
+    .get_features = vus_get_features,
+    .set_features = vus_set_features,
+    .queue_set_started = vus_queue_set_started,
+};
+
+static void
+vus_accept_cb(int sock, void *ctx)
+{
+    VusPort *port = ctx;
+    VusSwitch *sw = port->sw;
+    int conn_fd;
+
+    conn_fd = accept(sock, NULL, NULL);
+    if (conn_fd == -1) {
+        vus_die("accept()");
+    }
+    dispatcher_remove(&sw->dispatcher, sock);
+    close(sock);
+    port->listen_sock = -1;
+
+    vus_pause_workers(sw);
+    vu_init(&port->vudev, conn_fd, vus_panic,
+            vus_set_watch, vus_remove_watch, &vuiface);
+    port->connected = true;
+    vus_resume_workers(sw);
+
+    dispatcher_add(&sw->dispatcher, conn_fd, port, vus_receive_cb);
+    fprintf(stderr, "port %d: connected on %s\n", port->index, port->path);
+}
+
+static void
+vus_port_listen(VusPort *port)
+{
+    struct sockaddr_un un;
+    int sock;
+
+    if (strlen(port->path) >= sizeof(un.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", port->path);
+        exit(1);
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        vus_die("socket");
+    }
+
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, port->path);
+    unlink(port->path);
+
+    if (bind(sock, (struct sockaddr *)&un, sizeof(un)) == -1) {
+        vus_die("bind");
+    }
+    if (listen(sock, 1) == -1) {
+        vus_die("listen");
+    }
+
+    port->listen_sock = sock;
+    dispatcher_add(&port->sw->dispatcher, sock, port, vus_accept_cb);
+}
+
+static int64_t
+vus_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Print per-port packet rates.  The "total" line is what
+ * contrib/vhost-user-switch/bench.sh averages.
+ */
+static void
+vus_print_stats(VusSwitch *sw, uint64_t *last, int64_t elapsed_ns)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < sw->nports; i++) {
+        VusPort *port = &sw->ports[i];
+        uint64_t tx = atomic_read__nocheck(&port->tx_packets);
+        uint64_t rx = atomic_read__nocheck(&port->rx_packets);
+        uint64_t drops = atomic_read__nocheck(&port->drops);
+
+        printf("port %d: tx %.3f Mpps rx %.3f Mpps drops %" PRIu64 "\n", i,
+               (tx - last[i * 2]) * 1000.0 / elapsed_ns,
+               (rx - last[i * 2 + 1]) * 1000.0 / elapsed_ns, drops);
+        total += rx - last[i * 2 + 1];
+        last[i * 2] = tx;
+        last[i * 2 + 1] = rx;
+    }
+    printf("total: %.3f Mpps\n", total * 1000.0 / elapsed_ns);
+    fflush(stdout);
+}
+
+static int vus_quit;
+
+static void
+vus_signal_handler(int signum)
+{
+    vus_quit = 1;
+}
+
+static void
+vus_usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-t workers] [-s seconds] "
+            "-u ud_socket_path -u ud_socket_path [-u ...]\n", progname);
+    fprintf(stderr, "\t-u path of the UNIX domain socket of a port; "
+            "give it once per port (2 to %d)\n", VUS_MAX_PORTS);
+    fprintf(stderr, "\t-t number of busy-polling worker threads. default: 1\n");
+    fprintf(stderr, "\t-s print packet rates every that many seconds\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    static VusSwitch sw;
+    uint64_t last[VUS_MAX_PORTS * 2] = { 0 };
+    int stats_interval = 0;
+    int64_t last_stats;
+    int opt, i;
+
+    sw.nworkers = 1;
+    while ((opt = getopt(argc, argv, "u:t:s:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            if (sw.nports == VUS_MAX_PORTS) {
+                fprintf(stderr, "too many ports\n");
+                return 1;
+            }
+            sw.ports[sw.nports++].path = optarg;
+            break;
+        case 't':
+            sw.nworkers = atoi(optarg);
+            if (sw.nworkers < 1 || sw.nworkers > VUS_MAX_WORKERS) {
+                fprintf(stderr, "workers must be between 1 and %d\n",
+                        VUS_MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        default:
+            vus_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (sw.nports < 2) {
+        vus_usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, vus_signal_handler);
+    signal(SIGTERM, vus_signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    FD_ZERO(&sw.dispatcher.fdset);
+    sw.dispatcher.max_sock = -1;
+
+    for (i = 0; i < sw.nports; i++) {
+        VusPort *port = &sw.ports[i];
+
+        port->sw = &sw;
+        port->index = i;
+        port->hdrlen = sizeof(struct virtio_net_hdr);
+        qemu_spin_init(&port->rx_lock);
+        vus_port_listen(port);
+        fprintf(stderr, "port %d: waiting for connection on %s\n",
+                i, port->path);
+    }
+
+    for (i = 0; i < sw.nworkers; i++) {
+        VusWorker *w = &sw.workers[i];
+
+        w->sw = &sw;
+        w->index = i;
+        qemu_mutex_init(&w->lock);
+        qemu_thread_create(&w->thread, "vus-worker", vus_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    last_stats = vus_clock_ns();
+    while (!vus_quit) {
+        int64_t now;
+
+        /* timeout 200ms */
+        dispatcher_wait(&sw.dispatcher, 200000);
+
+        now = vus_clock_ns();
+        if (stats_interval &&
+            now - last_stats >= stats_interval * 1000000000LL) {
+            vus_print_stats(&sw, last, now - last_stats);
+            last_stats = now;
+        }
+    }
+
+    atomic_set(&sw.quit, 1);
+    for (i = 0; i < sw.nworkers; i++) {
+        qemu_thread_join(&sw.workers[i].thread);
+    }
+    for (i = 0; i < sw.nports; i++) {
+        if (sw.ports[i].connected) {
+            vu_deinit(&sw.ports[i].vudev);
+        }
+        unlink(sw.ports[i].path);
+    }
+
+    return 0;
+}
@@ -1045,6 +1045,34 @@ found:
     return block;
 }
 
+/* Called within RCU critical section.  */
+void cpu_physical_memory_set_dirty_hint(ram_addr_t start, ram_addr_t length)
+{
+    RAMBlock *block;
+    unsigned long first, last;
+
+    if (!length) {
+        return;
+    }
+    block = atomic_rcu_read(&ram_list.mru_block);
+    if (!block || start - block->offset >= block->max_length) {
+        RAMBLOCK_FOREACH(block) {
+            if (start - block->offset < block->max_length) {
+                break;
+            }
+        }
+        if (!block) {
+            return;
+        }
+    }
+
+    start -= block->offset;
+    length = MIN(length, block->max_length - start);
+    first = start >> (TARGET_PAGE_BITS + RAM_DIRTY_HINT_BITS);
+    last = (start + length - 1) >> (TARGET_PAGE_BITS + RAM_DIRTY_HINT_BITS);
+    bitmap_set_atomic(block->dirty_hint, first, last - first + 1);
+}
+
 static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 {
     CPUState *cpu;
@@ -1887,6 +1915,10 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
         }
     }
 
+    new_block->dirty_hint =
+        bitmap_new(DIV_ROUND_UP(new_block->max_length >> TARGET_PAGE_BITS,
+                                RAM_DIRTY_HINT_PAGES));
+
     new_ram_size = MAX(old_ram_size,
               (new_block->offset + new_block->max_length) >> TARGET_PAGE_BITS);
     if (new_ram_size > old_ram_size) {
@@ -2047,6 +2079,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->dirty_hint);
     g_free(block);
 }
 
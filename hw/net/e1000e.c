@@ -214,6 +214,13 @@ e1000e_nc_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     return e1000e_receive(&s->core, buf, size);
 }
 
+static void
+e1000e_nc_tx_sent(NetClientState *nc, ssize_t ret)
+{
+    E1000EState *s = qemu_get_nic_opaque(nc);
+    e1000e_core_tx_complete(&s->core, nc, ret);
+}
+
 static void
 e1000e_set_link_status(NetClientState *nc)
 {
@@ -257,6 +264,7 @@ static void e1000e_core_realize(E1000EState *s)
 {
     s->core.owner = &s->parent_obj;
     s->core.owner_nic = s->nic;
+    s->core.owner_tx_sent = e1000e_nc_tx_sent;
 }
 
 static void
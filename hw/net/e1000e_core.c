@@ -648,11 +648,18 @@ e1000e_setup_tx_offloads(E1000ECore *core, struct e1000e_tx *tx)
     }
 }
 
+static inline NetClientState *
+e1000e_tx_queue(E1000ECore *core, int queue_index)
+{
+    int target_queue = MIN(core->max_queue_num, queue_index);
+
+    return qemu_get_subqueue(core->owner_nic, target_queue);
+}
+
 static bool
 e1000e_tx_pkt_send(E1000ECore *core, struct e1000e_tx *tx, int queue_index)
 {
-    int target_queue = MIN(core->max_queue_num, queue_index);
-    NetClientState *queue = qemu_get_subqueue(core->owner_nic, target_queue);
+    NetClientState *queue = e1000e_tx_queue(core, queue_index);
 
     e1000e_setup_tx_offloads(core, tx);
 
@@ -662,7 +669,8 @@ e1000e_tx_pkt_send(E1000ECore *core, struct e1000e_tx *tx, int queue_index)
         ((core->mac[RCTL] & E1000_RCTL_LBM_MAC) == E1000_RCTL_LBM_MAC)) {
         return net_tx_pkt_send_loopback(tx->tx_pkt, queue);
     } else {
-        return net_tx_pkt_send(tx->tx_pkt, queue);
+        return net_tx_pkt_send_zerocopy(tx->tx_pkt, queue,
+                                        core->owner_tx_sent, &tx->queued);
     }
 }
 
@@ -696,7 +704,11 @@ e1000e_on_tx_done_update_stats(E1000ECore *core, struct NetTxPkt *tx_pkt)
     core->mac[GOTCH] = core->mac[TOTH];
 }
 
-static void
+/* Returns true if the frame ending with this descriptor was queued by
+ * the net layer; the descriptor is then completed by
+ * e1000e_core_tx_complete().
+ */
+static bool
 e1000e_process_tx_desc(E1000ECore *core,
                        struct e1000e_tx *tx,
                        struct e1000_tx_desc *dp,
@@ -712,7 +724,8 @@ e1000e_process_tx_desc(E1000ECore *core,
     if (dtype == E1000_TXD_CMD_DEXT) { /* context descriptor */
         e1000x_read_tx_ctx_descr(xp, &tx->props);
         e1000e_process_snap_option(core, le32_to_cpu(xp->cmd_and_length));
-        return;
+        tx->frame_descs++;
+        return false;
     } else if (dtype == (E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_D)) {
         /* data descriptor */
         tx->props.sum_needed = le32_to_cpu(dp->upper.data) >> 8;
@@ -739,17 +752,24 @@ e1000e_process_tx_desc(E1000ECore *core,
                 net_tx_pkt_setup_vlan_header_ex(tx->tx_pkt,
                     le16_to_cpu(dp->upper.fields.special), core->vet);
             }
-            if (e1000e_tx_pkt_send(core, tx, queue_index)) {
+            if (e1000e_tx_pkt_send(core, tx, queue_index) && !tx->queued) {
                 e1000e_on_tx_done_update_stats(core, tx->tx_pkt);
             }
         }
 
         tx->skip_cp = false;
-        net_tx_pkt_reset(tx->tx_pkt);
+        if (!tx->queued) {
+            net_tx_pkt_reset(tx->tx_pkt);
+            tx->frame_descs = 0;
+        }
 
         tx->props.sum_needed = 0;
         tx->props.cptse = 0;
+    } else {
+        tx->frame_descs++;
     }
+
+    return tx->queued;
 }
 
 static inline uint32_t
@@ -835,6 +855,16 @@ e1000e_ring_advance(E1000ECore *core, const E1000E_RingInfo *r, uint32_t count)
     }
 }
 
+static inline void
+e1000e_ring_rewind(E1000ECore *core, const E1000E_RingInfo *r, uint32_t count)
+{
+    uint32_t len = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (len) {
+        core->mac[r->dh] = (core->mac[r->dh] + len - count % len) % len;
+    }
+}
+
 static inline uint32_t
 e1000e_ring_free_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
 {
@@ -908,6 +938,23 @@ e1000e_rx_ring_init(E1000ECore *core, E1000E_RxRing *rxr, int idx)
     rxr->i      = &i[idx];
 }
 
+/* Both rings may feed the same queue of the peer, which takes a single
+ * queued frame from it at a time.
+ */
+static bool
+e1000e_tx_queue_busy(E1000ECore *core, int queue_index)
+{
+    NetClientState *nc = e1000e_tx_queue(core, queue_index);
+    int i;
+
+    for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+        if (core->tx[i].queued && e1000e_tx_queue(core, i) == nc) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
@@ -922,6 +969,10 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
         return;
     }
 
+    if (e1000e_tx_queue_busy(core, txi->idx)) {
+        return;
+    }
+
     while (!e1000e_ring_empty(core, txi)) {
         base = e1000e_ring_head_descr(core, txi);
 
@@ -930,17 +981,91 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
         trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
                               desc.lower.data, desc.upper.data);
 
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
+        if (e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx)) {
+            /* The head stays on the frame's last descriptor */
+            cause &= ~E1000_ICS_TXQE;
+            break;
+        }
         cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
 
         e1000e_ring_advance(core, txi, 1);
     }
 
+    if (!cause) {
+        return;
+    }
+
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
         e1000e_set_interrupt_cause(core, cause);
     }
 }
 
+/* The net layer is done with a frame that it had to queue.  ret is 0 if
+ * the frame was purged, which happens on reset, unplug and VM stop.  No
+ * descriptor is completed then; the head goes back to the first descriptor
+ * of the frame, so that the whole frame is sent again on resume.
+ */
+void
+e1000e_core_tx_complete(E1000ECore *core, NetClientState *nc, ssize_t ret)
+{
+    E1000E_TxRing txr;
+    struct e1000_tx_desc desc;
+    dma_addr_t base;
+    bool ide = false;
+    uint32_t cause;
+    int i;
+
+    for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+        if (core->tx[i].queued && e1000e_tx_queue(core, i) == nc) {
+            break;
+        }
+    }
+    if (i == E1000E_NUM_QUEUES) {
+        return;
+    }
+
+    e1000e_tx_ring_init(core, &txr, i);
+    txr.tx->queued = false;
+
+    if (!ret) {
+        net_tx_pkt_reset(txr.tx->tx_pkt);
+        e1000e_ring_rewind(core, txr.i, txr.tx->frame_descs);
+        txr.tx->frame_descs = 0;
+        return;
+    }
+
+    e1000e_on_tx_done_update_stats(core, txr.tx->tx_pkt);
+    net_tx_pkt_reset(txr.tx->tx_pkt);
+    txr.tx->frame_descs = 0;
+
+    base = e1000e_ring_head_descr(core, txr.i);
+    pci_dma_read(core->owner, base, &desc, sizeof(desc));
+    cause = e1000e_txdesc_writeback(core, base, &desc, &ide, txr.i->idx);
+    e1000e_ring_advance(core, txr.i, 1);
+
+    if (cause && (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause))) {
+        e1000e_set_interrupt_cause(core, cause);
+    }
+
+    for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+        if (core->mac[i ? TARC1 : TARC0] & E1000_TARC_ENABLE) {
+            e1000e_tx_ring_init(core, &txr, i);
+            e1000e_start_xmit(core, &txr);
+        }
+    }
+}
+
+/* Drop frames queued by the net layer, leaving their descriptors pending */
+static void
+e1000e_tx_purge(E1000ECore *core)
+{
+    int i;
+
+    for (i = 0; i <= core->max_queue_num; i++) {
+        qemu_purge_queued_packets(qemu_get_subqueue(core->owner_nic, i));
+    }
+}
+
 static bool
 e1000e_has_rxbufs(E1000ECore *core, const E1000E_RingInfo *r,
                   size_t total_size)
@@ -3287,13 +3412,26 @@ static void
 e1000e_vm_state_change(void *opaque, int running, RunState state)
 {
     E1000ECore *core = opaque;
+    E1000E_TxRing txr;
+    int i;
 
     if (running) {
         trace_e1000e_vm_state_running();
         e1000e_intrmgr_resume(core);
         e1000e_autoneg_resume(core);
+
+        /* Send what was left behind by a frame purged at stop */
+        for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+            e1000e_tx_ring_init(core, &txr, i);
+            if ((core->mac[i ? TARC1 : TARC0] & E1000_TARC_ENABLE) &&
+                !e1000e_ring_empty(core, txr.i)) {
+                e1000e_start_xmit(core, &txr);
+            }
+        }
     } else {
         trace_e1000e_vm_state_stopped();
+        /* Queued frames point into guest memory, which may be migrated */
+        e1000e_tx_purge(core);
         e1000e_autoneg_pause(core);
         e1000e_intrmgr_pause(core);
     }
@@ -3341,6 +3479,7 @@ e1000e_core_pci_uninit(E1000ECore *core)
 
     qemu_del_vm_change_state_handler(core->vmstate);
 
+    e1000e_tx_purge(core);
     for (i = 0; i < E1000E_NUM_QUEUES; i++) {
         net_tx_pkt_reset(core->tx[i].tx_pkt);
         net_tx_pkt_uninit(core->tx[i].tx_pkt);
@@ -3438,6 +3577,7 @@ e1000e_core_reset(E1000ECore *core)
 
     timer_del(core->autoneg_timer);
 
+    e1000e_tx_purge(core);
     e1000e_intrmgr_reset(core);
 
     memset(core->phy, 0, sizeof core->phy);
@@ -3457,6 +3597,7 @@ e1000e_core_reset(E1000ECore *core)
         net_tx_pkt_reset(core->tx[i].tx_pkt);
         memset(&core->tx[i].props, 0, sizeof(core->tx[i].props));
         core->tx[i].skip_cp = false;
+        core->tx[i].frame_descs = 0;
     }
 }
 
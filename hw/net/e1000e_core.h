@@ -71,6 +71,11 @@ struct E1000Core {
         e1000x_txd_props props;
 
         bool skip_cp;
+        /* tx_pkt is queued by the net layer, its EOP descriptor is
+         * written back by e1000e_core_tx_complete() */
+        bool queued;
+        /* Descriptors of the current frame that the head has passed */
+        uint32_t frame_descs;
         struct NetTxPkt *tx_pkt;
     } tx[E1000E_NUM_QUEUES];
 
@@ -107,6 +112,7 @@ struct E1000Core {
     NICState *owner_nic;
     PCIDevice *owner;
     void (*owner_start_recv)(PCIDevice *d);
+    NetPacketSent *owner_tx_sent;
 };
 
 void
@@ -147,3 +153,6 @@ e1000e_receive_iov(E1000ECore *core, const struct iovec *iov, int iovcnt);
 
 void
 e1000e_start_recv(E1000ECore *core);
+
+void
+e1000e_core_tx_complete(E1000ECore *core, NetClientState *nc, ssize_t ret);
@@ -594,7 +594,8 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
-bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
+static bool net_tx_pkt_do_send(struct NetTxPkt *pkt, NetClientState *nc,
+    NetPacketSent *sent_cb, bool *queued)
 {
     assert(pkt);
 
@@ -617,14 +618,32 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 
     if (pkt->has_virt_hdr ||
         pkt->virt_hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
-        net_tx_pkt_sendv(pkt, nc, pkt->vec,
-            pkt->payload_frags + NET_TX_PKT_PL_START_FRAG);
+        if (sent_cb && !pkt->is_loopback) {
+            /* Headers live in pkt, payload in mapped guest memory */
+            *queued = qemu_sendv_packet_zerocopy(nc, pkt->vec,
+                pkt->payload_frags + NET_TX_PKT_PL_START_FRAG, sent_cb) == 0;
+        } else {
+            net_tx_pkt_sendv(pkt, nc, pkt->vec,
+                pkt->payload_frags + NET_TX_PKT_PL_START_FRAG);
+        }
         return true;
     }
 
     return net_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
 
+bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
+{
+    return net_tx_pkt_do_send(pkt, nc, NULL, NULL);
+}
+
+bool net_tx_pkt_send_zerocopy(struct NetTxPkt *pkt, NetClientState *nc,
+    NetPacketSent *sent_cb, bool *queued)
+{
+    *queued = false;
+    return net_tx_pkt_do_send(pkt, nc, sent_cb, queued);
+}
+
 bool net_tx_pkt_send_loopback(struct NetTxPkt *pkt, NetClientState *nc)
 {
     bool res;
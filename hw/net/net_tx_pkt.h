@@ -19,6 +19,7 @@
 #define NET_TX_PKT_H
 
 #include "net/eth.h"
+#include "net/queue.h"
 #include "exec/hwaddr.h"
 
 /* define to enable packet dump functions */
@@ -160,6 +161,22 @@ void net_tx_pkt_reset(struct NetTxPkt *pkt);
  */
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc);
 
+/**
+ * Send packet to qemu without copying it if the peer can't take it now.
+ * Handles sw offloads if vhdr is not supported; packets that need sw
+ * fragmentation are sent as with net_tx_pkt_send().
+ *
+ * @pkt:            packet
+ * @nc:             NetClientState
+ * @sent_cb:        called once a queued packet was sent or dropped
+ * @queued:         set if the packet was queued, in which case it must
+ *                  not be reset before @sent_cb is called
+ * @ret:            operation result
+ *
+ */
+bool net_tx_pkt_send_zerocopy(struct NetTxPkt *pkt, NetClientState *nc,
+    NetPacketSent *sent_cb, bool *queued);
+
 /**
 * Redirect packet directly to receive path (emulate loopback phy).
 * Handles sw offloads if vhdr is not supported.
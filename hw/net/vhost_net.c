@@ -53,6 +53,7 @@ static const int kernel_feature_bits[] = {
     VIRTIO_F_VERSION_1,
     VIRTIO_NET_F_MTU,
     VIRTIO_F_IOMMU_PLATFORM,
+    VIRTIO_F_RING_PACKED,
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -83,6 +84,8 @@ static const int user_feature_bits[] = {
 
     VIRTIO_NET_F_MQ,
 
+    VIRTIO_F_RING_PACKED,
+
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -25,6 +25,9 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "qapi/visitor.h"
+#include "net_rx_pkt.h"
+#include "trace.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -72,6 +75,45 @@ static int vq2q(int queue_index)
     return queue_index / 2;
 }
 
+/* While the dataplane runs, queue pairs serviced by an IOThread raise
+ * interrupts through irqfds, because virtio_notify() needs the BQL.
+ */
+static void virtio_net_notify(VirtIONetQueue *q, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->ctx && q->n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+/* Device state read by the IOThreads is changed from the main loop with
+ * all of their AioContexts held.
+ */
+static void virtio_net_acquire_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].ctx) {
+            aio_context_acquire(n->vqs[i].ctx);
+        }
+    }
+}
+
+static void virtio_net_release_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].ctx) {
+            aio_context_release(n->vqs[i].ctx);
+        }
+    }
+}
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -233,12 +275,16 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
 
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(&n->vqs[vq2q(virtio_get_queue_index(vq))], vq);
     }
 }
 
+static bool virtio_net_rsc_drain(VirtIONetQueue *q);
+static void virtio_net_rsc_purge(VirtIONetQueue *q);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -249,6 +295,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    virtio_net_acquire_queues(n);
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -264,6 +311,28 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
+        } else {
+            /* Segments held for coalescing were already acknowledged to
+             * the backend, so give them to the guest unless it is resetting
+             * the device or vhost took the ring over.  A stopped VM keeps
+             * them: virtio_net_vm_state_change() delivered what fit while
+             * the VM was still running, and the rest waits for the guest.
+             */
+            if (!(queue_status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+                n->vhost_started) {
+                virtio_net_rsc_purge(q);
+            } else if (q->rsc_pkt && vdev->vm_running) {
+                rcu_read_lock();
+                virtio_net_rsc_drain(q);
+                rcu_read_unlock();
+            }
+            /* Deliver the interrupt the timer was holding back, or the
+             * guest would not see the buffers used before the stop.
+             */
+            if (q->rx_notify_timer && timer_pending(q->rx_notify_timer)) {
+                timer_del(q->rx_notify_timer);
+                virtio_net_notify(q, q->rx_vq);
+            }
         }
 
         if (!q->tx_waiting) {
@@ -293,6 +362,32 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_release_queues(n);
+}
+
+/* Registered after virtio_init(), so this runs before vm_running is cleared
+ * and virtio_net_set_status() stops the queues.
+ */
+static void virtio_net_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    VirtIONet *n = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i;
+
+    if (running || !vdev->vm_running || n->vhost_started) {
+        return;
+    }
+
+    virtio_net_acquire_queues(n);
+    rcu_read_lock();
+    for (i = 0; i < n->curr_queues; i++) {
+        if (n->vqs[i].rsc_pkt) {
+            virtio_net_rsc_drain(&n->vqs[i]);
+        }
+    }
+    rcu_read_unlock();
+    virtio_net_release_queues(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -417,6 +512,12 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
+
+    /* Packets queued for transmission point into the guest's buffers */
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -928,6 +1029,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    virtio_net_acquire_queues(n);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -969,15 +1071,30 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    virtio_net_release_queues(n);
 }
 
 /* RX */
 
+static bool virtio_net_rsc_drain(VirtIONetQueue *q);
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    VirtIONetQueue *q = &n->vqs[queue_index];
+
+    /* Coalesced frames are older than anything queued in the backend */
+    if (!QTAILQ_EMPTY(&q->rsc_flows)) {
+        bool drained;
 
+        rcu_read_lock();
+        drained = virtio_net_rsc_drain(q);
+        rcu_read_unlock();
+        if (!drained) {
+            return;
+        }
+    }
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -1134,8 +1251,13 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+/* Copies one packet into the receive queue.  The used ring entries are
+ * filled starting at offset *used, which is advanced on success; the
+ * caller flushes them and notifies the guest, so that a batch of
+ * packets costs a single flush and interrupt.
+ */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, unsigned *used)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1221,7 +1343,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, *used + i++);
         g_free(elem);
     }
 
@@ -1232,33 +1354,544 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    *used += i;
 
     return size;
 }
 
+/* Length of the window over which the RX packet rate is measured */
+#define RX_COALESCE_WINDOW_NS (10 * SCALE_MS)
+
+/* Once per window, decide from the number of buffers the queue consumed
+ * whether RX interrupts should be coalesced.  Buffers rather than
+ * interrupts are counted, because coalescing itself lowers the interrupt
+ * rate.  Coalescing stops only below half the threshold, so that a rate
+ * close to it does not flip the policy at every window.
+ */
+static void virtio_net_rx_coalesce_update(VirtIONetQueue *q, int64_t now)
+{
+    VirtIONet *n = q->n;
+    VirtQueueStats stats;
+    uint64_t rate;
+
+    if (now - q->rx_window_start < RX_COALESCE_WINDOW_NS) {
+        return;
+    }
+
+    virtio_queue_get_stats(q->rx_vq, &stats);
+    rate = (double)(stats.elements - q->rx_window_elements) *
+           NANOSECONDS_PER_SECOND / (now - q->rx_window_start);
+    q->rx_window_start = now;
+    q->rx_window_elements = stats.elements;
+
+    if (!q->rx_coalescing && rate >= n->net_conf.rx_coalesce_rate) {
+        q->rx_coalescing = true;
+    } else if (q->rx_coalescing && rate < n->net_conf.rx_coalesce_rate / 2) {
+        q->rx_coalescing = false;
+    }
+    trace_virtio_net_rx_coalesce(q, rate, q->rx_coalescing);
+}
+
+static void virtio_net_rx_notify(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    int64_t now;
+
+    if (q->rx_notify_timer) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        virtio_net_rx_coalesce_update(q, now);
+        if (q->rx_coalescing) {
+            if (!timer_pending(q->rx_notify_timer)) {
+                timer_mod(q->rx_notify_timer,
+                          now + n->net_conf.rx_coalesce_usecs * SCALE_US);
+            }
+            return;
+        }
+        timer_del(q->rx_notify_timer);
+    }
+
+    virtio_net_notify(q, q->rx_vq);
+}
+
+static void virtio_net_rx_notify_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    /* Queue pairs in an IOThread receive there */
+    if (q->ctx) {
+        aio_context_acquire(q->ctx);
+    }
+    virtio_net_notify(q, q->rx_vq);
+    if (q->ctx) {
+        aio_context_release(q->ctx);
+    }
+}
+
+static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    unsigned used = 0;
+    ssize_t r;
+
+    r = virtio_net_receive_one(nc, buf, size, &used);
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        virtio_net_rx_notify(q);
+    }
+
+    return r;
+}
+
+/* Receive segment coalescing
+ *
+ * In-order TCP segments of a flow are merged into one frame, which is
+ * handed to the guest as a GSO frame when it has accepted TSO offloads
+ * for the protocol.  The rules follow Linux's GRO: only plain ACK and
+ * ACK|PSH segments with payload are merged, they must carry the same
+ * acknowledgement and TCP options, and anything else that belongs to a
+ * coalesced flow flushes it first so that the flow stays in order.
+ */
+typedef struct VirtioNetRscFlow {
+    QTAILQ_ENTRY(VirtioNetRscFlow) next;
+    uint8_t *buf;               /* host vnet header, then the frame */
+    size_t size;
+    size_t l3_off;              /* header offsets within the frame */
+    size_t l4_off;
+    size_t l5_off;
+    bool is_ip6;
+    bool push;
+    bool closed;                /* ended by a short segment */
+    uint32_t next_seq;
+    uint16_t mss;               /* payload of the first segment */
+    uint16_t segs;
+} VirtioNetRscFlow;
+
+static bool virtio_net_rsc_same_flow(VirtIONet *n, VirtioNetRscFlow *flow,
+                                     const uint8_t *frame, bool is_ip6,
+                                     size_t l3_off, size_t l4_off)
+{
+    const uint8_t *f = flow->buf + n->host_hdr_len;
+
+    if (flow->is_ip6 != is_ip6 || flow->l3_off != l3_off ||
+        flow->l4_off != l4_off) {
+        return false;
+    }
+
+    /* MAC addresses and VLAN tag */
+    if (memcmp(f, frame, l3_off)) {
+        return false;
+    }
+
+    /* IP addresses, then TCP ports */
+    if (is_ip6) {
+        if (memcmp(f + l3_off + offsetof(struct ip6_header, ip6_src),
+                   frame + l3_off + offsetof(struct ip6_header, ip6_src),
+                   2 * sizeof(struct in6_address))) {
+            return false;
+        }
+    } else if (memcmp(f + l3_off + offsetof(struct ip_header, ip_src),
+                      frame + l3_off + offsetof(struct ip_header, ip_src),
+                      2 * sizeof(uint32_t))) {
+        return false;
+    }
+    return !memcmp(f + l4_off, frame + l4_off, 2 * sizeof(uint16_t));
+}
+
+/* Can the segment be merged at all, i.e. start or extend a flow? */
+static bool virtio_net_rsc_segment_ok(VirtIONet *n, const uint8_t *buf,
+                                      size_t size, bool is_ip6,
+                                      size_t l3_off, size_t l4_off,
+                                      size_t l5_off)
+{
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+    const uint8_t *frame = buf + n->host_hdr_len;
+    const struct tcp_header *tcp = (const struct tcp_header *)(frame + l4_off);
+    uint64_t offload = is_ip6 ? VIRTIO_NET_F_GUEST_TSO6
+                              : VIRTIO_NET_F_GUEST_TSO4;
+    uint8_t flags = TCP_HEADER_FLAGS(tcp);
+
+    /* The guest must accept the merged frame as a GSO frame */
+    if (!(n->curr_guest_offloads & (1ULL << offload))) {
+        return false;
+    }
+
+    /* Leave frames that the backend already segmented or left without
+     * a complete checksum alone */
+    if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        return false;
+    }
+
+    if ((flags & ~TH_PUSH) != TH_ACK || l5_off >= size - n->host_hdr_len) {
+        return false;
+    }
+
+    /* No IPv4 options or IPv6 extension headers */
+    if (is_ip6) {
+        return l4_off - l3_off == sizeof(struct ip6_header);
+    }
+    return l4_off - l3_off == sizeof(struct ip_header) &&
+           !IP4_IS_FRAGMENT((const struct ip_header *)(frame + l3_off));
+}
+
+static bool virtio_net_rsc_merge(VirtIONet *n, VirtioNetRscFlow *flow,
+                                 const uint8_t *buf, size_t size,
+                                 size_t l5_off)
+{
+    uint8_t *f = flow->buf + n->host_hdr_len;
+    const uint8_t *frame = buf + n->host_hdr_len;
+    size_t len = size - n->host_hdr_len;
+    struct tcp_header *ftcp = (struct tcp_header *)(f + flow->l4_off);
+    const struct tcp_header *tcp =
+        (const struct tcp_header *)(frame + flow->l4_off);
+    size_t payload = len - l5_off;
+
+    /* The guest resegments the frame into gso_size pieces, so only the
+     * last segment may be shorter than the first one.  A flow that could
+     * not be flushed yet must not grow either.
+     */
+    if (flow->push || flow->closed || payload > flow->mss ||
+        l5_off != flow->l5_off ||
+        ldl_be_p(&tcp->th_seq) != flow->next_seq ||
+        tcp->th_ack != ftcp->th_ack ||
+        memcmp(f + flow->l4_off + sizeof(struct tcp_header),
+               frame + flow->l4_off + sizeof(struct tcp_header),
+               l5_off - flow->l4_off - sizeof(struct tcp_header))) {
+        return false;
+    }
+
+    /* The IP length fields must still fit */
+    if (flow->size - n->host_hdr_len - flow->l3_off + payload > 0xffff) {
+        return false;
+    }
+
+    if (flow->is_ip6) {
+        /* version, traffic class and flow label; hop limit */
+        if (memcmp(f + flow->l3_off, frame + flow->l3_off, 4) ||
+            f[flow->l3_off + 7] != frame[flow->l3_off + 7]) {
+            return false;
+        }
+    } else {
+        const struct ip_header *ip =
+            (const struct ip_header *)(frame + flow->l3_off);
+        struct ip_header *fip = (struct ip_header *)(f + flow->l3_off);
+
+        if (ip->ip_tos != fip->ip_tos || ip->ip_ttl != fip->ip_ttl) {
+            return false;
+        }
+    }
+
+    memcpy(flow->buf + flow->size, frame + l5_off, payload);
+    flow->size += payload;
+    flow->next_seq += payload;
+    flow->segs++;
+    if (payload < flow->mss) {
+        flow->closed = true;
+    }
+    ftcp->th_win = tcp->th_win;
+    if (TCP_HEADER_FLAGS(tcp) & TH_PUSH) {
+        flow->push = true;
+    }
+    return true;
+}
+
+/* Fix up the lengths and checksums of a merged frame and describe it to
+ * the guest as a GSO frame.  Safe to repeat if delivery has to be retried.
+ */
+static void virtio_net_rsc_finalize(VirtIONet *n, VirtioNetRscFlow *flow)
+{
+    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)flow->buf;
+    uint8_t *f = flow->buf + n->host_hdr_len;
+    struct tcp_header *tcp = (struct tcp_header *)(f + flow->l4_off);
+    size_t tcp_len = flow->size - n->host_hdr_len - flow->l4_off;
+    uint32_t sum;
+
+    if (flow->is_ip6) {
+        struct ip6_header *ip6 = (struct ip6_header *)(f + flow->l3_off);
+
+        stw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen, tcp_len);
+        sum = net_checksum_add(2 * sizeof(struct in6_address),
+                               (uint8_t *)&ip6->ip6_src);
+    } else {
+        struct ip_header *ip = (struct ip_header *)(f + flow->l3_off);
+
+        stw_be_p(&ip->ip_len, tcp_len + sizeof(struct ip_header));
+        ip->ip_sum = 0;
+        stw_be_p(&ip->ip_sum,
+                 net_raw_checksum((uint8_t *)ip, sizeof(struct ip_header)));
+        sum = net_checksum_add(2 * sizeof(uint32_t), (uint8_t *)&ip->ip_src);
+    }
+
+    if (flow->push) {
+        stw_be_p(&tcp->th_offset_flags,
+                 lduw_be_p(&tcp->th_offset_flags) | TH_PUSH);
+    }
+    tcp->th_sum = 0;
+    sum += net_checksum_add(tcp_len, (uint8_t *)tcp);
+    sum += IP_PROTO_TCP + tcp_len;
+    stw_be_p(&tcp->th_sum, net_checksum_finish(sum));
+
+    /* The header is in the backend's format, see receive_header() */
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->gso_type = flow->is_ip6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                                 : VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr->gso_size = flow->mss;
+    hdr->hdr_len = flow->l5_off;
+    if (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) {
+        hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    }
+    if (!n->needs_vnet_hdr_swap) {
+        virtio_net_hdr_swap(VIRTIO_DEVICE(n), hdr);
+    }
+}
+
+static void virtio_net_rsc_free(VirtIONetQueue *q, VirtioNetRscFlow *flow)
+{
+    QTAILQ_REMOVE(&q->rsc_flows, flow, next);
+    q->rsc_num_flows--;
+    g_free(flow->buf);
+    g_free(flow);
+}
+
+/* Hand a flow's frame to the guest.  Returns false, keeping the flow,
+ * if the guest is out of receive buffers.
+ */
+static bool virtio_net_rsc_flush(VirtIONetQueue *q, VirtioNetRscFlow *flow)
+{
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic,
+                                           vq2q(virtio_get_queue_index(q->rx_vq)));
+    unsigned used = 0;
+    ssize_t r;
+
+    if (flow->segs > 1) {
+        virtio_net_rsc_finalize(n, flow);
+    }
+
+    r = virtio_net_receive_one(nc, flow->buf, flow->size, &used);
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        virtio_net_rx_notify(q);
+    }
+    if (r == 0) {
+        return false;
+    }
+
+    if (flow->segs > 1) {
+        q->rsc_frames++;
+        q->rsc_coalesced += flow->segs;
+        trace_virtio_net_rsc_flush(q, flow->segs, flow->size);
+    }
+    virtio_net_rsc_free(q, flow);
+    return true;
+}
+
+static bool virtio_net_rsc_drain(VirtIONetQueue *q)
+{
+    VirtioNetRscFlow *flow, *next;
+
+    QTAILQ_FOREACH_SAFE(flow, &q->rsc_flows, next, next) {
+        if (!virtio_net_rsc_flush(q, flow)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void virtio_net_rsc_purge(VirtIONetQueue *q)
+{
+    VirtioNetRscFlow *flow, *next;
+
+    QTAILQ_FOREACH_SAFE(flow, &q->rsc_flows, next, next) {
+        virtio_net_rsc_free(q, flow);
+    }
+    if (q->rsc_timer) {
+        timer_del(q->rsc_timer);
+    }
+}
+
+static void virtio_net_rsc_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+
+    /* Queue pairs in an IOThread receive there */
+    if (q->ctx) {
+        aio_context_acquire(q->ctx);
+    }
+    rcu_read_lock();
+    q->rsc_timeouts++;
+    if (!virtio_net_rsc_drain(q)) {
+        timer_mod(q->rsc_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  n->net_conf.rsc_interval);
+    }
+    rcu_read_unlock();
+    if (q->ctx) {
+        aio_context_release(q->ctx);
+    }
+}
+
+/* Returns true if the packet was dealt with, setting *ret to what the
+ * receive function should return; false if it should be delivered as is.
+ */
+static bool virtio_net_rsc_receive(VirtIONetQueue *q, NetClientState *nc,
+                                   const uint8_t *buf, size_t size,
+                                   ssize_t *ret)
+{
+    VirtIONet *n = q->n;
+    const uint8_t *frame = buf + n->host_hdr_len;
+    size_t len = size - n->host_hdr_len;
+    VirtioNetRscFlow *flow;
+    bool isip4, isip6, isudp, istcp, ok;
+    size_t l3_off, l4_off, l5_off, ip_len;
+
+    if (!n->has_vnet_hdr || size <= n->host_hdr_len ||
+        !virtio_net_can_receive(nc)) {
+        return false;
+    }
+
+    net_rx_pkt_set_protocols(q->rsc_pkt, frame, len);
+    net_rx_pkt_get_protocols(q->rsc_pkt, &isip4, &isip6, &isudp, &istcp);
+    if (!istcp) {
+        return false;
+    }
+    l3_off = net_rx_pkt_get_l3_hdr_offset(q->rsc_pkt);
+    l4_off = net_rx_pkt_get_l4_hdr_offset(q->rsc_pkt);
+    l5_off = net_rx_pkt_get_l5_hdr_offset(q->rsc_pkt);
+    if (l5_off > len) {
+        return false;
+    }
+
+    /* Short frames are padded; only the IP datagram is payload */
+    if (isip6) {
+        ip_len = sizeof(struct ip6_header) +
+            lduw_be_p(&((struct ip6_header *)(frame + l3_off))
+                      ->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    } else {
+        ip_len = lduw_be_p(&((struct ip_header *)(frame + l3_off))->ip_len);
+    }
+    if (l3_off + ip_len < l5_off || l3_off + ip_len > len) {
+        return false;
+    }
+    len = l3_off + ip_len;
+
+    ok = virtio_net_rsc_segment_ok(n, buf, n->host_hdr_len + len, isip6,
+                                   l3_off, l4_off, l5_off);
+
+    QTAILQ_FOREACH(flow, &q->rsc_flows, next) {
+        if (virtio_net_rsc_same_flow(n, flow, frame, isip6, l3_off, l4_off)) {
+            break;
+        }
+    }
+
+    if (flow) {
+        if (ok && virtio_net_rsc_merge(n, flow, buf, n->host_hdr_len + len,
+                                       l5_off)) {
+            if (flow->push || flow->closed) {
+                virtio_net_rsc_flush(q, flow);
+            }
+            *ret = size;
+            return true;
+        }
+        /* Keep the flow in order: what is held goes first */
+        if (!virtio_net_rsc_flush(q, flow)) {
+            *ret = 0;
+            return true;
+        }
+    }
+
+    if (!ok || (TCP_HEADER_FLAGS((struct tcp_header *)(frame + l4_off)) &
+                TH_PUSH)) {
+        return false;
+    }
+
+    if (q->rsc_num_flows == VIRTIO_NET_RSC_MAX_FLOWS &&
+        !virtio_net_rsc_flush(q, QTAILQ_FIRST(&q->rsc_flows))) {
+        *ret = 0;
+        return true;
+    }
+
+    flow = g_new0(VirtioNetRscFlow, 1);
+    flow->buf = g_malloc(n->host_hdr_len + 0xffff + l3_off);
+    memcpy(flow->buf, buf, n->host_hdr_len + len);
+    flow->size = n->host_hdr_len + len;
+    flow->l3_off = l3_off;
+    flow->l4_off = l4_off;
+    flow->l5_off = l5_off;
+    flow->is_ip6 = isip6;
+    flow->next_seq = ldl_be_p(&((struct tcp_header *)(frame + l4_off))->th_seq) +
+                     (len - l5_off);
+    flow->mss = len - l5_off;
+    flow->segs = 1;
+    QTAILQ_INSERT_TAIL(&q->rsc_flows, flow, next);
+    q->rsc_num_flows++;
+
+    if (!timer_pending(q->rsc_timer)) {
+        timer_mod(q->rsc_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  n->net_conf.rsc_interval);
+    }
+    *ret = size;
+    return true;
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     ssize_t r;
 
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    if (!q->rsc_pkt || !virtio_net_rsc_receive(q, nc, buf, size, &r)) {
+        r = virtio_net_receive_rcu(nc, buf, size);
+    }
     rcu_read_unlock();
     return r;
 }
 
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    unsigned used = 0;
+    int i;
+
+    /* Coalescing does its own batching */
+    if (q->rsc_pkt) {
+        for (i = 0; i < count; i++) {
+            if (virtio_net_receive(nc, pkts[i].iov_base,
+                                   pkts[i].iov_len) == 0) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    rcu_read_lock();
+    for (i = 0; i < count; i++) {
+        /* A negative return means the packet was dropped */
+        if (virtio_net_receive_one(nc, pkts[i].iov_base, pkts[i].iov_len,
+                                   &used) == 0) {
+            break;
+        }
+    }
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        virtio_net_rx_notify(q);
+    }
+    rcu_read_unlock();
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(q, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -1288,7 +1921,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         ssize_t ret;
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+        struct virtio_net_hdr_mrg_rxbuf *mhdr = &q->async_tx.hdr;
 
         elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1305,7 +1938,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         }
 
         if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            if (iov_to_buf(out_sg, out_num, 0, mhdr, n->guest_hdr_len) <
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
@@ -1313,8 +1946,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
+                virtio_net_hdr_swap(vdev, (void *) mhdr);
+                sg2[0].iov_base = mhdr;
                 sg2[0].iov_len = n->guest_hdr_len;
                 out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
                                    out_sg, out_num,
@@ -1343,8 +1976,10 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        /* elem stays mapped until virtio_net_tx_complete() pushes it */
+        ret = qemu_sendv_packet_zerocopy(qemu_get_subqueue(n->nic, queue_index),
+                                         out_sg, out_num,
+                                         virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
@@ -1353,16 +1988,42 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_notify(q, q->tx_vq);
         g_free(elem);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
             break;
         }
     }
     return num_packets;
 }
 
+/* With tx=adaptive, grow the burst while flushes keep filling it and
+ * shrink it when the guest transmits slowly or the backend pushes back,
+ * so that a lightly loaded queue does not hold the main loop for long
+ * and a busy one is drained without bouncing notifications on and off.
+ */
+static void virtio_net_tx_update_burst(VirtIONetQueue *q, int32_t ret)
+{
+    VirtIONet *n = q->n;
+    int32_t burst = q->tx_burst;
+
+    if (!n->tx_adaptive || ret == -EINVAL) {
+        return;
+    }
+
+    if (ret == -EBUSY || ret < burst / 4) {
+        burst = MAX(burst / 2, MIN(TX_BURST_MIN, n->tx_burst));
+    } else if (ret >= burst) {
+        burst = MIN(burst * 2, n->tx_burst);
+    }
+
+    if (burst != q->tx_burst) {
+        trace_virtio_net_tx_burst(q, ret, burst);
+        q->tx_burst = burst;
+    }
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1444,6 +2105,7 @@ static void virtio_net_tx_bh(void *opaque)
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int32_t burst = q->tx_burst;
     int32_t ret;
 
     /* This happens when device was stopped but BH wasn't. */
@@ -1461,6 +2123,7 @@ static void virtio_net_tx_bh(void *opaque)
     }
 
     ret = virtio_net_flush_tx(q);
+    virtio_net_tx_update_burst(q, ret);
     if (ret == -EBUSY || ret == -EINVAL) {
         return; /* Notification re-enable handled by tx_complete or device
                  * broken */
@@ -1468,7 +2131,7 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= burst) {
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1488,6 +2151,293 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+/* TX virtqueue handler for queue pairs serviced by an IOThread.  It runs
+ * in the IOThread's AioContext, which busy-polls the virtqueue for up to
+ * the IOThread's poll-max-ns (adapting the polling time to how often
+ * polling finds work) before falling back to the ioeventfd.  The backend
+ * lives in the same AioContext, so packets are sent without the BQL.
+ */
+static bool virtio_net_handle_tx_aio(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    int32_t burst, ret = 0;
+
+    aio_context_acquire(q->ctx);
+
+    /* The main loop may have stopped ioeventfd while we waited for the lock */
+    if (!q->tx_aio_started || !vdev->vm_running) {
+        goto out;
+    }
+
+    if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
+        virtio_net_drop_tx_queue_data(vdev, vq);
+        goto out;
+    }
+
+    burst = q->tx_burst;
+    ret = virtio_net_flush_tx(q);
+    virtio_net_tx_update_burst(q, ret);
+    if (ret == -EBUSY || ret == -EINVAL) {
+        goto out;
+    }
+
+    /* Come back right away if the burst was full or the guest queued more
+     * packets before seeing notification re-enabled.  While the AioContext
+     * is polling, it disables notification again after we return.
+     */
+    if (ret < burst) {
+        virtio_queue_set_notification(vq, 1);
+    }
+    if (ret >= burst || !virtio_queue_empty(vq)) {
+        virtio_queue_set_notification(vq, 0);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+
+out:
+    aio_context_release(q->ctx);
+    return ret > 0;
+}
+
+/* RX virtqueue handler for queue pairs serviced by an IOThread: new
+ * buffers let packets queued by the backend through.  This never counts
+ * as progress, since the ring is normally full of buffers and polling
+ * would otherwise never stop.
+ */
+static bool virtio_net_handle_rx_aio(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    aio_context_acquire(q->ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(q->ctx);
+    return false;
+}
+
+/* Context: QEMU global mutex held
+ *
+ * Move every queue pair, together with its backend, to its IOThread.
+ * Guest notifiers are used for interrupts, as in virtio-blk dataplane.
+ */
+static int virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    /* A netfilter may have been attached to a backend since realize */
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!qemu_net_can_set_aio_context(nc->peer)) {
+            error_report("virtio-net: netdev cannot run in an IOThread");
+            return -ENOTSUP;
+        }
+    }
+
+    /* Interrupts come from irqfds now, not from vhost's masked notifiers */
+    vdev->use_guest_notifier_mask = false;
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        vdev->use_guest_notifier_mask = true;
+        return r;
+    }
+
+    /* Assigns the host notifiers and kicks them */
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r < 0) {
+        k->set_guest_notifiers(qbus->parent, nvqs, false);
+        vdev->use_guest_notifier_mask = true;
+        return r;
+    }
+
+    n->dataplane_started = true;
+    trace_virtio_net_dataplane_start(n);
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        aio_context_acquire(q->ctx);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   NULL);
+        q->tx_aio_started = true;
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                                                   virtio_net_handle_rx_aio);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                                                   virtio_net_handle_tx_aio);
+        qemu_net_set_aio_context(nc->peer, q->ctx);
+        aio_context_release(q->ctx);
+    }
+    return 0;
+}
+
+/* Context: IOThread of the queue pair */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    /* Flushes anything kicked in the meantime, so clear tx_aio_started
+     * only afterwards. */
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+    q->tx_aio_started = false;
+    aio_context_release(q->ctx);
+
+    qemu_event_set(&q->n->dataplane_stop_done);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    trace_virtio_net_dataplane_stop(n);
+
+    /* Detach the virtqueues from within each IOThread, so that no handler
+     * is still running afterwards, then bring the backend home.
+     */
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!q->tx_aio_started) {
+            continue;
+        }
+        qemu_event_reset(&n->dataplane_stop_done);
+        aio_bh_schedule_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        qemu_event_wait(&n->dataplane_stop_done);
+
+        qemu_net_set_aio_context(nc->peer, NULL);
+    }
+
+    virtio_device_stop_ioeventfd_impl(vdev);
+
+    k->set_guest_notifiers(qbus->parent, virtio_get_num_queues(vdev), false);
+    vdev->use_guest_notifier_mask = true;
+    n->dataplane_started = false;
+}
+
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    if (n->num_iothreads) {
+        return virtio_net_dataplane_start(n);
+    }
+    return virtio_device_start_ioeventfd_impl(vdev);
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    if (n->num_iothreads) {
+        virtio_net_dataplane_stop(n);
+        return;
+    }
+    virtio_device_stop_ioeventfd_impl(vdev);
+}
+
+/* Context: QEMU global mutex held
+ *
+ * Look up the IOThread of the iothread property, or those named in the
+ * colon-separated iothreads property, after checking that the transport
+ * and every backend can follow the queue pairs into them.  A single
+ * iothread services all queue pairs.  Returns 0, or -1 on error.
+ */
+static int virtio_net_dataplane_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    const char *prop = n->net_conf.iothread ? "iothread" : "iothreads";
+    char **ids;
+    int i, num;
+
+    if (n->net_conf.iothread && n->net_conf.iothreads) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return -1;
+    }
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with %s "
+                   "(transport does not support notifiers)", prop);
+        return -1;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for %s", prop);
+        return -1;
+    }
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!qemu_net_can_set_aio_context(peer)) {
+            error_setg(errp, "%s requires a netdev that can run in "
+                       "an IOThread, such as tap, and has no filters", prop);
+            return -1;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "%s cannot be used together with vhost", prop);
+            return -1;
+        }
+    }
+
+    if (n->net_conf.iothread) {
+        n->iothreads = g_new(IOThread *, 1);
+        n->iothreads[0] = n->net_conf.iothread;
+        object_ref(OBJECT(n->iothreads[0]));
+        n->num_iothreads = 1;
+        return 0;
+    }
+
+    ids = g_strsplit(n->net_conf.iothreads, ":", -1);
+    num = g_strv_length(ids);
+    if (num == 0) {
+        error_setg(errp, "iothreads must name at least one IOThread");
+        g_strfreev(ids);
+        return -1;
+    }
+
+    n->iothreads = g_new0(IOThread *, num);
+    for (i = 0; i < num; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+        IOThread *iothread;
+
+        iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            while (i--) {
+                object_unref(OBJECT(n->iothreads[i]));
+            }
+            g_free(n->iothreads);
+            n->iothreads = NULL;
+            g_strfreev(ids);
+            return -1;
+        }
+        object_ref(OBJECT(iothread));
+        n->iothreads[i] = iothread;
+    }
+    n->num_iothreads = num;
+
+    g_strfreev(ids);
+    return 0;
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1506,7 +2456,27 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    if (n->net_conf.rx_coalesce_usecs) {
+        n->vqs[index].rx_notify_timer =
+            timer_new_ns(QEMU_CLOCK_VIRTUAL, virtio_net_rx_notify_timer,
+                         &n->vqs[index]);
+    }
+
+    QTAILQ_INIT(&n->vqs[index].rsc_flows);
+    if (n->net_conf.rsc) {
+        net_rx_pkt_init(&n->vqs[index].rsc_pkt, false);
+        n->vqs[index].rsc_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                               virtio_net_rsc_timer,
+                                               &n->vqs[index]);
+    }
+
     n->vqs[index].tx_waiting = 0;
+    n->vqs[index].tx_burst = n->tx_adaptive ?
+        MIN(TX_BURST_MIN, n->net_conf.txburst) : n->net_conf.txburst;
+    if (n->num_iothreads) {
+        n->vqs[index].ctx = iothread_get_aio_context(
+            n->iothreads[index % n->num_iothreads]);
+    }
     n->vqs[index].n = n;
 }
 
@@ -1519,6 +2489,18 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     qemu_purge_queued_packets(nc);
 
     virtio_del_queue(vdev, index * 2);
+    if (q->rx_notify_timer) {
+        timer_del(q->rx_notify_timer);
+        timer_free(q->rx_notify_timer);
+        q->rx_notify_timer = NULL;
+    }
+    if (q->rsc_pkt) {
+        virtio_net_rsc_purge(q);
+        timer_free(q->rsc_timer);
+        q->rsc_timer = NULL;
+        net_rx_pkt_uninit(q->rsc_pkt);
+        q->rsc_pkt = NULL;
+    }
     if (q->tx_timer) {
         timer_del(q->tx_timer);
         timer_free(q->tx_timer);
@@ -1831,6 +2813,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1923,16 +2906,35 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->tx_timeout = n->net_conf.txtimer;
 
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
-                       && strcmp(n->net_conf.tx, "bh")) {
+                       && strcmp(n->net_conf.tx, "bh")
+                       && strcmp(n->net_conf.tx, "adaptive")) {
         error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
-                     n->net_conf.tx);
+                     "Unknown option tx=%s, valid options: \"timer\" \"bh\" "
+                     "\"adaptive\"", n->net_conf.tx);
         error_report("Defaulting to \"bh\"");
     }
+    n->tx_adaptive = n->net_conf.tx && !strcmp(n->net_conf.tx, "adaptive");
+
+    if (n->net_conf.iothread && !n->tx_adaptive) {
+        error_setg(errp, "iothread requires tx=adaptive");
+        virtio_cleanup(vdev);
+        return;
+    }
+
+    if ((n->net_conf.iothread || n->net_conf.iothreads) &&
+        virtio_net_dataplane_init(n, errp) < 0) {
+        virtio_cleanup(vdev);
+        return;
+    }
+    qemu_event_init(&n->dataplane_stop_done, false);
 
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
+    if (n->net_conf.rsc) {
+        n->rsc_vmstate =
+            qemu_add_vm_change_state_handler(virtio_net_vm_state_change, n);
+    }
 
     n->ctrl_vq = virtio_add_queue(vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&n->nic_conf.macaddr);
@@ -2001,13 +3003,60 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         virtio_net_del_queue(n, i);
     }
 
+    if (n->rsc_vmstate) {
+        qemu_del_vm_change_state_handler(n->rsc_vmstate);
+    }
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    qemu_event_destroy(&n->dataplane_stop_done);
     virtio_cleanup(vdev);
 }
 
+static void virtio_net_rsc_get_stats(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    VirtIONet *n = opaque;
+    uint64_t coalesced = 0, frames = 0, timeouts = 0;
+    Error *err = NULL;
+    int i;
+
+    for (i = 0; n->vqs && i < n->max_queues; i++) {
+        coalesced += n->vqs[i].rsc_coalesced;
+        frames += n->vqs[i].rsc_frames;
+        timeouts += n->vqs[i].rsc_timeouts;
+    }
+
+    visit_start_struct(v, name, NULL, 0, &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_uint64(v, "coalesced-segments", &coalesced, &err);
+    if (err) {
+        goto out_end;
+    }
+    visit_type_uint64(v, "coalesced-frames", &frames, &err);
+    if (err) {
+        goto out_end;
+    }
+    visit_type_uint64(v, "timeouts", &timeouts, &err);
+    if (err) {
+        goto out_end;
+    }
+    visit_check_struct(v, &err);
+out_end:
+    visit_end_struct(v, NULL);
+out:
+    error_propagate(errp, err);
+}
+
 static void virtio_net_instance_init(Object *obj)
 {
     VirtIONet *n = VIRTIO_NET(obj);
@@ -2020,6 +3069,12 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
+    object_property_add(obj, "rsc-stats", "receive segment coalescing stats",
+                        virtio_net_rsc_get_stats, NULL, NULL, n, NULL);
 }
 
 static void virtio_net_pre_save(void *opaque)
@@ -2087,9 +3142,17 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_STRING("iothreads", VirtIONet, net_conf.iothreads),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_UINT16("host_mtu", VirtIONet, net_conf.mtu, 0),
+    DEFINE_PROP_UINT32("rx_coalesce_usecs", VirtIONet,
+                       net_conf.rx_coalesce_usecs, 0),
+    DEFINE_PROP_UINT32("rx_coalesce_rate", VirtIONet,
+                       net_conf.rx_coalesce_rate, RX_COALESCE_RATE),
+    DEFINE_PROP_BOOL("rsc", VirtIONet, net_conf.rsc, false),
+    DEFINE_PROP_UINT32("rsc_interval", VirtIONet, net_conf.rsc_interval,
+                       VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2112,6 +3175,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->set_status = virtio_net_set_status;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
     vdc->vmsd = &vmstate_virtio_net_device;
 }
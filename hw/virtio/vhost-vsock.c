@@ -23,6 +23,17 @@
 #include "qemu/iov.h"
 #include "monitor/monitor.h"
 
+/* Features supported by the host kernel */
+static const int feature_bits[] = {
+    VIRTIO_F_VERSION_1,
+    VIRTIO_RING_F_INDIRECT_DESC,
+    VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_NOTIFY_ON_EMPTY,
+    VIRTIO_F_IOMMU_PLATFORM,
+    VIRTIO_F_RING_PACKED,
+    VHOST_INVALID_FEATURE_BIT
+};
+
 enum {
     VHOST_VSOCK_SAVEVM_VERSION = 0,
 
@@ -179,8 +190,13 @@ static uint64_t vhost_vsock_get_features(VirtIODevice *vdev,
                                          uint64_t requested_features,
                                          Error **errp)
 {
-    /* No feature bits used yet */
-    return requested_features;
+    VHostVSock *vsock = VHOST_VSOCK(vdev);
+
+    /* No device specific feature bits yet, but the backend must support
+     * the ring layout and the transport features that were requested.
+     */
+    return vhost_get_features(&vsock->vhost_dev, feature_bits,
+                              requested_features);
 }
 
 static void vhost_vsock_handle_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -24,6 +24,7 @@
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
+#include "qmp-commands.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -60,6 +61,30 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* Completions staged by virtqueue_fill() until virtqueue_flush() writes
+ * them back to a packed ring.
+ */
+typedef struct VRingPackedUsedElem
+{
+    unsigned int id;
+    unsigned int len;
+    unsigned int ndescs;
+} VRingPackedUsedElem;
+
 typedef struct VRingMemoryRegionCaches {
     struct rcu_head rcu;
     MemoryRegionCache desc;
@@ -84,11 +109,16 @@ struct VirtQueue
 
     /* Next head to pop */
     uint16_t last_avail_idx;
+    bool last_avail_wrap_counter;
 
     /* Last avail_idx read from VQ. */
     uint16_t shadow_avail_idx;
 
     uint16_t used_idx;
+    bool used_wrap_counter;
+
+    /* Packed ring only: completions not yet flushed */
+    VRingPackedUsedElem *used_elems;
 
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -103,6 +133,15 @@ struct VirtQueue
 
     unsigned int inuse;
 
+    /* Notification statistics, see query-virtio-stats */
+    struct {
+        uint64_t kicks;
+        uint64_t interrupts;
+        uint64_t interrupts_suppressed;
+        uint64_t elements;
+        uint64_t descriptors;
+    } stats;
+
     uint16_t vector;
     VirtIOHandleOutput handle_output;
     VirtIOHandleAIOOutput handle_aio_output;
@@ -134,6 +173,10 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     int64_t len;
 
     event_size = virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        /* The event suppression structures have a fixed size.  */
+        event_size = 0;
+    }
 
     addr = vq->vring.desc;
     if (!addr) {
@@ -206,6 +249,106 @@ static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
     virtio_tswap16s(vdev, &desc->next);
 }
 
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read_flags(VirtIODevice *vdev, uint16_t *flags,
+                                         MemoryRegionCache *cache, int i)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc) + offsetof(VRingPackedDesc, flags);
+
+    *flags = virtio_lduw_phys_cached(vdev, cache, off);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i,
+                                   bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
+
+    if (strict_order) {
+        /* Make sure the flags are read before the rest of the descriptor. */
+        smp_rmb();
+    }
+
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
+                              &desc->addr, sizeof(desc->addr));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
+                              &desc->len, sizeof(desc->len));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
+                              &desc->id, sizeof(desc->id));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_write(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                    MemoryRegionCache *cache, int i,
+                                    bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+    hwaddr off_id = off + offsetof(VRingPackedDesc, id);
+    hwaddr off_len = off + offsetof(VRingPackedDesc, len);
+    hwaddr off_flags = off + offsetof(VRingPackedDesc, flags);
+
+    virtio_stw_phys_cached(vdev, cache, off_id, desc->id);
+    virtio_stl_phys_cached(vdev, cache, off_len, desc->len);
+
+    if (strict_order) {
+        /* Make sure id and len are written before the flags. */
+        smp_wmb();
+    }
+
+    virtio_stw_phys_cached(vdev, cache, off_flags, desc->flags);
+    address_space_cache_invalidate(cache, off, sizeof(VRingPackedDesc));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    hwaddr off_off = offsetof(VRingPackedDescEvent, off_wrap);
+    hwaddr off_flags = offsetof(VRingPackedDescEvent, flags);
+
+    e->flags = virtio_lduw_phys_cached(vdev, cache, off_flags);
+    /* Make sure the flags are seen before off_wrap. */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys_cached(vdev, cache, off_off);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_off_wrap_write(VirtIODevice *vdev,
+                                        MemoryRegionCache *cache,
+                                        uint16_t off_wrap)
+{
+    hwaddr off = offsetof(VRingPackedDescEvent, off_wrap);
+
+    virtio_stw_phys_cached(vdev, cache, off, off_wrap);
+    address_space_cache_invalidate(cache, off, sizeof(off_wrap));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_flags_write(VirtIODevice *vdev,
+                                     MemoryRegionCache *cache, uint16_t flags)
+{
+    hwaddr off = offsetof(VRingPackedDescEvent, flags);
+
+    virtio_stw_phys_cached(vdev, cache, off, flags);
+    address_space_cache_invalidate(cache, off, sizeof(flags));
+}
+
+static bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail, used;
+
+    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+    return (avail != used) && (avail == wrap_counter);
+}
+
 static VRingMemoryRegionCaches *vring_get_region_caches(struct VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
@@ -312,15 +455,25 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
     address_space_cache_invalidate(&caches->used, pa, sizeof(val));
 }
 
-void virtio_queue_set_notification(VirtQueue *vq, int enable)
+/* Called within rcu_read_lock().  */
+static inline void vring_packed_set_avail_event(VirtQueue *vq)
 {
-    vq->notification = enable;
+    VRingMemoryRegionCaches *caches;
+    uint16_t off_wrap;
 
-    if (!vq->vring.desc) {
+    if (!vq->notification) {
         return;
     }
 
-    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    off_wrap = vq->last_avail_idx |
+               vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    vring_packed_off_wrap_write(vq->vdev, &caches->used, off_wrap);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_split_set_notification(VirtQueue *vq, int enable)
+{
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
@@ -328,6 +481,43 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     } else {
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
     }
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* Make sure off_wrap is written before the flags. */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+
+    vring_packed_flags_write(vq->vdev, &caches->used, flags);
+}
+
+void virtio_queue_set_notification(VirtQueue *vq, int enable)
+{
+    trace_virtio_queue_set_notification(vq, enable);
+    vq->notification = enable;
+
+    if (!vq->vring.desc) {
+        return;
+    }
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else {
+        virtio_queue_split_set_notification(vq, enable);
+    }
     if (enable) {
         /* Expose avail event/used flags before caller checks the avail idx. */
         smp_mb();
@@ -343,7 +533,7 @@ int virtio_queue_ready(VirtQueue *vq)
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers.
  * Called within rcu_read_lock().  */
-static int virtio_queue_empty_rcu(VirtQueue *vq)
+static int virtio_queue_split_empty_rcu(VirtQueue *vq)
 {
     if (unlikely(!vq->vring.avail)) {
         return 1;
@@ -356,6 +546,34 @@ static int virtio_queue_empty_rcu(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+/* A packed ring has no avail index; the flags of the next descriptor
+ * tell whether the driver has made it available.
+ * Called within rcu_read_lock().  */
+static int virtio_queue_packed_empty_rcu(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+    uint16_t flags;
+
+    if (unlikely(!vq->vring.desc)) {
+        return 1;
+    }
+
+    caches = vring_get_region_caches(vq);
+    vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                 vq->last_avail_idx);
+
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
+/* Called within rcu_read_lock().  */
+static int virtio_queue_empty_rcu(VirtQueue *vq)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty_rcu(vq);
+    }
+    return virtio_queue_split_empty_rcu(vq);
+}
+
 int virtio_queue_empty(VirtQueue *vq)
 {
     bool empty;
@@ -364,6 +582,13 @@ int virtio_queue_empty(VirtQueue *vq)
         return 1;
     }
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        rcu_read_lock();
+        empty = virtio_queue_packed_empty_rcu(vq);
+        rcu_read_unlock();
+        return empty;
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -411,7 +636,11 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vq->inuse -= elem->ndescs;
+    } else {
+        vq->inuse--;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -426,7 +655,16 @@ void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+        vq->shadow_avail_idx = vq->last_avail_idx;
+    } else {
+        vq->last_avail_idx--;
+    }
     virtqueue_detach_element(vq, elem, len);
 }
 
@@ -442,27 +680,107 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
  * Returns: true on success, false if @num is greater than the number of in use
  * elements.
  */
+/* Elements of a packed ring may span several descriptors, so walk back
+ * over the chains ending at last_avail_idx.  The device has not written
+ * anything into the last vq->inuse slots yet, so their flags are still
+ * those set by the driver.
+ * Called within rcu_read_lock().  */
+static bool virtqueue_packed_rewind(VirtQueue *vq, unsigned int num)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int ndescs = 0;
+    uint16_t flags;
+
+    while (num--) {
+        do {
+            if (ndescs == vq->inuse) {
+                return false;
+            }
+            if (idx == 0) {
+                idx = vq->vring.num;
+                wrap_counter ^= 1;
+            }
+            idx--;
+            ndescs++;
+
+            /* The chain starts after a descriptor without NEXT. */
+            flags = 0;
+            if (ndescs < vq->inuse) {
+                vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                             (idx ? idx : vq->vring.num) - 1);
+            }
+        } while (flags & VRING_DESC_F_NEXT);
+    }
+
+    vq->last_avail_idx = idx;
+    vq->last_avail_wrap_counter = wrap_counter;
+    vq->shadow_avail_idx = idx;
+    vq->inuse -= ndescs;
+    return true;
+}
+
 bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
 {
+    bool ok;
+
     if (num > vq->inuse) {
         return false;
     }
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        rcu_read_lock();
+        ok = virtqueue_packed_rewind(vq, num);
+        rcu_read_unlock();
+        return ok;
+    }
     vq->last_avail_idx -= num;
     vq->inuse -= num;
     return true;
 }
 
 /* Called within rcu_read_lock().  */
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
+    idx = (idx + vq->used_idx) % vq->vring.num;
+
+    uelem.id = elem->index;
+    uelem.len = len;
+    vring_used_write(vq, &uelem, idx);
+}
+
+/* Used descriptors of a packed ring are only written by
+ * virtqueue_flush(), because the position of each one depends on the
+ * number of descriptors consumed by the elements before it.
+ */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    if (idx >= vq->vring.num) {
+        virtio_error(vq->vdev, "Used element %u out of range", idx);
+        return;
+    }
+
+    vq->used_elems[idx].id = elem->index;
+    vq->used_elems[idx].len = len;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+}
+
+/* Called within rcu_read_lock().  */
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
     trace_virtqueue_fill(vq, elem, len, idx);
 
     virtqueue_unmap_sg(vq, elem, len);
 
     if (unlikely(vq->vdev->broken)) {
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            vq->used_elems[idx % vq->vring.num].ndescs = elem->ndescs;
+        }
         return;
     }
 
@@ -470,30 +788,46 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
-    idx = (idx + vq->used_idx) % vq->vring.num;
-
-    uelem.id = elem->index;
-    uelem.len = len;
-    vring_used_write(vq, &uelem, idx);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+    } else {
+        virtqueue_split_fill(vq, elem, len, idx);
+    }
 }
 
 /* Called within rcu_read_lock().  */
-void virtqueue_flush(VirtQueue *vq, unsigned int count)
+static void virtqueue_packed_fill_desc(VirtQueue *vq,
+                                       const VRingPackedUsedElem *uelem,
+                                       unsigned int idx, bool strict_order)
 {
-    uint16_t old, new;
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    bool wrap_counter = vq->used_wrap_counter;
+    VRingPackedDesc desc = {
+        .id = uelem->id,
+        .len = uelem->len,
+    };
 
-    if (unlikely(vq->vdev->broken)) {
-        vq->inuse -= count;
-        return;
+    idx += vq->used_idx;
+    if (idx >= vq->vring.num) {
+        idx -= vq->vring.num;
+        wrap_counter ^= 1;
     }
 
-    if (unlikely(!vq->vring.used)) {
-        return;
+    if (wrap_counter) {
+        desc.flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+        desc.flags |= 1 << VRING_PACKED_DESC_F_USED;
     }
 
+    vring_packed_desc_write(vq->vdev, &desc, &caches->desc, idx, strict_order);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t old, new;
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
-    trace_virtqueue_flush(vq, count);
     old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
@@ -502,6 +836,64 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, ndescs;
+
+    if (!count) {
+        return;
+    }
+
+    /* Each element occupies as many slots as it consumed descriptors.
+     * The first one is written last, so that the driver never sees a
+     * partially written batch.
+     */
+    ndescs = vq->used_elems[0].ndescs;
+    for (i = 1; i < count; i++) {
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], ndescs, false);
+        ndescs += vq->used_elems[i].ndescs;
+    }
+    virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
+
+    vq->inuse -= ndescs;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+}
+
+/* Called within rcu_read_lock().  */
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+
+    if (unlikely(vq->vdev->broken)) {
+        if (packed) {
+            unsigned int i;
+
+            for (i = 0; i < count; i++) {
+                vq->inuse -= vq->used_elems[i].ndescs;
+            }
+        } else {
+            vq->inuse -= count;
+        }
+        return;
+    }
+
+    if (unlikely(!vq->vring.used)) {
+        return;
+    }
+
+    trace_virtqueue_flush(vq, count);
+    if (packed) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -577,9 +969,12 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes)
 {
     VirtIODevice *vdev = vq->vdev;
     unsigned int max, idx;
@@ -589,17 +984,6 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     int64_t len = 0;
     int rc;
 
-    if (unlikely(!vq->vring.desc)) {
-        if (in_bytes) {
-            *in_bytes = 0;
-        }
-        if (out_bytes) {
-            *out_bytes = 0;
-        }
-        return;
-    }
-
-    rcu_read_lock();
     idx = vq->last_avail_idx;
     total_bufs = in_total = out_total = 0;
 
@@ -686,20 +1070,172 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         goto err;
     }
 
-done:
-    address_space_cache_destroy(&indirect_desc_cache);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    *in_bytes = in_total;
+    *out_bytes = out_total;
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+static int virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                           VRingPackedDesc *desc,
+                                           MemoryRegionCache *desc_cache,
+                                           unsigned int max,
+                                           unsigned int *next,
+                                           bool indirect)
+{
+    /* If this descriptor says it doesn't chain, we're done.  Indirect
+     * tables have no NEXT flag and simply end with the table. */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return VIRTQUEUE_READ_DESC_DONE;
+    }
+
+    ++*next;
+    if (*next == max) {
+        if (indirect) {
+            return VIRTQUEUE_READ_DESC_DONE;
+        }
+        *next = 0;
+    }
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, *next, false);
+    return VIRTQUEUE_READ_DESC_MORE;
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int idx;
+    unsigned int total_bufs, in_total, out_total;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    bool wrap_counter;
+    int64_t len = 0;
+    int rc;
+
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+    total_bufs = in_total = out_total = 0;
+
+    caches = vring_get_region_caches(vq);
+    if (caches->desc.len < vq->vring.num * sizeof(VRingPackedDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto err;
+    }
+
+    while (total_bufs < vq->vring.num) {
+        MemoryRegionCache *desc_cache = &caches->desc;
+        unsigned int max = vq->vring.num;
+        unsigned int num_bufs = total_bufs;
+        unsigned int i = idx;
+        VRingPackedDesc desc;
+
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+        if (!is_desc_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                virtio_error(vdev, "Invalid size for indirect buffer table");
+                goto err;
+            }
+
+            /* loop over the indirect descriptor table */
+            len = address_space_cache_init(&indirect_desc_cache,
+                                           vdev->dma_as,
+                                           desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            if (len < desc.len) {
+                virtio_error(vdev, "Cannot map indirect buffer");
+                goto err;
+            }
+
+            max = desc.len / sizeof(VRingPackedDesc);
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max,
+                                                 &i, desc_cache ==
+                                                 &indirect_desc_cache);
+        } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+        if (desc_cache == &indirect_desc_cache) {
+            address_space_cache_destroy(&indirect_desc_cache);
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    *in_bytes = in_total;
+    *out_bytes = out_total;
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    unsigned int in_total = 0, out_total = 0;
+
+    if (likely(vq->vring.desc)) {
+        rcu_read_lock();
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            virtqueue_packed_get_avail_bytes(vq, &in_total, &out_total,
+                                             max_in_bytes, max_out_bytes);
+        } else {
+            virtqueue_split_get_avail_bytes(vq, &in_total, &out_total,
+                                            max_in_bytes, max_out_bytes);
+        }
+        rcu_read_unlock();
+    }
+
     if (in_bytes) {
         *in_bytes = in_total;
     }
     if (out_bytes) {
         *out_bytes = out_total;
     }
-    rcu_read_unlock();
-    return;
-
-err:
-    in_total = out_total = 0;
-    goto done;
 }
 
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
@@ -825,7 +1361,7 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     VRingMemoryRegionCaches *caches;
@@ -837,6 +1373,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int elem_entries = 0;
     VRingDesc desc;
     int rc;
 
@@ -926,6 +1463,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             virtio_error(vdev, "Looped descriptor");
             goto err_undo_map;
         }
+        elem_entries++;
 
         rc = virtqueue_read_next_desc(vdev, &desc, desc_cache, max, &i);
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
@@ -937,6 +1475,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = head;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -947,6 +1486,152 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 
     vq->inuse++;
+    vq->stats.elements++;
+    vq->stats.descriptors += elem_entries;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
+
+    return elem;
+
+err_undo_map:
+    virtqueue_undo_map_desc(out_num, in_num, iov);
+    goto done;
+}
+
+/* Consume @ndescs descriptors at last_avail_idx of a packed ring.
+ * Called within rcu_read_lock().  */
+static void virtqueue_packed_advance_avail(VirtQueue *vq, unsigned int ndescs)
+{
+    vq->inuse += ndescs;
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+}
+
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, max;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    int64_t len;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num, elem_entries;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    uint16_t id;
+    int rc;
+
+    if (unlikely(vdev->broken)) {
+        return NULL;
+    }
+    rcu_read_lock();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        goto done;
+    }
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = elem_entries = 0;
+
+    max = vq->vring.num;
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        goto done;
+    }
+
+    i = vq->last_avail_idx;
+
+    caches = vring_get_region_caches(vq);
+    if (caches->desc.len < max * sizeof(VRingPackedDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto done;
+    }
+
+    desc_cache = &caches->desc;
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            virtio_error(vdev, "Invalid size for indirect buffer table");
+            goto done;
+        }
+
+        /* loop over the indirect descriptor table */
+        len = address_space_cache_init(&indirect_desc_cache, vdev->dma_as,
+                                       desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        if (len < desc.len) {
+            virtio_error(vdev, "Cannot map indirect buffer");
+            goto done;
+        }
+
+        max = desc.len / sizeof(VRingPackedDesc);
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        bool map_ok;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+                                        iov + out_num,
+                                        VIRTQUEUE_MAX_SIZE - out_num, true,
+                                        desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                virtio_error(vdev, "Incorrect order for descriptors");
+                goto err_undo_map;
+            }
+            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+                                        VIRTQUEUE_MAX_SIZE, false,
+                                        desc.addr, desc.len);
+        }
+        if (!map_ok) {
+            goto err_undo_map;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++elem_entries > max) {
+            virtio_error(vdev, "Looped descriptor");
+            goto err_undo_map;
+        }
+
+        rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max, &i,
+                                             desc_cache ==
+                                             &indirect_desc_cache);
+    } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    virtqueue_packed_advance_avail(vq, elem->ndescs);
+    vq->stats.elements++;
+    vq->stats.descriptors += elem_entries;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
 done:
@@ -960,6 +1645,60 @@ err_undo_map:
     goto done;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz);
+    }
+    return virtqueue_split_pop(vq, sz);
+}
+
+static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtQueueElement elem = {};
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int dropped = 0;
+    VRingPackedDesc desc;
+
+    if (unlikely(!vq->vring.desc)) {
+        return 0;
+    }
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    while (vq->inuse < vq->vring.num) {
+        unsigned int idx = vq->last_avail_idx;
+
+        /* works similar to virtqueue_pop but does not map buffers
+         * and does not allocate any memory */
+        vring_packed_desc_read(vdev, &desc, &caches->desc, idx, true);
+        if (!is_desc_avail(desc.flags, vq->last_avail_wrap_counter)) {
+            break;
+        }
+
+        elem.index = desc.id;
+        elem.ndescs = 1;
+        while (virtqueue_packed_read_next_desc(vq, &desc, &caches->desc,
+                                               vq->vring.num, &idx, false)) {
+            if (++elem.ndescs > vq->vring.num - vq->inuse) {
+                virtio_error(vdev, "Looped descriptor");
+                goto out;
+            }
+        }
+
+        virtqueue_packed_advance_avail(vq, elem.ndescs);
+        /* immediately push the element, nothing to unmap
+         * as both in_num and out_num are set to 0 */
+        virtqueue_push(vq, &elem, 0);
+        dropped++;
+    }
+
+out:
+    rcu_read_unlock();
+    return dropped;
+}
+
 /* virtqueue_drop_all:
  * @vq: The #VirtQueue
  * Drops all queued buffers and indicates them to the guest
@@ -977,6 +1716,11 @@ unsigned int virtqueue_drop_all(VirtQueue *vq)
         return 0;
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_drop_all(vq);
+    }
+
+    elem.ndescs = 1;
     while (!virtio_queue_empty(vq) && vq->inuse < vq->vring.num) {
         /* works similar to virtqueue_pop but does not map buffers
         * and does not allocate any memory */
@@ -1035,6 +1779,10 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -1060,7 +1808,8 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -1089,6 +1838,11 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    /* Only packed rings need to know how many slots the element takes.  */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -1120,6 +1874,12 @@ static int virtio_validate_features(VirtIODevice *vdev)
         return -EFAULT;
     }
 
+    /* The packed layout is only defined for VIRTIO 1.0 and later.  */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED) &&
+        !virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1)) {
+        return -EINVAL;
+    }
+
     if (k->validate_features) {
         return k->validate_features(vdev);
     } else {
@@ -1213,8 +1973,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -1536,8 +2298,10 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
 
     trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
     if (vq->handle_aio_output) {
+        /* Counted by virtio_queue_host_notifier_aio_read() */
         event_notifier_set(&vq->host_notifier);
     } else if (vq->handle_output) {
+        atomic_inc(&vq->stats.kicks);
         vq->handle_output(vdev, vq);
     }
 }
@@ -1583,6 +2347,9 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
+    vdev->vq[i].last_avail_wrap_counter = true;
+    vdev->vq[i].used_wrap_counter = true;
+    vdev->vq[i].used_elems = g_new0(VRingPackedUsedElem, VIRTQUEUE_MAX_SIZE);
 
     return &vdev->vq[i];
 }
@@ -1595,6 +2362,8 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1609,6 +2378,53 @@ static void virtio_set_isr(VirtIODevice *vdev, int value)
     }
 }
 
+/* The event offset and the indices are all taken modulo the ring size;
+ * bring them into the lap of @new before comparing, so that the
+ * arithmetic in vring_need_event() keeps working across a wrap.
+ */
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    int prev = old;
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    if (prev > new) {
+        prev -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, prev);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_event_read(vdev, &caches->avail, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
 /* Called within rcu_read_lock().  */
 static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
@@ -1622,6 +2438,10 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1641,8 +2461,11 @@ void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
     rcu_read_unlock();
 
     if (!should_notify) {
+        vq->stats.interrupts_suppressed++;
+        trace_virtio_notify_suppressed(vdev, vq);
         return;
     }
+    vq->stats.interrupts++;
 
     trace_virtio_notify_irqfd(vdev, vq);
 
@@ -1679,8 +2502,11 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     rcu_read_unlock();
 
     if (!should_notify) {
+        vq->stats.interrupts_suppressed++;
+        trace_virtio_notify_suppressed(vdev, vq);
         return;
     }
+    vq->stats.interrupts++;
 
     trace_virtio_notify(vdev, vq);
     virtio_irq(vq);
@@ -1722,6 +2548,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1775,6 +2608,30 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1895,6 +2752,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_ringsize,
         &vmstate_virtio_broken,
         &vmstate_virtio_extra_state,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -2155,6 +3013,35 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                 virtio_queue_update_rings(vdev, i);
             }
 
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                VirtQueue *vq = &vdev->vq[i];
+                int inuse;
+
+                /*
+                 * used_idx and the wrap counters come from the
+                 * packed_virtqueues subsection; there is no avail index
+                 * to check against, so only validate the distance
+                 * between the two positions.
+                 */
+                vq->shadow_avail_idx = vq->last_avail_idx;
+                inuse = vq->last_avail_idx - vq->used_idx;
+                if (vq->last_avail_wrap_counter != vq->used_wrap_counter) {
+                    inuse += vq->vring.num;
+                }
+                if (vq->last_avail_idx >= vq->vring.num ||
+                    vq->used_idx >= vq->vring.num ||
+                    inuse < 0 || inuse > vq->vring.num) {
+                    error_report("VQ %d size 0x%x: packed last_avail_idx 0x%x "
+                                 "inconsistent with used_idx 0x%x",
+                                 i, vq->vring.num, vq->last_avail_idx,
+                                 vq->used_idx);
+                    rcu_read_unlock();
+                    return -1;
+                }
+                vq->inuse = inuse;
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -2285,17 +3172,26 @@ hwaddr virtio_queue_get_used_addr(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDesc) * vdev->vq[n].vring.num;
+    }
     return sizeof(VRingDesc) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -2335,6 +3231,87 @@ uint16_t virtio_get_queue_index(VirtQueue *vq)
     return vq->queue_index;
 }
 
+void virtio_queue_get_stats(VirtQueue *vq, VirtQueueStats *stats)
+{
+    /* Kicks are counted in the AioContext of the host notifier */
+    stats->index = vq->queue_index;
+    stats->kicks = atomic_read__nocheck(&vq->stats.kicks);
+    stats->interrupts = vq->stats.interrupts;
+    stats->interrupts_suppressed = vq->stats.interrupts_suppressed;
+    stats->elements = vq->stats.elements;
+    stats->descriptors = vq->stats.descriptors;
+    stats->elements_per_kick = stats->kicks ?
+        (double)vq->stats.elements / stats->kicks : 0;
+    stats->chain_length = vq->stats.elements ?
+        (double)vq->stats.descriptors / vq->stats.elements : 0;
+}
+
+static VirtioStatsInfo *virtio_get_stats_info(VirtIODevice *vdev)
+{
+    VirtioStatsInfo *info = g_new0(VirtioStatsInfo, 1);
+    VirtQueueStatsList **tail = &info->queues;
+    int i;
+
+    info->path = object_get_canonical_path(OBJECT(vdev));
+    info->name = g_strdup(vdev->name);
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueueStatsList *entry;
+
+        if (vdev->vq[i].vring.num == 0) {
+            break;
+        }
+
+        entry = g_new0(VirtQueueStatsList, 1);
+        entry->value = g_new0(VirtQueueStats, 1);
+        virtio_queue_get_stats(&vdev->vq[i], entry->value);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return info;
+}
+
+static int virtio_query_stats_one(Object *obj, void *opaque)
+{
+    VirtioStatsInfoList ***tail = opaque;
+    VirtioStatsInfoList *entry;
+
+    if (!object_dynamic_cast(obj, TYPE_VIRTIO_DEVICE) ||
+        !DEVICE(obj)->realized) {
+        return 0;
+    }
+
+    entry = g_new0(VirtioStatsInfoList, 1);
+    entry->value = virtio_get_stats_info(VIRTIO_DEVICE(obj));
+    **tail = entry;
+    *tail = &entry->next;
+    return 0;
+}
+
+VirtioStatsInfoList *qmp_query_virtio_stats(bool has_path, const char *path,
+                                            Error **errp)
+{
+    VirtioStatsInfoList *head = NULL, **tail = &head;
+    Object *obj;
+
+    if (!has_path) {
+        object_child_foreach_recursive(object_get_root(),
+                                       virtio_query_stats_one, &tail);
+        return head;
+    }
+
+    obj = object_resolve_path_type(path, TYPE_VIRTIO_DEVICE, NULL);
+    if (!obj || !DEVICE(obj)->realized) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Virtio device '%s' not found", path);
+        return NULL;
+    }
+
+    virtio_query_stats_one(obj, &tail);
+    return head;
+}
+
 static void virtio_queue_guest_notifier_read(EventNotifier *n)
 {
     VirtQueue *vq = container_of(n, VirtQueue, guest_notifier);
@@ -2368,6 +3345,7 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
 {
     VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
     if (event_notifier_test_and_clear(n)) {
+        atomic_inc(&vq->stats.kicks);
         virtio_queue_notify_aio_vq(vq);
     }
 }
@@ -2404,6 +3382,10 @@ static void virtio_queue_host_notifier_aio_poll_end(EventNotifier *n)
     virtio_queue_set_notification(vq, 1);
 }
 
+/* The handler and the poll callbacks run in @ctx without the BQL, and
+ * change the notification state of @vq.  While they are installed, the
+ * device must only touch @vq from @ctx.
+ */
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleAIOOutput handle_output)
 {
@@ -2428,6 +3410,7 @@ void virtio_queue_host_notifier_read(EventNotifier *n)
 {
     VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
     if (event_notifier_test_and_clear(n)) {
+        atomic_inc(&vq->stats.kicks);
         virtio_queue_notify_vq(vq);
     }
 }
@@ -2531,6 +3514,7 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
             break;
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        g_free(vdev->vq[i].used_elems);
     }
     g_free(vdev->vq);
 }
@@ -2551,7 +3535,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r, err;
@@ -2602,7 +3586,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qemu/rcu.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -42,6 +43,20 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+/* The bins are [0, boundaries[0]), [boundaries[0], boundaries[1]), ...
+ * [boundaries[nbins - 2], +inf).  Latencies are in nanoseconds.
+ *
+ * Only the thread that completes the requests writes to the bins; the
+ * monitor replaces the whole histogram to change the boundaries or to
+ * reset the counts, and frees the old one after an RCU grace period.
+ */
+typedef struct BlockLatencyHistogram {
+    struct rcu_head rcu;
+    int nbins;
+    uint64_t *bins;
+    uint64_t boundaries[];      /* nbins - 1 entries, followed by the bins */
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -51,6 +66,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram *latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -78,4 +94,16 @@ int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 
+/* Boundaries must be non-zero and strictly ascending.  A NULL array
+ * selects the default, logarithmic boundaries.  The counts start at zero.
+ */
+void block_latency_histogram_set(BlockAcctStats *stats,
+                                 enum BlockAcctType type,
+                                 const uint64_t *boundaries,
+                                 int nboundaries);
+void block_latency_histogram_reset(BlockAcctStats *stats,
+                                   enum BlockAcctType type);
+void block_latency_histogram_clear(BlockAcctStats *stats,
+                                   enum BlockAcctType type);
+
 #endif
@@ -47,8 +47,15 @@ struct RAMBlock {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* one bit per RAM_DIRTY_HINT_PAGES pages, set when pages of the block
+     * are marked dirty for migration in ram_list.dirty_memory
+     */
+    unsigned long *dirty_hint;
 };
 
+#define RAM_DIRTY_HINT_BITS 9
+#define RAM_DIRTY_HINT_PAGES (1 << RAM_DIRTY_HINT_BITS)
+
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
 {
     return (b && b->host && offset < b->used_length) ? true : false;
@@ -219,6 +226,8 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
     rcu_read_unlock();
 }
 
+void cpu_physical_memory_set_dirty_hint(ram_addr_t start, ram_addr_t length);
+
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
                                                        ram_addr_t length,
                                                        uint8_t mask)
@@ -266,6 +275,11 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
         base += DIRTY_MEMORY_BLOCK_SIZE;
     }
 
+    /* Only after the bits are set, see migration_bitmap_sync */
+    if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
+        cpu_physical_memory_set_dirty_hint(start, length);
+    }
+
     rcu_read_unlock();
 
     xen_hvm_modified_memory(start, length);
@@ -320,6 +334,8 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
             }
         }
 
+        cpu_physical_memory_set_dirty_hint(start, pages << TARGET_PAGE_BITS);
+
         rcu_read_unlock();
 
         xen_hvm_modified_memory(start, pages << TARGET_PAGE_BITS);
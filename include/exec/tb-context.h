@@ -31,15 +31,20 @@ typedef struct TBContext TBContext;
 
 struct TBContext {
 
-    TranslationBlock *tbs;
+    /* TBs indexed by the host address of their code, for tb_find_pc */
+    GTree *tb_tree;
     struct qht htable;
-    int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
+    /* any access to tb_tree or the page table must use this lock */
     QemuMutex tb_lock;
+    /* bumped under tb_lock whenever guest code may have been written to,
+     * so that tb_gen_code can validate a translation done without tb_lock */
+    unsigned code_write_gen;
 
     /* statistics */
     unsigned tb_flush_count;
     int tb_phys_invalidate_count;
 };
 
+extern TBContext tb_ctx;
+
 #endif
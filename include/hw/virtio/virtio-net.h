@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -30,6 +31,19 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Smallest burst tx=adaptive shrinks to when the guest transmits slowly
+ * or the backend pushes back. */
+#define TX_BURST_MIN 16
+
+/* Receive rate, in packets per second and per queue, above which RX
+ * interrupts are coalesced when rx_coalesce_usecs is set. */
+#define RX_COALESCE_RATE 50000
+
+/* Receive segment coalescing: how long a partly coalesced frame waits for
+ * more segments, and how many TCP flows each queue coalesces at once. */
+#define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000 /* 300 us */
+#define VIRTIO_NET_RSC_MAX_FLOWS 8
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
@@ -37,6 +51,12 @@ typedef struct virtio_net_conf
     char *tx;
     uint16_t rx_queue_size;
     uint16_t mtu;
+    uint32_t rx_coalesce_usecs;
+    uint32_t rx_coalesce_rate;
+    bool rsc;
+    uint32_t rsc_interval;
+    IOThread *iothread;
+    char *iothreads;        /* colon-separated IOThread ids, one per queue pair */
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -45,11 +65,27 @@ typedef struct virtio_net_conf
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
+    AioContext *ctx;        /* IOThread servicing the pair, or NULL */
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     uint32_t tx_waiting;
+    int32_t tx_burst;
+    bool tx_aio_started;
+    QEMUTimer *rx_notify_timer;
+    bool rx_coalescing;
+    int64_t rx_window_start;
+    uint64_t rx_window_elements;
+    struct NetRxPkt *rsc_pkt;
+    QTAILQ_HEAD(, VirtioNetRscFlow) rsc_flows;
+    int rsc_num_flows;
+    QEMUTimer *rsc_timer;
+    uint64_t rsc_coalesced;
+    uint64_t rsc_frames;
+    uint64_t rsc_timeouts;
     struct {
         VirtQueueElement *elem;
+        /* byte-swapped header of elem, the queued packet points here */
+        struct virtio_net_hdr_mrg_rxbuf hdr;
     } async_tx;
     struct VirtIONet *n;
 } VirtIONetQueue;
@@ -63,6 +99,7 @@ typedef struct VirtIONet {
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    bool tx_adaptive;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -96,7 +133,12 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    VMChangeStateEntry *rsc_vmstate;
     bool needs_vnet_hdr_swap;
+    IOThread **iothreads;
+    int num_iothreads;
+    bool dataplane_started;
+    QemuEvent dataplane_stop_done;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -48,6 +48,10 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* sendmsg() calls done with MSG_ZEROCOPY, and how many of them
+     * the kernel has reported as completed */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
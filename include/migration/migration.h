@@ -158,6 +158,7 @@ struct MigrationState
 void migrate_set_state(int *state, int old_state, int new_state);
 
 void migration_fd_process_incoming(QEMUFile *f);
+bool migration_has_all_channels(void);
 
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -191,6 +192,8 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+QIOChannel *socket_send_channel_create(Error **errp);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
@@ -221,10 +224,20 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+int multifd_save_setup(void);
+void multifd_save_cleanup(void);
+void multifd_save_shutdown(void);
+int multifd_load_setup(void);
+void multifd_load_cleanup(void);
+bool multifd_recv_all_channels_created(void);
+void multifd_recv_new_channel(QIOChannel *ioc);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 uint64_t ram_dirty_sync_count(void);
+uint64_t ram_dirty_sync_time(void);
+uint64_t ram_dirty_sync_time_total(void);
+bool ram_sync_dirty_range(RAMBlock *rb, ram_addr_t start, ram_addr_t length);
 uint64_t ram_dirty_pages_rate(void);
 uint64_t ram_postcopy_requests(void);
 void free_xbzrle_decoded_buf(void);
@@ -258,6 +271,8 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool test_xbzrle_next_accel(void);
+const char *test_xbzrle_accel_name(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -270,6 +285,10 @@ int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
+int migrate_multifd_channels(void);
+int migrate_multifd_page_count(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
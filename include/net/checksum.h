@@ -54,47 +54,29 @@ uint32_t net_checksum_add_iov(const struct iovec *iov,
                               uint32_t csum_offset);
 
 typedef struct toeplitz_key_st {
-    uint32_t leftmost_32_bits;
-    uint8_t *next_byte;
+    uint8_t *window;            /* the leftmost 32 bits of the key */
 } net_toeplitz_key;
 
 static inline
 void net_toeplitz_key_init(net_toeplitz_key *key, uint8_t *key_bytes)
 {
-    key->leftmost_32_bits = be32_to_cpu(*(uint32_t *)key_bytes);
-    key->next_byte = key_bytes + sizeof(uint32_t);
+    key->window = key_bytes;
 }
 
-static inline
-void net_toeplitz_add(uint32_t *result,
-                      uint8_t *input,
-                      uint32_t len,
-                      net_toeplitz_key *key)
-{
-    register uint32_t accumulator = *result;
-    register uint32_t leftmost_32_bits = key->leftmost_32_bits;
-    register uint32_t byte;
-
-    for (byte = 0; byte < len; byte++) {
-        register uint8_t input_byte = input[byte];
-        register uint8_t key_byte = *(key->next_byte++);
-        register uint8_t bit;
-
-        for (bit = 0; bit < 8; bit++) {
-            if (input_byte & (1 << 7)) {
-                accumulator ^= leftmost_32_bits;
-            }
-
-            leftmost_32_bits =
-                (leftmost_32_bits << 1) | ((key_byte & (1 << 7)) >> 7);
-
-            input_byte <<= 1;
-            key_byte <<= 1;
-        }
-    }
+/**
+ * net_toeplitz_add: hash input with a Toeplitz key
+ *
+ * @result: hash to update
+ * @input: data to hash
+ * @len: length of @input; the key must have @len + 4 more bytes
+ * @key: key, advanced past the bytes used for @input
+ */
+void net_toeplitz_add(uint32_t *result, uint8_t *input, uint32_t len,
+                      net_toeplitz_key *key);
 
-    key->leftmost_32_bits = leftmost_32_bits;
-    *result = accumulator;
-}
+/* For the tests only: switch to the next slower checksum and hash
+ * implementations, returning false once the generic ones are in use.
+ */
+bool test_net_checksum_next_accel(void);
 
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -33,6 +33,11 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The data stays valid until the sent callback is called, so a packet
+ * that has to be queued keeps pointing to it instead of being copied.
+ * Without a sent callback the packet is copied as usual.
+ */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 /* Returns:
  *   >0 - success
@@ -45,6 +50,16 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Delivers @count packets, each of them contiguous in one element of
+ * @pkts.  Returns how many were consumed (delivered or discarded),
+ * stopping at the first one that can't be received right now.
+ */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       unsigned flags,
+                                       const struct iovec *pkts,
+                                       int count,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -70,6 +85,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetQueueDeliverBatchFunc *deliver_batch);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
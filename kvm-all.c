@@ -34,6 +34,7 @@
 #include "exec/memory.h"
 #include "exec/ram_addr.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 #include "qemu/event_notifier.h"
 #include "trace-root.h"
 #include "hw/irq.h"
@@ -65,6 +66,7 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -102,6 +104,12 @@ struct KVMState
 #endif
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+
+    /* Memory listeners by KVM address space id */
+    KVMMemoryListener *as_kml[2];
+    /* Entries of each vCPU's dirty ring, or 0 to use KVM_GET_DIRTY_LOG */
+    uint32_t kvm_dirty_ring_size;
+    uint32_t kvm_dirty_ring_bytes;
 };
 
 KVMState *kvm_state;
@@ -254,6 +262,8 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+static uint64_t kvm_dirty_ring_reap(KVMState *s);
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -275,15 +285,28 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Do not lose the pages that the vCPU dirtied last */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    /* The ring of the parked vCPU goes on from where it was */
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -293,11 +316,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -309,7 +334,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -339,6 +364,21 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+#ifdef KVM_DIRTY_LOG_PAGE_OFFSET
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+#endif
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -504,6 +544,148 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     return ret;
 }
 
+/*
+ * Dirty ring mode: instead of a bitmap per memory slot, KVM pushes the
+ * pages that each vCPU dirties to a ring shared with QEMU.  Collecting
+ * the rings costs time proportional to the number of dirtied pages,
+ * rather than to the size of guest memory.
+ */
+
+/* Mark @pages host pages at page @offset of slot @slot_id as dirty */
+static void kvm_dirty_ring_mark_pages(KVMState *s, uint32_t slot_id,
+                                      uint64_t offset, uint64_t pages)
+{
+    uint8_t clients = tcg_enabled() ? DIRTY_CLIENTS_ALL : DIRTY_CLIENTS_NOCODE;
+    uint32_t as_id = slot_id >> 16;
+    uint32_t id = slot_id & 0xffff;
+    uint64_t page_size = qemu_real_host_page_size;
+    KVMSlot *mem;
+    RAMBlock *rb;
+    ram_addr_t offset_in_block, length;
+
+    if (as_id >= ARRAY_SIZE(s->as_kml) || !s->as_kml[as_id] ||
+        id >= s->nr_slots) {
+        return;
+    }
+    mem = &s->as_kml[as_id]->slots[id];
+    if (offset + pages > mem->memory_size / page_size) {
+        /* The slot went away or shrank since the pages were dirtied */
+        return;
+    }
+
+    rb = qemu_ram_block_from_host(mem->ram + offset * page_size, false,
+                                  &offset_in_block);
+    if (!rb) {
+        return;
+    }
+    length = pages * page_size;
+
+    /* While migration syncs its bitmap, set the pages there directly */
+    if (ram_sync_dirty_range(rb, offset_in_block, length)) {
+        clients &= ~(1 << DIRTY_MEMORY_MIGRATION);
+    }
+    cpu_physical_memory_set_dirty_range(rb->offset + offset_in_block, length,
+                                        clients);
+}
+
+/* Collect the dirty ring of one vCPU, returns the number of entries */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t slot = 0;
+    uint64_t start = 0, pages = 0;
+    uint32_t count = 0;
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[fetch & (s->kvm_dirty_ring_size - 1)];
+        if (atomic_load_acquire(&gfn->flags) != KVM_DIRTY_GFN_F_DIRTY) {
+            break;
+        }
+
+        /* Batch runs of contiguous pages, such as those of a huge page
+         * that the guest fills, into a single update of the bitmaps.  */
+        if (pages && gfn->slot == slot && gfn->offset == start + pages) {
+            pages++;
+        } else {
+            if (pages) {
+                kvm_dirty_ring_mark_pages(s, slot, start, pages);
+            }
+            slot = gfn->slot;
+            start = gfn->offset;
+            pages = 1;
+        }
+
+        atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        fetch++;
+        count++;
+    }
+    if (pages) {
+        kvm_dirty_ring_mark_pages(s, slot, start, pages);
+    }
+
+    cpu->kvm_fetch_index = fetch;
+    return count;
+}
+
+/*
+ * Collect the dirty rings of all vCPUs, and let KVM reuse the collected
+ * entries.  Called with the BQL held.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+    if (total) {
+        kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+    }
+
+    trace_kvm_dirty_ring_reap(total, qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                     start_time);
+    return total;
+}
+
+static int kvm_dirty_ring_init(KVMState *s)
+{
+#ifdef KVM_DIRTY_LOG_PAGE_OFFSET
+    uint64_t ring_bytes = (uint64_t)s->kvm_dirty_ring_size *
+                          sizeof(struct kvm_dirty_gfn);
+    int max_bytes, ret;
+
+    max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0) {
+        fprintf(stderr, "KVM does not support the dirty ring\n");
+        return -EINVAL;
+    }
+    if (ring_bytes > max_bytes) {
+        fprintf(stderr, "KVM dirty ring size %" PRIu32 " too big "
+                "(maximum is %zu entries)\n", s->kvm_dirty_ring_size,
+                max_bytes / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret) {
+        fprintf(stderr, "Enabling the KVM dirty ring failed: %s\n",
+                strerror(-ret));
+        return ret;
+    }
+
+    s->kvm_dirty_ring_bytes = ring_bytes;
+    return 0;
+#else
+    fprintf(stderr, "KVM dirty ring is not supported on this host\n");
+    return -EINVAL;
+#endif
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -750,7 +932,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         old = *mem;
 
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (s->kvm_dirty_ring_size) {
+                kvm_dirty_ring_reap(s);
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the overlapping slot */
@@ -883,6 +1069,18 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+/*
+ * Pages that are still buffered by the processor, e.g. in its page
+ * modification log, only reach the ring at the vCPU's next exit from
+ * KVM_RUN, so they are collected by a later sync.  The vCPUs do not
+ * need to be kicked for that: the last sync of a migration happens
+ * with the VM stopped, when every vCPU has left KVM_RUN.
+ */
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_reap(kvm_state);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -959,6 +1157,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < ARRAY_SIZE(s->as_kml));
+    s->as_kml[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -968,7 +1168,12 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (!s->kvm_dirty_ring_size) {
+        kml->listener.log_sync = kvm_log_sync;
+    } else if (as_id == 0) {
+        /* The rings hold the pages of all address spaces */
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1698,6 +1903,15 @@ static int kvm_init(MachineState *ms)
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
 
+    /* The dirty ring must be enabled before any vCPU is created */
+    s->kvm_dirty_ring_size = machine_kvm_dirty_ring_size(ms);
+    if (s->kvm_dirty_ring_size) {
+        ret = kvm_dirty_ring_init(s);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
     if (ret > 0) {
@@ -2063,6 +2277,14 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* KVM_RUN fails until the ring is collected */
+            DPRINTF("dirty_ring_full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
@@ -2269,6 +2491,11 @@ int kvm_has_intx_set_mask(void)
     return kvm_state->intx_set_mask;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
 #ifdef KVM_CAP_SET_GUEST_DEBUG
 struct kvm_sw_breakpoint *kvm_find_sw_breakpoint(CPUState *cpu,
                                                  target_ulong pc)
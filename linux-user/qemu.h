@@ -439,6 +439,11 @@ void mmap_fork_end(int child);
 /* main.c */
 extern unsigned long guest_stack_size;
 
+/* tbcache.c */
+void tb_cache_init(const char *dir, int execfd);
+void tb_cache_load(const struct image_info *info, const char *cpu_model);
+void tb_cache_save(void);
+
 /* user access */
 
 #define VERIFY_READ 0
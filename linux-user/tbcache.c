@@ -0,0 +1,423 @@
+/*
+ *  On-disk cache of translated code
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The translated code of the main executable is saved when the program
+ * exits, and mapped back when it is started again so that it need not
+ * be translated anew.
+ *
+ * TCG does not record relocations in the code it generates: TBs embed
+ * the absolute addresses of helpers, of other TBs and of the code buffer
+ * itself.  Rather than relocating the code, the cache is therefore an
+ * image of the code buffer that is only used if it can be mapped at the
+ * very same host address, by the very same QEMU binary, with the same
+ * guest_base and the same load address of the guest executable.  In
+ * practice this needs a QEMU that is not built as a position independent
+ * executable, since the code buffer of user mode lives in its .bss.
+ *
+ * Only TBs whose guest code lies entirely within the text of the main
+ * executable are restored, after checking that their guest code is
+ * unchanged; TBs that embed other host pointers (see CF_HOST_PTR) are
+ * never restored.  Restored TBs are linked like new ones, so writes to
+ * their guest code invalidate them through page_unprotect as usual.
+ *
+ * File layout: the header, the index of restorable TBs, their guest
+ * code, the prologue, and finally the image of the code buffer, which
+ * starts at the same offset within a host page as it does in memory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu.h"
+#include "qemu-common.h"
+#include "qemu/log.h"
+#include "exec/exec-all.h"
+#include "exec/tb-context.h"
+#include "tcg.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    1
+
+/* Everything that the cached code depends on.  */
+typedef struct TBCacheKey {
+    uint8_t exe_hash[32];       /* SHA-256 of the guest executable */
+    char cpu_model[64];
+    uint64_t qemu_size;         /* of the QEMU binary */
+    uint64_t qemu_mtime;
+    uint64_t qemu_ino;
+    uint64_t qemu_anchor;       /* host address of a function in QEMU */
+    uint64_t guest_base;
+    uint64_t load_bias;
+    uint64_t start_code;
+    uint64_t end_code;
+    uint64_t code_gen_prologue;
+    uint64_t code_gen_buffer;
+    uint64_t code_gen_buffer_size;
+    uint32_t singlestep;
+    uint32_t target_page_bits;
+} TBCacheKey;
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t prologue_size;
+    TBCacheKey key;
+    uint64_t n_tbs;
+    uint64_t guest_size;        /* total guest code after the index */
+    uint64_t image_size;        /* starting at key.code_gen_buffer */
+    uint64_t image_offset;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t offset;            /* of the TB within the image */
+    uint32_t guest_size;
+    uint32_t reserved;
+} TBCacheEntry;
+
+static char *tb_cache_file;
+static TBCacheKey tb_cache_key;
+
+static bool tb_cache_hash_exe(int fd, uint8_t *hash)
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    gsize len = sizeof(tb_cache_key.exe_hash);
+    uint8_t buf[65536];
+    off_t offset = 0;
+    ssize_t ret;
+
+    /* The loader reads the executable from the current file offset */
+    do {
+        ret = pread(fd, buf, sizeof(buf), offset);
+        if (ret > 0) {
+            g_checksum_update(sum, buf, ret);
+            offset += ret;
+        }
+    } while (ret > 0 || (ret < 0 && errno == EINTR));
+
+    if (ret == 0) {
+        g_checksum_get_digest(sum, hash, &len);
+    }
+    g_checksum_free(sum);
+    return ret == 0;
+}
+
+/*
+ * Enable the cache for the executable open in EXECFD, with the cache
+ * file kept in DIR.  Must be called before the executable is loaded.
+ */
+void tb_cache_init(const char *dir, int execfd)
+{
+    TBCacheKey *key = &tb_cache_key;
+    struct stat st;
+    char hex[sizeof(key->exe_hash) * 2 + 1];
+    int i;
+
+    memset(key, 0, sizeof(*key));
+    if (!tb_cache_hash_exe(execfd, key->exe_hash) ||
+        stat("/proc/self/exe", &st) < 0) {
+        fprintf(stderr, "qemu: TB cache disabled: %s\n", strerror(errno));
+        return;
+    }
+    key->qemu_size = st.st_size;
+    key->qemu_mtime = st.st_mtime;
+    key->qemu_ino = st.st_ino;
+    key->qemu_anchor = (uintptr_t)tcg_exec_init;
+
+    for (i = 0; i < sizeof(key->exe_hash); i++) {
+        snprintf(hex + i * 2, 3, "%02x", key->exe_hash[i]);
+    }
+    tb_cache_file = g_strdup_printf("%s/" TARGET_NAME "-%s.tbc", dir, hex);
+}
+
+/* Fill in the parts of the key that are known once the program is loaded */
+static void tb_cache_key_finish(const struct image_info *info,
+                                const char *cpu_model)
+{
+    TBCacheKey *key = &tb_cache_key;
+
+    pstrcpy(key->cpu_model, sizeof(key->cpu_model), cpu_model);
+    key->guest_base = guest_base;
+    key->load_bias = info->load_bias;
+    key->start_code = info->start_code;
+    key->end_code = info->end_code;
+    key->code_gen_prologue = (uintptr_t)tcg_init_ctx.code_gen_prologue;
+    key->code_gen_buffer = (uintptr_t)tcg_init_ctx.code_gen_buffer;
+    key->code_gen_buffer_size = tcg_init_ctx.code_gen_buffer_size;
+    key->singlestep = singlestep;
+    key->target_page_bits = TARGET_PAGE_BITS;
+}
+
+static bool tb_cache_read(int fd, void *buf, size_t size, off_t offset)
+{
+    ssize_t ret;
+
+    while (size) {
+        ret = pread(fd, buf, size, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+/* Whether the guest code of a TB is (still) that of the executable */
+static bool tb_cache_guest_code_ok(const TranslationBlock *tb)
+{
+    const TBCacheKey *key = &tb_cache_key;
+
+    return tb->size &&
+           tb->pc >= key->start_code && tb->pc + tb->size <= key->end_code &&
+           page_check_range(tb->pc, tb->size, PAGE_READ) == 0;
+}
+
+/*
+ * Map the image of the code buffer back, and restore the TBs whose guest
+ * code has not changed.  Returns the number of restored TBs, or -1 if
+ * the cache file cannot be used.
+ */
+static int tb_cache_restore(int fd, const TBCacheHeader *hdr)
+{
+    void *start = tcg_init_ctx.code_gen_buffer;
+    void *end = start + hdr->image_size;
+    size_t head = MIN(hdr->image_size,
+                      ROUND_UP((uintptr_t)start, qemu_real_host_page_size) -
+                      (uintptr_t)start);
+    size_t prologue_size = start - tcg_init_ctx.code_gen_prologue;
+    TBCacheEntry *entries;
+    uint8_t *guest, *p;
+    off_t offset;
+    uint64_t i;
+    int n = 0;
+
+    if (hdr->prologue_size != prologue_size ||
+        end > tcg_init_ctx.code_gen_highwater ||
+        hdr->image_offset % qemu_real_host_page_size !=
+        (uintptr_t)start % qemu_real_host_page_size ||
+        hdr->n_tbs > hdr->image_size / sizeof(TranslationBlock) ||
+        hdr->guest_size > hdr->n_tbs * 2 * TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    offset = sizeof(*hdr);
+    entries = g_new(TBCacheEntry, hdr->n_tbs);
+    guest = g_malloc(MAX(hdr->guest_size, prologue_size));
+    if (!tb_cache_read(fd, entries, hdr->n_tbs * sizeof(*entries), offset)) {
+        n = -1;
+        goto out;
+    }
+    offset += hdr->n_tbs * sizeof(*entries);
+
+    /* The prologue depends on the features of the host CPU, and so does
+       all the code that is generated after it.  */
+    if (!tb_cache_read(fd, guest, prologue_size, offset + hdr->guest_size) ||
+        memcmp(guest, tcg_init_ctx.code_gen_prologue, prologue_size)) {
+        n = -1;
+        goto out;
+    }
+    if (!tb_cache_read(fd, guest, hdr->guest_size, offset)) {
+        n = -1;
+        goto out;
+    }
+
+    /* The page holding the start of the buffer may also hold unrelated
+       data, so copy that part of the image rather than mapping it.  */
+    if (!tb_cache_read(fd, start, head, hdr->image_offset)) {
+        n = -1;
+        goto out;
+    }
+    if (hdr->image_size > head &&
+        mmap(start + head, hdr->image_size - head,
+             PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_FIXED,
+             fd, hdr->image_offset + head) == MAP_FAILED) {
+        n = -1;
+        goto out;
+    }
+    flush_icache_range((uintptr_t)start, (uintptr_t)end);
+    tcg_init_ctx.code_gen_ptr = end;
+
+    for (i = 0, p = guest; i < hdr->n_tbs; i++) {
+        TranslationBlock *tb = start + entries[i].offset;
+        uint32_t size = entries[i].guest_size;
+
+        if (p + size > guest + hdr->guest_size) {
+            break;
+        }
+        if (entries[i].offset <= hdr->image_size - sizeof(*tb) &&
+            entries[i].offset % sizeof(uintptr_t) == 0 &&
+            size == tb->size && tb_cache_guest_code_ok(tb) &&
+            (void *)tb->tc_ptr > (void *)tb &&
+            (void *)tb->tc_ptr + tb->tc_size <= end &&
+            memcmp(p, g2h(tb->pc), size) == 0) {
+            tb_restore(tb);
+            n++;
+        }
+        p += size;
+    }
+
+ out:
+    g_free(entries);
+    g_free(guest);
+    return n;
+}
+
+/*
+ * Restore the TBs saved by a previous run of the same program.  Called
+ * once the executable is loaded and the code buffer is set up, before
+ * any code is translated.
+ */
+void tb_cache_load(const struct image_info *info, const char *cpu_model)
+{
+    TBCacheHeader hdr;
+    int fd, n;
+
+    if (!tb_cache_file) {
+        return;
+    }
+    tb_cache_key_finish(info, cpu_model);
+
+    fd = open(tb_cache_file, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (!tb_cache_read(fd, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != TB_CACHE_VERSION ||
+        memcmp(&hdr.key, &tb_cache_key, sizeof(hdr.key))) {
+        close(fd);
+        return;
+    }
+
+    mmap_lock();
+    tb_lock();
+    n = tb_cache_restore(fd, &hdr);
+    tb_unlock();
+    mmap_unlock();
+    close(fd);
+
+    if (n < 0) {
+        /* Part of the image may have been copied already */
+        tcg_init_ctx.code_gen_ptr = tcg_init_ctx.code_gen_buffer;
+        fprintf(stderr, "qemu: ignoring invalid TB cache %s\n",
+                tb_cache_file);
+    } else if (qemu_loglevel_mask(CPU_LOG_PAGE)) {
+        qemu_log("restored %d TBs from %s\n", n, tb_cache_file);
+    }
+}
+
+typedef struct TBCacheSave {
+    GArray *entries;
+    GByteArray *guest;
+} TBCacheSave;
+
+static gboolean tb_cache_collect(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+    TBCacheSave *save = data;
+    TBCacheEntry entry = { 0 };
+
+    if (tb->invalid || (tb->cflags & (CF_NOCACHE | CF_HOST_PTR)) ||
+        !tb_cache_guest_code_ok(tb)) {
+        return false;
+    }
+
+    entry.offset = (void *)tb - tcg_init_ctx.code_gen_buffer;
+    entry.guest_size = tb->size;
+    g_array_append_val(save->entries, entry);
+    g_byte_array_append(save->guest, g2h(tb->pc), tb->size);
+    return false;
+}
+
+static bool tb_cache_write(int fd, const void *buf, size_t size)
+{
+    return qemu_write_full(fd, buf, size) == size;
+}
+
+/*
+ * Save the translated code of the executable for the next run.  Called
+ * when the program exits; other threads may still be running.
+ */
+void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    TBCacheSave save;
+    void *start = tcg_init_ctx.code_gen_buffer;
+    size_t prologue_size = start - tcg_init_ctx.code_gen_prologue;
+    char *tmp;
+    off_t offset;
+    bool ok;
+    int fd;
+
+    if (!tb_cache_file) {
+        return;
+    }
+
+    tmp = g_strdup_printf("%s.XXXXXX", tb_cache_file);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        g_free(tmp);
+        return;
+    }
+
+    save.entries = g_array_new(false, false, sizeof(TBCacheEntry));
+    save.guest = g_byte_array_new();
+
+    mmap_lock();
+    tb_lock();
+
+    g_tree_foreach(tb_ctx.tb_tree, tb_cache_collect, &save);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.prologue_size = prologue_size;
+    hdr.key = tb_cache_key;
+    hdr.n_tbs = save.entries->len;
+    hdr.guest_size = save.guest->len;
+    hdr.image_size = tcg_init_ctx.code_gen_ptr - start;
+
+    /* Place the image at the same offset within a page as in memory */
+    offset = sizeof(hdr) + hdr.n_tbs * sizeof(TBCacheEntry) +
+             hdr.guest_size + prologue_size;
+    hdr.image_offset = ROUND_UP(offset, qemu_real_host_page_size) +
+                       (uintptr_t)start % qemu_real_host_page_size;
+
+    ok = tb_cache_write(fd, &hdr, sizeof(hdr)) &&
+         tb_cache_write(fd, save.entries->data,
+                        hdr.n_tbs * sizeof(TBCacheEntry)) &&
+         tb_cache_write(fd, save.guest->data, hdr.guest_size) &&
+         tb_cache_write(fd, tcg_init_ctx.code_gen_prologue, prologue_size) &&
+         lseek(fd, hdr.image_offset, SEEK_SET) == hdr.image_offset &&
+         tb_cache_write(fd, start, hdr.image_size);
+
+    tb_unlock();
+    mmap_unlock();
+
+    g_array_free(save.entries, true);
+    g_byte_array_free(save.guest, true);
+    close(fd);
+
+    /* Concurrent runs of the program each write a complete file */
+    if (!ok || rename(tmp, tb_cache_file) < 0) {
+        unlink(tmp);
+    }
+    g_free(tmp);
+}
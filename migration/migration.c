@@ -73,6 +73,11 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Default number of channels (and threads) used by multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default number of pages handed to a multifd thread at a time */
+#define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -99,6 +104,8 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .x_multifd_page_count = DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT,
         },
     };
 
@@ -362,6 +369,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    multifd_load_cleanup();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -425,6 +433,7 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        multifd_load_cleanup();
         exit(EXIT_FAILURE);
     }
 
@@ -444,6 +453,52 @@ void migration_fd_process_incoming(QEMUFile *f)
     qemu_coroutine_enter(co);
 }
 
+/*
+ * The first channel to arrive is always the main migration stream;
+ * with multifd enabled, the remaining ones carry RAM pages.  The load
+ * itself only starts once every channel is connected, because the
+ * main channel blocks waiting for the multifd threads at
+ * synchronization points and would otherwise stop the main loop from
+ * accepting the remaining connections.
+ */
+static void migration_ioc_process_incoming(QIOChannel *ioc)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (!mis->from_src_file) {
+        mis->from_src_file = qemu_fopen_channel_input(ioc);
+        if (migrate_use_multifd() && multifd_load_setup() < 0) {
+            error_report("Failed to setup multifd receive threads");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        multifd_recv_new_channel(ioc);
+    }
+
+    if (migration_has_all_channels()) {
+        migration_fd_process_incoming(mis->from_src_file);
+    }
+}
+
+/**
+ * migration_has_all_channels: We have received all channels that we need
+ *
+ * Returns true when we have got connections to all the channels that
+ * we need for migration.
+ */
+bool migration_has_all_channels(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    bool all_channels;
+
+    all_channels = mis->from_src_file != NULL;
+    if (all_channels && migrate_use_multifd()) {
+        all_channels = multifd_recv_all_channels_created();
+    }
+
+    return all_channels;
+}
+
 
 void migration_channel_process_incoming(MigrationState *s,
                                         QIOChannel *ioc)
@@ -461,8 +516,7 @@ void migration_channel_process_incoming(MigrationState *s,
             error_report_err(local_err);
         }
     } else {
-        QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        migration_ioc_process_incoming(ioc);
     }
 }
 
@@ -592,6 +646,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_x_multifd_channels = true;
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->has_x_multifd_page_count = true;
+    params->x_multifd_page_count = s->parameters.x_multifd_page_count;
 
     return params;
 }
@@ -642,6 +700,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         qemu_target_page_size();
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = ram_dirty_sync_count();
+    info->ram->dirty_sync_time = ram_dirty_sync_time();
+    info->ram->dirty_sync_total_time = ram_dirty_sync_time_total();
     info->ram->postcopy_requests = ram_postcopy_requests();
     info->ram->page_size = qemu_target_page_size();
 
@@ -784,6 +844,16 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
             s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM] =
                 false;
         }
+        if (migrate_use_multifd()) {
+            /* Pages arriving on the multifd channels are written
+             * directly into guest RAM, which can't be done atomically
+             * as postcopy requires.
+             */
+            error_report("Postcopy is not currently compatible with "
+                         "multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM] =
+                false;
+        }
         /* This check is reasonably expensive, so only when it's being
          * set the first time, also it's only the destination that needs
          * special support.
@@ -798,6 +868,30 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd() &&
+        (migrate_use_compression() || migrate_use_xbzrle())) {
+        /* Both need the pages to go through the main stream in order */
+        error_report("Multifd is not currently compatible with "
+                     "compression or xbzrle");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+    }
+
+    if (migrate_use_zero_copy_send()) {
+#ifdef CONFIG_LINUX
+        if (!migrate_use_multifd()) {
+            /* Only the multifd channels send pages straight from guest
+             * memory; the main stream goes through the QEMUFile buffer.
+             */
+            error_report("Zero copy send requires multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND] =
+                false;
+        }
+#else
+        error_report("Zero copy send is only supported on Linux");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND] = false;
+#endif
+    }
 }
 
 void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
@@ -859,6 +953,21 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_x_multifd_channels &&
+        (params->x_multifd_channels < 1 || params->x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (params->has_x_multifd_page_count &&
+            (params->x_multifd_page_count < 1 ||
+             params->x_multifd_page_count > 10000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_page_count",
+                   "is invalid, it should be in the range of 1 to 10000");
+        return;
+    }
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -900,6 +1009,12 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
             colo_checkpoint_notify(s);
         }
     }
+    if (params->has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = params->x_multifd_channels;
+    }
+    if (params->has_x_multifd_page_count) {
+        s->parameters.x_multifd_page_count = params->x_multifd_page_count;
+    }
 }
 
 
@@ -954,6 +1069,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_save_cleanup();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -1009,6 +1125,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
     }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
@@ -1207,6 +1324,18 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "multifd is only supported with the tcp: and"
+                       " unix: migration protocols");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "multifd is not supported together with TLS");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1395,6 +1524,42 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_multifd_page_count(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_page_count;
+}
+
 int64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
@@ -2071,6 +2236,12 @@ void migrate_fd_connect(MigrationState *s)
     }
 
     migrate_compress_threads_create();
+    if (multifd_save_setup() != 0) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
     qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -42,8 +42,11 @@
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
+#include "sysemu/kvm.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
+#include "qemu/iov.h"
+#include "io/channel.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -63,6 +66,7 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static uint8_t *ZERO_TARGET_PAGE;
 
@@ -174,6 +178,9 @@ struct RAMState {
     int dirty_rate_high_cnt;
     /* How many times we have synchronized the bitmap */
     uint64_t bitmap_sync_count;
+    /* Time taken by the last bitmap sync, and by all of them, in us */
+    uint64_t bitmap_sync_time;
+    uint64_t bitmap_sync_time_total;
     /* these variables are used for bitmap sync */
     /* last time we did a full bitmap_sync */
     int64_t time_last_bitmap_sync;
@@ -213,6 +220,8 @@ struct RAMState {
     uint64_t postcopy_requests;
     /* protects modification of the bitmap */
     QemuMutex bitmap_mutex;
+    /* migration_bitmap_sync is collecting the KVM dirty rings */
+    bool bitmap_sync_direct;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
@@ -273,6 +282,16 @@ uint64_t ram_dirty_sync_count(void)
     return ram_state.bitmap_sync_count;
 }
 
+uint64_t ram_dirty_sync_time(void)
+{
+    return ram_state.bitmap_sync_time;
+}
+
+uint64_t ram_dirty_sync_time_total(void)
+{
+    return ram_state.bitmap_sync_time_total;
+}
+
 uint64_t ram_dirty_pages_rate(void)
 {
     return ram_state.dirty_pages_rate;
@@ -430,6 +449,930 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multiple fd's */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sent once at the start of each channel */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t id;
+    uint8_t unused1[7];     /* Reserved for future use */
+    uint64_t unused2[4];    /* Reserved for future use */
+} __attribute__((packed)) MultiFDInit_t;
+
+/*
+ * Header of each batch of pages.  All pages in a packet belong to the
+ * same RAMBlock; the header is followed by @used page offsets and then
+ * by the page contents themselves, so that the destination can place
+ * them regardless of the order in which channels deliver them.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* number of pages in this packet */
+    uint32_t used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} __attribute__((packed)) MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* offset of each page */
+    ram_addr_t *offset;
+    /* pointer to each page */
+    struct iovec *iov;
+    RAMBlock *block;
+} MultiFDPages_t;
+
+typedef struct {
+    /* these fields are not changed once the thread is created */
+    /* channel number */
+    uint8_t id;
+    /* channel thread name */
+    char *name;
+    /* channel thread id */
+    QemuThread thread;
+    /* sem where to wait for more work */
+    QemuSemaphore sem;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* communication channel */
+    QIOChannel *c;
+    /* is this channel thread running */
+    bool running;
+    /* should this thread finish */
+    bool quit;
+    /* number of jobs queued for the thread */
+    int pending_job;
+    /* array of pages to send */
+    MultiFDPages_t *pages;
+    /* multifd flags for the next packet */
+    uint32_t flags;
+    /* global number of the next packet */
+    uint64_t packet_num;
+    /* thread local variables */
+    /* pointer to the packet */
+    MultiFDPacket_t *packet;
+    /* packets sent through this channel */
+    uint64_t num_packets;
+    /* pages sent through this channel */
+    uint64_t num_pages;
+} MultiFDSendParams;
+
+typedef struct {
+    /* these fields are not changed once the thread is created */
+    /* channel number */
+    uint8_t id;
+    /* channel thread name */
+    char *name;
+    /* channel thread id */
+    QemuThread thread;
+    /* communication channel */
+    QIOChannel *c;
+    /* sem where the main thread releases us after a sync */
+    QemuSemaphore sem_sync;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* is this channel thread running */
+    bool running;
+    /* should this thread finish */
+    bool quit;
+    /* number of the last packet received */
+    uint64_t packet_num;
+    /* thread local variables */
+    /* pages being received */
+    MultiFDPages_t *pages;
+    /* pointer to the packet */
+    MultiFDPacket_t *packet;
+    /* packets received through this channel */
+    uint64_t num_packets;
+    /* pages received through this channel */
+    uint64_t num_pages;
+} MultiFDRecvParams;
+
+static MultiFDPages_t *multifd_pages_init(size_t size)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->iov = g_new0(struct iovec, size);
+    pages->offset = g_new0(ram_addr_t, size);
+
+    return pages;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    g_free(pages->iov);
+    g_free(pages->offset);
+    g_free(pages);
+}
+
+static size_t multifd_packet_len(uint32_t pages)
+{
+    return sizeof(MultiFDPacket_t) + sizeof(uint64_t) * pages;
+}
+
+static struct {
+    MultiFDSendParams *params;
+    /* number of created threads */
+    int count;
+    /* pages queued by the migration thread, not yet handed to a channel */
+    MultiFDPages_t *pages;
+    /* syncs main thread and channels */
+    QemuSemaphore sem_sync;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* posted each time a channel becomes idle */
+    QemuSemaphore channels_ready;
+} *multifd_send_state;
+
+static void multifd_send_terminate_threads(Error *err)
+{
+    int i;
+
+    trace_multifd_send_terminate_threads(err != NULL);
+
+    if (err) {
+        MigrationState *s = migrate_get_current();
+
+        error_report_err(error_copy(err));
+        if (s->to_dst_file) {
+            qemu_file_set_error(s->to_dst_file, -EIO);
+        }
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        if (err && p->c) {
+            /* Unblock any thread stuck writing to a dead socket */
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    multifd_send_terminate_threads(NULL);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+            p->c = NULL;
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->name);
+        p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        g_free(p->packet);
+        p->packet = NULL;
+    }
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->params);
+    multifd_send_state->params = NULL;
+    multifd_pages_clear(multifd_send_state->pages);
+    multifd_send_state->pages = NULL;
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/**
+ * multifd_save_shutdown: force the multifd channels down
+ *
+ * Called when the migration is cancelled, so that threads blocked
+ * writing to the network notice and exit.
+ */
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg = {};
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+
+    return qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
+}
+
+static void multifd_send_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPacket_t *packet = p->packet;
+    int i;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->used = cpu_to_be32(p->pages->used);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (p->pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                p->pages->block->idstr);
+    }
+
+    for (i = 0; i < p->pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
+    }
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    QIOChannel *c;
+    int write_flags = 0;
+
+    trace_multifd_send_thread_start(p->id);
+
+    c = socket_send_channel_create(&local_err);
+    if (!c) {
+        goto out;
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->c = c;
+    qemu_mutex_unlock(&p->mutex);
+
+    if (migrate_use_zero_copy_send()) {
+        if (!qio_channel_has_feature(c, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_setg(&local_err, "multifd: channel %d does not support "
+                       "zero copy send", p->id);
+            goto out;
+        }
+        write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    }
+
+    if (multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+
+    qemu_sem_post(&multifd_send_state->channels_ready);
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+
+        if (p->pending_job) {
+            uint32_t used = p->pages->used;
+            uint64_t packet_num = p->packet_num;
+            uint32_t flags = p->flags;
+
+            multifd_send_fill_packet(p);
+            p->flags = 0;
+            qemu_mutex_unlock(&p->mutex);
+
+            trace_multifd_send(p->id, packet_num, used, flags);
+
+            /* The packet header is reused for the next batch, so it is
+             * always copied; only the pages may go out zero copy.
+             */
+            if (qio_channel_write_all(p->c, (char *)p->packet,
+                                      multifd_packet_len(used),
+                                      &local_err) < 0) {
+                break;
+            }
+            if (used && qio_channel_writev_full_all(p->c, p->pages->iov, used,
+                                                    NULL, 0, write_flags,
+                                                    &local_err) < 0) {
+                break;
+            }
+
+            if ((flags & MULTIFD_FLAG_SYNC) && write_flags) {
+                /* Pages sent zero copy are still read by the kernel
+                 * after sendmsg() returns.  Wait until they are all on
+                 * the wire before telling the migration thread that the
+                 * iteration is complete, so that a page re-dirtied in
+                 * the meantime is always sent again afterwards and the
+                 * destination never sees two rounds mixed up.
+                 */
+                int ret = qio_channel_flush(p->c, &local_err);
+
+                if (ret < 0) {
+                    break;
+                }
+                trace_multifd_send_zero_copy_flush(p->id, ret == 1);
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->num_packets++;
+            p->num_pages += used;
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job--;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_send_state->sem_sync);
+            }
+            if (used) {
+                qemu_sem_post(&multifd_send_state->channels_ready);
+            }
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            /* sometimes there are spurious wakeups */
+        }
+    }
+
+out:
+    if (local_err) {
+        multifd_send_terminate_threads(local_err);
+        error_free(local_err);
+    }
+
+    /* Make sure the migration thread doesn't wait forever on us */
+    qemu_sem_post(&multifd_send_state->sem_sync);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    qemu_mutex_lock(&p->mutex);
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+
+    return NULL;
+}
+
+int multifd_save_setup(void)
+{
+    int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
+    uint8_t i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->quit = false;
+        p->pending_job = 0;
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet = g_malloc0(multifd_packet_len(page_count));
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        p->running = true;
+    }
+    /* Threads may terminate each other on error, so set them all up first */
+    multifd_send_state->count = thread_count;
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_send_pages: hand the queued pages to an idle channel
+ *
+ * Returns 1 on success or negative on error
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_pages(RAMState *rs)
+{
+    int i;
+    static int next_channel;
+    MultiFDSendParams *p = NULL;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    uint64_t transferred;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit!", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (!p->pending_job) {
+            p->pending_job++;
+            next_channel = (i + 1) % migrate_multifd_channels();
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    /* Swap the queued pages with the (empty) set owned by the channel */
+    p->packet_num = multifd_send_state->packet_num++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE +
+                  multifd_packet_len(pages->used);
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    /* Account for it in the main stream so rate limiting applies */
+    qemu_file_update_transfer(rs->f, transferred);
+    qemu_update_position(rs->f, transferred);
+    rs->bytes_transferred += transferred;
+
+    return 1;
+}
+
+/**
+ * multifd_queue_page: queue a page to be sent through multifd
+ *
+ * Returns 1 on success or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int multifd_queue_page(RAMState *rs, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    if (!pages->block) {
+        pages->block = block;
+    }
+
+    if (pages->block == block) {
+        pages->offset[pages->used] = offset;
+        pages->iov[pages->used].iov_base = block->host + offset;
+        pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+        pages->used++;
+
+        if (pages->used < pages->allocated) {
+            return 1;
+        }
+    }
+
+    if (multifd_send_pages(rs) < 0) {
+        return -1;
+    }
+
+    if (pages->block != block) {
+        return multifd_queue_page(rs, block, offset);
+    }
+
+    return 1;
+}
+
+/**
+ * multifd_send_sync_main: flush all the channels
+ *
+ * Sends out any queued pages, then waits until every channel has
+ * written everything it was given, and finally tells the destination
+ * (through the main stream) to wait for the same point on its side.
+ * This keeps pages from two different iterations from being placed
+ * out of order.
+ *
+ * Returns 0 on success or negative on error
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_sync_main(RAMState *rs)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used) {
+        if (multifd_send_pages(rs) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        p->packet_num = multifd_send_state->packet_num++;
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        bool quit;
+
+        qemu_mutex_lock(&p->mutex);
+        quit = p->quit;
+        qemu_mutex_unlock(&p->mutex);
+        if (quit) {
+            return -1;
+        }
+    }
+
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    rs->bytes_transferred += 8;
+
+    return 0;
+}
+
+static struct {
+    MultiFDRecvParams *params;
+    /* number of created threads */
+    int count;
+    /* syncs main thread and channels */
+    QemuSemaphore sem_sync;
+    /* global number of the last packet received */
+    uint64_t packet_num;
+} *multifd_recv_state;
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem_sync);
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        object_unref(OBJECT(p->c));
+        p->c = NULL;
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->name);
+        p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        g_free(p->packet);
+        p->packet = NULL;
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    multifd_recv_state->params = NULL;
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/**
+ * multifd_recv_sync_main: wait for all the channels to reach a sync point
+ *
+ * Called from ram_load() when the source says that everything it
+ * sent through multifd so far has to be in place.
+ *
+ * Returns 0 on success or negative on error
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i, ret = 0;
+
+    if (!migrate_use_multifd() || !multifd_recv_state) {
+        error_report("multifd sync received but multifd is not enabled");
+        return -EINVAL;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->running) {
+            ret = -EIO;
+        }
+        if (multifd_recv_state->packet_num < p->packet_num) {
+            multifd_recv_state->packet_num = p->packet_num;
+        }
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem_sync);
+    }
+    trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
+
+    return ret;
+}
+
+static int multifd_recv_initial_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDInit_t msg;
+
+    if (qio_channel_read_all(p->c, (char *)&msg, sizeof(msg), errp) < 0) {
+        return -1;
+    }
+
+    if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", be32_to_cpu(msg.magic), MULTIFD_MAGIC);
+        return -1;
+    }
+
+    if (be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", be32_to_cpu(msg.version), MULTIFD_VERSION);
+        return -1;
+    }
+
+    if (msg.id >= migrate_multifd_channels()) {
+        error_setg(errp, "multifd: received channel id %d is greater "
+                   "than number of channels %d", msg.id,
+                   migrate_multifd_channels());
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Called with rcu_read_lock held */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    RAMBlock *block;
+    int i;
+
+    packet->magic = be32_to_cpu(packet->magic);
+    if (packet->magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", packet->magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    packet->version = be32_to_cpu(packet->version);
+    if (packet->version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", packet->version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    packet->flags = be32_to_cpu(packet->flags);
+    packet->used = be32_to_cpu(packet->used);
+    if (packet->used > p->pages->allocated) {
+        error_setg(errp, "multifd: received packet with %d pages "
+                   "and expected maximum pages are %d",
+                   packet->used, p->pages->allocated);
+        return -1;
+    }
+    packet->packet_num = be64_to_cpu(packet->packet_num);
+
+    p->pages->used = packet->used;
+    if (!packet->used) {
+        return 0;
+    }
+
+    /* make sure that ramblock is 0 terminated */
+    packet->ramblock[255] = 0;
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown ram block %s",
+                   packet->ramblock);
+        return -1;
+    }
+    p->pages->block = block;
+
+    if (qio_channel_read_all(p->c, (char *)packet->offset,
+                             sizeof(uint64_t) * packet->used, errp) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < packet->used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if (offset > (block->used_length - TARGET_PAGE_SIZE) ||
+            (offset & ~TARGET_PAGE_MASK)) {
+            error_setg(errp, "multifd: offset too long " RAM_ADDR_FMT
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    if (multifd_recv_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+
+    while (true) {
+        uint32_t used;
+        uint32_t flags;
+
+        ret = qio_channel_read_all_eof(p->c, (char *)p->packet,
+                                       sizeof(MultiFDPacket_t), &local_err);
+        if (ret <= 0) {
+            /* 0: EOF  -1: Error */
+            break;
+        }
+
+        rcu_read_lock();
+        ret = multifd_recv_unfill_packet(p, &local_err);
+        if (ret == 0 && p->pages->used) {
+            ret = qio_channel_readv_all(p->c, p->pages->iov,
+                                        p->pages->used, &local_err);
+        }
+        rcu_read_unlock();
+        if (ret < 0) {
+            break;
+        }
+
+        used = p->pages->used;
+        flags = p->packet->flags;
+        trace_multifd_recv(p->id, p->packet->packet_num, used, flags);
+
+        qemu_mutex_lock(&p->mutex);
+        p->packet_num = p->packet->packet_num;
+        p->num_packets++;
+        p->num_pages += used;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+out:
+    if (local_err) {
+        bool quit;
+
+        qemu_mutex_lock(&p->mutex);
+        quit = p->quit;
+        qemu_mutex_unlock(&p->mutex);
+        /* Errors caused by multifd_load_cleanup() are expected */
+        if (!quit) {
+            MigrationIncomingState *mis = migration_incoming_get_current();
+
+            error_report_err(local_err);
+            local_err = NULL;
+            if (mis->from_src_file) {
+                qemu_file_set_error(mis->from_src_file, -EIO);
+            }
+        }
+        error_free(local_err);
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    /* Don't leave ram_load() waiting for a sync that will never come */
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+int multifd_load_setup(void)
+{
+    int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
+    uint8_t i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = 0;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem_sync, 0);
+        p->quit = false;
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet = g_malloc0(multifd_packet_len(page_count));
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+
+    return 0;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    int thread_count = migrate_multifd_channels();
+
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+
+    return multifd_recv_state &&
+           thread_count == atomic_read(&multifd_recv_state->count);
+}
+
+/**
+ * multifd_recv_new_channel: start a thread for a newly accepted channel
+ *
+ * Channels are numbered in the order they are accepted; the id sent
+ * by the source is only checked for sanity since pages can be placed
+ * by any of the threads.
+ *
+ * @ioc: the channel that was just accepted
+ */
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+    int id;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: unexpected migration channel");
+        return;
+    }
+    id = atomic_read(&multifd_recv_state->count);
+    if (id >= migrate_multifd_channels()) {
+        error_report("multifd: too many migration channels");
+        return;
+    }
+
+    trace_multifd_recv_new_channel(id);
+
+    p = &multifd_recv_state->params[id];
+    p->c = ioc;
+    object_ref(OBJECT(ioc));
+    qio_channel_set_blocking(ioc, true, NULL);
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    atomic_inc(&multifd_recv_state->count);
+}
+
 /**
  * save_page_header: write page header to wire
  *
@@ -641,6 +1584,71 @@ static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * Sync only the parts of @rb that cpu_physical_memory_set_dirty_range
+ * hinted at, instead of walking the dirty bitmap of the whole block.
+ */
+static void migration_bitmap_sync_hinted(RAMState *rs, RAMBlock *rb)
+{
+    ram_addr_t chunk_size = (ram_addr_t)RAM_DIRTY_HINT_PAGES <<
+                            TARGET_PAGE_BITS;
+    unsigned long chunks = DIV_ROUND_UP(rb->used_length, chunk_size);
+    unsigned long i, bits;
+    ram_addr_t start;
+    int j;
+
+    for (i = 0; i < BITS_TO_LONGS(chunks); i++) {
+        if (!atomic_read(&rb->dirty_hint[i])) {
+            continue;
+        }
+        bits = atomic_xchg(&rb->dirty_hint[i], 0);
+        while (bits) {
+            j = ctzl(bits);
+            bits &= bits - 1;
+            start = (i * BITS_PER_LONG + j) * chunk_size;
+            if (start < rb->used_length) {
+                migration_bitmap_sync_range(rs, rb, start,
+                                            MIN(chunk_size,
+                                                rb->used_length - start));
+            }
+        }
+    }
+}
+
+/**
+ * ram_sync_dirty_range: mark pages dirty in the migration bitmap
+ *
+ * Lets the KVM dirty ring set the pages it collects during
+ * migration_bitmap_sync straight in the bitmap of @rb, rather than
+ * in ram_list.dirty_memory.  Called with the iothread lock held.
+ *
+ * Returns false, and does nothing, if no bitmap sync is in progress.
+ *
+ * @rb: RAMBlock containing the pages
+ * @start: offset of the first page in @rb
+ * @length: length of the range in bytes
+ */
+bool ram_sync_dirty_range(RAMBlock *rb, ram_addr_t start, ram_addr_t length)
+{
+    RAMState *rs = &ram_state;
+    unsigned long page, end;
+
+    if (!rs->bitmap_sync_direct || !rb->bmap) {
+        return false;
+    }
+
+    page = start >> TARGET_PAGE_BITS;
+    end = MIN(TARGET_PAGE_ALIGN(start + length),
+              rb->used_length) >> TARGET_PAGE_BITS;
+    for (; page < end; page++) {
+        rs->num_dirty_pages_period++;
+        if (!test_and_set_bit(page, rb->bmap)) {
+            rs->migration_dirty_pages++;
+        }
+    }
+    return true;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -665,10 +1673,11 @@ uint64_t ram_pagesize_summary(void)
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
-    int64_t end_time;
+    int64_t start_time_us, end_time;
     uint64_t bytes_xfer_now;
 
     rs->bitmap_sync_count++;
+    start_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     if (!rs->bytes_xfer_prev) {
         rs->bytes_xfer_prev = ram_bytes_transferred();
@@ -679,17 +1688,38 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
-    memory_global_dirty_log_sync();
-
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
-    RAMBLOCK_FOREACH(block) {
-        migration_bitmap_sync_range(rs, block, 0, block->used_length);
+
+    /* The KVM dirty ring hands over the pages dirtied by the guest while
+     * the dirty log is synced, and they go straight to the bitmaps of the
+     * RAMBlocks.  Only pages marked dirty by QEMU itself, e.g. by device
+     * DMA, or by a ring that filled up between two syncs, are left in
+     * ram_list.dirty_memory, so skip the parts of RAM without any.
+     */
+    if (kvm_dirty_ring_enabled()) {
+        rs->bitmap_sync_direct = true;
+        memory_global_dirty_log_sync();
+        rs->bitmap_sync_direct = false;
+        RAMBLOCK_FOREACH(block) {
+            migration_bitmap_sync_hinted(rs, block);
+        }
+    } else {
+        memory_global_dirty_log_sync();
+        RAMBLOCK_FOREACH(block) {
+            migration_bitmap_sync_range(rs, block, 0, block->used_length);
+        }
     }
+
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    rs->bitmap_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                           start_time_us;
+    rs->bitmap_sync_time_total += rs->bitmap_sync_time;
+
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    rs->bitmap_sync_time);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -860,6 +1890,38 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
+/**
+ * ram_save_multifd_page: queue the given page for the multifd channels
+ *
+ * Zero pages still go through the main stream; everything else is
+ * handed to the multifd send threads.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_multifd_page(RAMState *rs, PageSearchStatus *pss,
+                                 bool last_stage)
+{
+    int pages;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    uint8_t *p = block->host + offset;
+
+    pages = save_zero_page(rs, block, offset, p);
+    if (pages == -1) {
+        if (multifd_queue_page(rs, block, offset) < 0) {
+            return -1;
+        }
+        rs->norm_pages++;
+        pages = 1;
+    }
+
+    return pages;
+}
+
 static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
                                 ram_addr_t offset)
 {
@@ -1286,8 +2348,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
          * round of migration even if compression is enabled. In theory,
          * xbzrle can do better than compression.
          */
-        if (migrate_use_compression() &&
-            (rs->ram_bulk_stage || !migrate_use_xbzrle())) {
+        if (migrate_use_multifd() && !migration_in_postcopy()) {
+            res = ram_save_multifd_page(rs, pss, last_stage);
+        } else if (migrate_use_compression() &&
+                   (rs->ram_bulk_stage || !migrate_use_xbzrle())) {
             res = ram_save_compressed_page(rs, pss, last_stage);
         } else {
             res = ram_save_page(rs, pss, last_stage);
@@ -2042,7 +3106,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(rs);
+    ret = multifd_send_sync_main(rs);
     rcu_read_unlock();
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
 
     /*
      * Must occur before EOS (or any QEMUFile operation)
@@ -2074,6 +3143,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     RAMState *rs = opaque;
+    int ret;
 
     rcu_read_lock();
 
@@ -2097,10 +3167,16 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(rs);
+    ret = multifd_send_sync_main(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2638,6 +3714,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -105,13 +105,22 @@ static int announce_self_create(uint8_t *buf,
 
 static void qemu_announce_self_iter(NICState *nic, void *opaque)
 {
+    NetClientState *nc = qemu_get_queue(nic);
+    AioContext *ctx = nc->peer ? nc->peer->aio_context : NULL;
     uint8_t buf[60];
     int len;
 
     trace_qemu_announce_self_iter(qemu_ether_ntoa(&nic->conf->macaddr));
     len = announce_self_create(buf, nic->conf->macaddr.a);
 
-    qemu_send_packet_raw(qemu_get_queue(nic), buf, len);
+    /* The backend may be serviced by an IOThread */
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    qemu_send_packet_raw(nc, buf, len);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
 }
 
 
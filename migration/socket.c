@@ -22,8 +22,43 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
 #include "trace.h"
 
+static struct SocketOutgoingArgs {
+    SocketAddress *saddr;
+} outgoing_args;
+
+/**
+ * socket_send_channel_create: open an extra channel to the destination
+ *
+ * Connects synchronously to the address used for the main migration
+ * channel; this is used by the multifd send threads, which each open
+ * their own connection from their own thread.
+ *
+ * Returns the new channel or NULL on error
+ *
+ * @errp: pointer to a NULL-initialized error object
+ */
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc = qio_channel_socket_new();
+
+    if (!outgoing_args.saddr) {
+        error_setg(errp, "No outgoing socket address for the migration");
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-outgoing");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_args.saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+
+    return QIO_CHANNEL(sioc);
+}
+
 
 static SocketAddress *tcp_build_address(const char *host_port, Error **errp)
 {
@@ -98,6 +133,10 @@ static void socket_start_outgoing_migration(MigrationState *s,
         data->hostname = g_strdup(saddr->u.inet.host);
     }
 
+    /* Kept around so that multifd can open more channels later */
+    qapi_free_SocketAddress(outgoing_args.saddr);
+    outgoing_args.saddr = QAPI_CLONE(SocketAddress, saddr);
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-outgoing");
     qio_channel_socket_connect_async(sioc,
                                      saddr,
@@ -150,6 +189,11 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
                                        QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
 
+    /* With multifd, more connections follow the main one */
+    if (migrate_use_multifd() && !migration_has_all_channels()) {
+        return TRUE; /* keep listening */
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
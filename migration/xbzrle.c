@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,17 +25,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +124,299 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vectorized encoders below share the run splitting logic, and
+ * only differ in how they find the end of a run: @find returns the
+ * first index at or after @i where old_buf and new_buf are equal (if
+ * @equal is false) or differ (if @equal is true), or @slen if there
+ * is none.  Since runs are maximal either way, they produce exactly
+ * the same output as xbzrle_encode_buffer_int().
+ */
+typedef int (*XBZRLEFindFunc)(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen, bool equal);
+
+static inline __attribute__((always_inline))
+int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                       uint8_t *dst, int dlen, XBZRLEFindFunc find)
+{
+    int d = 0, i = 0, j;
+    uint32_t zrun_len, nzrun_len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = find(old_buf, new_buf, i, slen, true);
+        zrun_len = j - i;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (j == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+        i = j;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = find(old_buf, new_buf, i, slen, false);
+        nzrun_len = j - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = j;
+    }
+
+    return d;
+}
+
+static inline int xbzrle_find_tail(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   int i, int slen, bool equal)
+{
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline int xbzrle_find_avx2(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   int i, int slen, bool equal)
+{
+    /* Compare 32 bytes at a time; bit n of the mask is set when
+     * byte n is equal in both buffers.  */
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        uint32_t stop = equal ? ~eq : eq;
+
+        if (stop) {
+            return i + ctz32(stop);
+        }
+        i += 32;
+    }
+    return xbzrle_find_tail(old_buf, new_buf, i, slen, equal);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline int xbzrle_find_avx512(const uint8_t *old_buf,
+                                     const uint8_t *new_buf,
+                                     int i, int slen, bool equal)
+{
+    __mmask64 valid;
+    __m512i a, b;
+    uint64_t eq, stop;
+
+    while (i + 64 <= slen) {
+        a = _mm512_loadu_si512(old_buf + i);
+        b = _mm512_loadu_si512(new_buf + i);
+        eq = _mm512_cmpeq_epi8_mask(a, b);
+        stop = equal ? ~eq : eq;
+        if (stop) {
+            return i + ctz64(stop);
+        }
+        i += 64;
+    }
+    if (i == slen) {
+        return slen;
+    }
+
+    /* A masked load handles the tail without reading past the end.  */
+    valid = (1ULL << (slen - i)) - 1;
+    a = _mm512_maskz_loadu_epi8(valid, old_buf + i);
+    b = _mm512_maskz_loadu_epi8(valid, new_buf + i);
+    eq = _mm512_cmpeq_epi8_mask(a, b);
+    stop = (equal ? ~eq : eq) & valid;
+    return stop ? i + ctz64(stop) : slen;
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+
+static inline int xbzrle_find_neon(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   int i, int slen, bool equal)
+{
+    while (i + 16 <= slen) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+        /* Narrow each 0x00/0xff byte to a nibble, giving a 64-bit
+         * mask with four bits per byte.  */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        uint64_t stop = equal ? ~mask : mask;
+
+        if (stop) {
+            return i + ctz64(stop) / 4;
+        }
+        i += 16;
+    }
+    return xbzrle_find_tail(old_buf, new_buf, i, slen, equal);
+}
+
+static int xbzrle_encode_buffer_neon(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_neon);
+}
+#endif /* __aarch64__ */
+
+/* Note that for test_xbzrle_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512  1
+#define CACHE_AVX2    2
+#define CACHE_NEON    4
+
+typedef int (*XBZRLEEncodeFunc)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
+
+#ifdef __aarch64__
+/* Advanced SIMD is part of the base AArch64 ISA.  */
+# define INIT_CACHE CACHE_NEON
+# define INIT_ACCEL xbzrle_encode_buffer_neon
+#else
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static XBZRLEEncodeFunc xbzrle_encode_accel = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    XBZRLEEncodeFunc fn = xbzrle_encode_buffer_int;
+#ifdef __aarch64__
+    if (cache & CACHE_NEON) {
+        fn = xbzrle_encode_buffer_neon;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#ifndef bit_AVX512BW
+#define bit_AVX512BW (1 << 30)
+#endif
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#ifdef CONFIG_AVX512BW_OPT
+            /* The OS must also save the opmask and ZMM state.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and
+       there are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *test_xbzrle_accel_name(void)
+{
+    if (cpuid_cache & CACHE_AVX512) {
+        return "avx512bw";
+    } else if (cpuid_cache & CACHE_AVX2) {
+        return "avx2";
+    } else if (cpuid_cache & CACHE_NEON) {
+        return "neon";
+    }
+    return "int";
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
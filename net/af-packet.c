@@ -0,0 +1,541 @@
+/*
+ * AF_PACKET ring-buffer network backend
+ *
+ * Frames are received from a memory-mapped TPACKET_V3 ring and handed to
+ * the peer in place; frames from the peer are copied into a memory-mapped
+ * transmit ring and pushed to the kernel once per batch.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qemu/iov.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+#include "trace.h"
+
+#define AF_PACKET_RX_BLOCK_SIZE     (256 * 1024)
+#define AF_PACKET_RX_BLOCKS         64
+#define AF_PACKET_TX_FRAMES         1024
+
+/* Retire a partially filled receive block after this many milliseconds */
+#define AF_PACKET_RX_BLOCK_TIMEOUT  1
+
+/* Packets handed to the peer in one qemu_send_packet_batch_async() call */
+#define AF_PACKET_RX_BATCH          64
+
+/* Kick the kernel without waiting for the bottom half past this many frames */
+#define AF_PACKET_TX_BATCH          64
+
+/* Offset of the frame data within a TPACKET_V2 transmit slot */
+#define AF_PACKET_TX_DATA_OFFSET \
+    (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+typedef struct AfPacketState {
+    NetClientState nc;
+    int rx_fd;
+    int tx_fd;
+    bool read_poll;
+    bool write_poll;
+
+    /* Receive ring: TPACKET_V3, made of variable-length frames in blocks */
+    uint8_t *rx_ring;
+    size_t rx_ring_size;
+    uint32_t rx_block_size;
+    uint32_t rx_blocks;
+    uint32_t rx_block;              /* block being consumed */
+    uint32_t rx_left;               /* packets left in that block */
+    struct tpacket3_hdr *rx_pkt;    /* next packet in that block */
+    struct iovec rx_iov[AF_PACKET_RX_BATCH];
+
+    /* Transmit ring: TPACKET_V2, fixed-size slots */
+    uint8_t *tx_ring;
+    size_t tx_ring_size;
+    uint32_t tx_frame_size;
+    uint32_t tx_frames;
+    uint32_t tx_head;
+    uint32_t tx_pending;            /* slots filled since the last kick */
+    QEMUBH *tx_bh;
+} AfPacketState;
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_update_fd_handler(AfPacketState *s)
+{
+    qemu_set_fd_handler(s->rx_fd, s->read_poll ? af_packet_send : NULL,
+                        NULL, s);
+    qemu_set_fd_handler(s->tx_fd, NULL,
+                        s->write_poll ? af_packet_writable : NULL, s);
+}
+
+static void af_packet_read_poll(AfPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AfPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+/* Transmit path (peer --> host interface) */
+
+static struct tpacket2_hdr *af_packet_tx_frame(AfPacketState *s, uint32_t i)
+{
+    return (struct tpacket2_hdr *)(s->tx_ring + (size_t)i * s->tx_frame_size);
+}
+
+/* Ask the kernel to send every slot marked TP_STATUS_SEND_REQUEST. */
+static void af_packet_tx_kick(AfPacketState *s)
+{
+    ssize_t ret;
+
+    if (!s->tx_pending) {
+        return;
+    }
+
+    trace_af_packet_tx_kick(s, s->tx_pending);
+    s->tx_pending = 0;
+    do {
+        ret = sendto(s->tx_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    /*
+     * EAGAIN and ENOBUFS leave the slots queued; they go out with the
+     * next kick, or are picked up once af_packet_writable() runs.
+     */
+    if (ret < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        error_report("af-packet: failed to transmit on %s: %s",
+                     s->nc.info_str, strerror(errno));
+    }
+}
+
+static void af_packet_tx_bh(void *opaque)
+{
+    af_packet_tx_kick(opaque);
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/*
+ * Frames are only queued here; the kick is deferred to a bottom half so
+ * that a burst from e.g. virtio_net_flush_tx() costs a single sendto().
+ */
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    struct tpacket2_hdr *hdr = af_packet_tx_frame(s, s->tx_head);
+
+    if (unlikely(size > s->tx_frame_size - AF_PACKET_TX_DATA_OFFSET)) {
+        /* Drop. */
+        return size;
+    }
+
+    if (atomic_read(&hdr->tp_status) != TP_STATUS_AVAILABLE) {
+        /* The slot may only be waiting for us to kick the kernel */
+        af_packet_tx_kick(s);
+        if (atomic_read(&hdr->tp_status) != TP_STATUS_AVAILABLE) {
+            af_packet_write_poll(s, true);
+            return 0;
+        }
+    }
+    smp_rmb();
+
+    iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET, size);
+    hdr->tp_len = size;
+    smp_wmb();
+    atomic_set(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+
+    s->tx_head = (s->tx_head + 1) % s->tx_frames;
+    if (++s->tx_pending >= AF_PACKET_TX_BATCH) {
+        af_packet_tx_kick(s);
+    } else {
+        qemu_bh_schedule(s->tx_bh);
+    }
+
+    return size;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+/* Receive path (host interface --> peer) */
+
+static struct tpacket_block_desc *af_packet_rx_block(AfPacketState *s)
+{
+    return (struct tpacket_block_desc *)
+        (s->rx_ring + (size_t)s->rx_block * s->rx_block_size);
+}
+
+/* Hand the current block back to the kernel and move to the next one. */
+static void af_packet_rx_release(AfPacketState *s)
+{
+    struct tpacket_block_desc *pbd = af_packet_rx_block(s);
+
+    smp_mb();
+    atomic_set(&pbd->hdr.bh1.block_status, TP_STATUS_KERNEL);
+    s->rx_block = (s->rx_block + 1) % s->rx_blocks;
+    s->rx_pkt = NULL;
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+/*
+ * Frames point straight into the ring.  A block is only returned to the
+ * kernel once all of its frames have been delivered or queued (the queue
+ * keeps its own copy), so the peer never sees a slot being overwritten.
+ */
+static void af_packet_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    while (s->read_poll) {
+        struct tpacket_block_desc *pbd = af_packet_rx_block(s);
+        int count = 0;
+        int sent;
+
+        if (!s->rx_pkt) {
+            if (!(atomic_read(&pbd->hdr.bh1.block_status) & TP_STATUS_USER)) {
+                break;
+            }
+            smp_rmb();
+            s->rx_left = pbd->hdr.bh1.num_pkts;
+            s->rx_pkt = (struct tpacket3_hdr *)
+                ((uint8_t *)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+        }
+
+        while (s->rx_left && count < AF_PACKET_RX_BATCH) {
+            struct tpacket3_hdr *ppd = s->rx_pkt;
+            struct sockaddr_ll *sll = (struct sockaddr_ll *)
+                ((uint8_t *)ppd + TPACKET_ALIGN(sizeof(*ppd)));
+
+            /* Skip what we transmitted ourselves */
+            if (sll->sll_pkttype != PACKET_OUTGOING) {
+                s->rx_iov[count].iov_base = (uint8_t *)ppd + ppd->tp_mac;
+                s->rx_iov[count].iov_len = ppd->tp_snaplen;
+                count++;
+            }
+            s->rx_pkt = (struct tpacket3_hdr *)
+                ((uint8_t *)ppd + ppd->tp_next_offset);
+            s->rx_left--;
+        }
+
+        sent = count ? qemu_send_packet_batch_async(&s->nc, s->rx_iov, count,
+                                                    af_packet_send_completed)
+                     : 0;
+        trace_af_packet_rx_batch(s, count, sent);
+
+        if (!s->rx_left) {
+            af_packet_rx_release(s);
+        }
+
+        if (sent < count) {
+            /*
+             * The peer does not receive anymore; the rest of the batch was
+             * queued.  Stop reading until af_packet_send_completed().
+             */
+            af_packet_read_poll(s, false);
+            break;
+        }
+    }
+}
+
+/* Setup */
+
+static int af_packet_ifindex(int fd, const char *ifname, int *mtu,
+                             Error **errp)
+{
+    struct ifreq ifr;
+
+    if (strlen(ifname) >= sizeof(ifr.ifr_name)) {
+        error_setg(errp, "interface name '%s' is too long", ifname);
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, ifname);
+    if (ioctl(fd, SIOCGIFMTU, &ifr) < 0) {
+        error_setg_errno(errp, errno, "cannot get MTU of %s", ifname);
+        return -1;
+    }
+    *mtu = ifr.ifr_mtu;
+
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        error_setg_errno(errp, errno, "cannot find interface %s", ifname);
+        return -1;
+    }
+    return ifr.ifr_ifindex;
+}
+
+/*
+ * Create a packet socket of the given TPACKET version, attach a ring of
+ * type @ring_opt to it, map the ring and bind the socket to @ifindex.
+ */
+static int af_packet_open(int version, int ring_opt, struct tpacket_req3 *req,
+                          int ifindex, uint16_t protocol,
+                          uint8_t **ring, size_t *ring_size, Error **errp)
+{
+    struct sockaddr_ll sll;
+    int one = 1;
+    void *map;
+    int fd;
+
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create AF_PACKET socket");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0) {
+        error_setg_errno(errp, errno, "TPACKET_V%d is not supported",
+                         version + 1);
+        goto fail;
+    }
+
+    /* Let the kernel skip malformed transmit frames instead of stopping */
+    if (ring_opt == PACKET_TX_RING &&
+        setsockopt(fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0) {
+        error_setg_errno(errp, errno, "cannot set PACKET_LOSS");
+        goto fail;
+    }
+
+    if (setsockopt(fd, SOL_PACKET, ring_opt, req,
+                   version == TPACKET_V3 ? sizeof(*req)
+                                         : sizeof(struct tpacket_req)) < 0) {
+        error_setg_errno(errp, errno, "cannot set up the %s ring",
+                         ring_opt == PACKET_RX_RING ? "receive" : "transmit");
+        goto fail;
+    }
+
+    *ring_size = (size_t)req->tp_block_size * req->tp_block_nr;
+    map = mmap(NULL, *ring_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (map == MAP_FAILED) {
+        /* MAP_LOCKED fails if RLIMIT_MEMLOCK is too low; not required */
+        map = mmap(NULL, *ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map the AF_PACKET ring");
+        goto fail;
+    }
+    *ring = map;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = protocol;
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_setg_errno(errp, errno, "cannot bind AF_PACKET socket");
+        munmap(*ring, *ring_size);
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    af_packet_poll(nc, false);
+    af_packet_tx_kick(s);
+    qemu_bh_delete(s->tx_bh);
+
+    munmap(s->rx_ring, s->rx_ring_size);
+    munmap(s->tx_ring, s->tx_ring_size);
+    close(s->rx_fd);
+    close(s->tx_fd);
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_DRIVER_AF_PACKET,
+    .size = sizeof(AfPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+};
+
+int net_init_af_packet(const Netdev *netdev, const char *name,
+                       NetClientState *peer, Error **errp)
+{
+    const NetdevAfPacketOptions *opts;
+    struct tpacket_req3 rx_req, tx_req;
+    struct packet_mreq mreq;
+    uint8_t *rx_ring = NULL, *tx_ring = NULL;
+    size_t rx_ring_size = 0, tx_ring_size = 0;
+    uint32_t block_size, blocks, frames, frame_size;
+    int rx_fd = -1, tx_fd = -1;
+    int ifindex, mtu;
+    NetClientState *nc;
+    AfPacketState *s;
+
+    assert(netdev->type == NET_CLIENT_DRIVER_AF_PACKET);
+    opts = &netdev->u.af_packet;
+
+    block_size = opts->has_rx_block_size ? opts->rx_block_size
+                                         : AF_PACKET_RX_BLOCK_SIZE;
+    blocks = opts->has_rx_blocks ? opts->rx_blocks : AF_PACKET_RX_BLOCKS;
+    frames = opts->has_tx_frames ? opts->tx_frames : AF_PACKET_TX_FRAMES;
+
+    if (!block_size || block_size % getpagesize()) {
+        error_setg(errp, "rx-block-size must be a multiple of %d",
+                   getpagesize());
+        return -1;
+    }
+    if (!blocks || !frames) {
+        error_setg(errp, "rx-blocks and tx-frames must be positive");
+        return -1;
+    }
+
+    tx_fd = qemu_socket(AF_PACKET, SOCK_RAW, 0);
+    if (tx_fd < 0) {
+        error_setg_errno(errp, errno, "cannot create AF_PACKET socket");
+        return -1;
+    }
+    ifindex = af_packet_ifindex(tx_fd, opts->ifname, &mtu, errp);
+    close(tx_fd);
+    tx_fd = -1;
+    if (ifindex < 0) {
+        return -1;
+    }
+
+    /* Room for the slot header and a VLAN tagged frame of MTU size */
+    frame_size = pow2ceil(AF_PACKET_TX_DATA_OFFSET + ETH_HLEN + 4 + mtu);
+    frame_size = MAX(frame_size, TPACKET_ALIGNMENT << 7);
+    if (block_size < frame_size) {
+        error_setg(errp, "rx-block-size must be at least %u for MTU %d",
+                   frame_size, mtu);
+        return -1;
+    }
+
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size = block_size;
+    rx_req.tp_block_nr = blocks;
+    rx_req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    rx_req.tp_frame_nr = (block_size / rx_req.tp_frame_size) * blocks;
+    rx_req.tp_retire_blk_tov = AF_PACKET_RX_BLOCK_TIMEOUT;
+
+    rx_fd = af_packet_open(TPACKET_V3, PACKET_RX_RING, &rx_req, ifindex,
+                           htons(ETH_P_ALL), &rx_ring, &rx_ring_size, errp);
+    if (rx_fd < 0) {
+        goto fail;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(rx_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_setg_errno(errp, errno, "cannot set %s in promiscuous mode",
+                         opts->ifname);
+        goto fail;
+    }
+
+    /*
+     * The transmit ring lives on a separate TPACKET_V2 socket, which works
+     * on kernels without TPACKET_V3 transmit support.  It is bound with
+     * protocol 0 so that it never receives anything.
+     */
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = MAX(frame_size, getpagesize());
+    tx_req.tp_frame_size = frame_size;
+    tx_req.tp_block_nr = DIV_ROUND_UP(frames,
+                                      tx_req.tp_block_size / frame_size);
+    tx_req.tp_frame_nr = tx_req.tp_block_nr *
+                         (tx_req.tp_block_size / frame_size);
+
+    tx_fd = af_packet_open(TPACKET_V2, PACKET_TX_RING, &tx_req, ifindex,
+                           0, &tx_ring, &tx_ring_size, errp);
+    if (tx_fd < 0) {
+        goto fail;
+    }
+
+    qemu_set_nonblock(rx_fd);
+    qemu_set_nonblock(tx_fd);
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s", opts->ifname);
+
+    s = DO_UPCAST(AfPacketState, nc, nc);
+    s->rx_fd = rx_fd;
+    s->tx_fd = tx_fd;
+    s->rx_ring = rx_ring;
+    s->rx_ring_size = rx_ring_size;
+    s->rx_block_size = block_size;
+    s->rx_blocks = blocks;
+    s->tx_ring = tx_ring;
+    s->tx_ring_size = tx_ring_size;
+    s->tx_frame_size = frame_size;
+    s->tx_frames = tx_req.tp_frame_nr;
+    s->tx_bh = qemu_bh_new(af_packet_tx_bh, s);
+
+    af_packet_read_poll(s, true); /* Initially only poll for reads. */
+
+    return 0;
+
+fail:
+    if (rx_fd >= 0) {
+        munmap(rx_ring, rx_ring_size);
+        close(rx_fd);
+    }
+    return -1;
+}
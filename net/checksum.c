@@ -17,27 +17,301 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/* The ones' complement sum does not depend on the byte order, except that
+ * the result comes out byte-swapped; so the kernels below add up 16-bit
+ * words in host order, and net_checksum_add_cont() swaps the folded sum
+ * to network order.  The kernels take an even length.
+ */
+
+static inline uint32_t csum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static uint32_t csum_words_int(const uint8_t *buf, size_t len)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum = 0;
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    /* 2^16 == 1 modulo 0xffff, so 32-bit words can be added as well */
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t v = ldq_he_p(buf);
+        sum += (v & 0xffffffff) + (v >> 32);
+    }
+    for (; len; buf += 2, len -= 2) {
+        sum += lduw_he_p(buf);
+    }
+    return csum_fold(sum);
+}
+
+/* Toeplitz hash: every set bit of the input, most significant bit of
+ * the first byte first, XORs in the 32 key bits that start at the same
+ * bit position.  len + 4 bytes of key are used.
+ */
+static uint32_t toeplitz_int(const uint8_t *input, size_t len,
+                             const uint8_t *key)
+{
+    uint64_t window = ldl_be_p(key);
+    uint32_t hash = 0;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        uint8_t in = input[i];
+
+        /* 40 key bits, enough for the 8 windows of this byte */
+        window = (window << 8) | key[i + 4];
+        for (bit = 0; bit < 8; bit++) {
+            hash ^= (uint32_t)(window >> (8 - bit)) &
+                    -(uint32_t)((in >> (7 - bit)) & 1);
+        }
+        window &= 0xffffffff;
+    }
+    return hash;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* As in util/bufferiszero.c, do not use push_options pragmas unnecessarily,
+ * because clang does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Blocks are small enough that the 32-bit lanes can't overflow */
+#define CSUM_VEC_BLOCK 8192
+
+static uint32_t csum_words_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        size_t n = MIN(len / 16, CSUM_VEC_BLOCK);
+        __m128i acc = zero;
+        uint32_t lanes[4];
+
+        len -= n * 16;
+        do {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            buf += 16;
+        } while (--n);
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return csum_fold(sum + csum_words_int(buf, len));
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* The regions are ordered with increasing ISA, see util/bufferiszero.c */
+#pragma GCC push_options
+#pragma GCC target("pclmul")
+#include <wmmintrin.h>
+
+/* The XOR of the shifted keys is a carry-less product.  With the input
+ * bits reversed, input bit b contributes key << b, and bits 32..63 of
+ * the product are the hash of 32 input bits.
+ */
+static uint32_t toeplitz_clmul(const uint8_t *input, size_t len,
+                               const uint8_t *key)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        __m128i x = _mm_set_epi32(0, 0, 0, revbit32(ldl_be_p(input + i)));
+        __m128i k = _mm_set_epi64x(0, ldq_be_p(key + i));
+        uint64_t prod[2];
+
+        _mm_storeu_si128((__m128i *)prod, _mm_clmulepi64_si128(x, k, 0));
+        hash ^= prod[0] >> 32;
     }
     if (i < len) {
-        sum1 += (uint32_t)buf[i];
+        hash ^= toeplitz_int(input + i, len - i, key + i);
     }
+    return hash;
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
 
+static uint32_t csum_words_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (len >= 32) {
+        size_t n = MIN(len / 32, CSUM_VEC_BLOCK);
+        __m256i acc = zero;
+        uint32_t lanes[8];
+        int i;
+
+        len -= n * 32;
+        do {
+            __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            buf += 32;
+        } while (--n);
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (i = 0; i < 8; i++) {
+            sum += lanes[i];
+        }
+    }
+    return csum_fold(sum + csum_words_sse2(buf, len));
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_net_checksum_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+#define CACHE_PCLMUL  4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support <cpuid.h>.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_CSUM_ACCEL csum_words_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_CSUM_ACCEL csum_words_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static uint32_t (*csum_accel)(const uint8_t *, size_t) = INIT_CSUM_ACCEL;
+static uint32_t (*toeplitz_accel)(const uint8_t *, size_t,
+                                  const uint8_t *) = toeplitz_int;
+
+static void init_accel(unsigned cache)
+{
+    uint32_t (*csum_fn)(const uint8_t *, size_t) = csum_words_int;
+    uint32_t (*toeplitz_fn)(const uint8_t *, size_t,
+                            const uint8_t *) = toeplitz_int;
+
+    if (cache & CACHE_SSE2) {
+        csum_fn = csum_words_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        csum_fn = csum_words_avx2;
+    }
+    if (cache & CACHE_PCLMUL) {
+        toeplitz_fn = toeplitz_clmul;
+    }
+#endif
+    csum_accel = csum_fn;
+    toeplitz_accel = toeplitz_fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+        if (c & bit_PCLMUL) {
+            cache |= CACHE_PCLMUL;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_net_checksum_next_accel(void)
+{
+    /* If no bits set, we just tested the integer versions, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define csum_accel      csum_words_int
+#define toeplitz_accel  toeplitz_int
+bool test_net_checksum_next_accel(void)
+{
+    return false;
+}
+#endif
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint32_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    sum = csum_accel(buf, len & ~1);
+#ifndef HOST_WORDS_BIGENDIAN
+    sum = bswap16(sum);
+#endif
+    if (len & 1) {
+        sum = csum_fold(sum + (buf[len - 1] << 8));
+    }
+
+    /* A chunk at an odd offset has its bytes in the other half words */
     if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+        sum = bswap16(sum);
     }
+    return sum;
+}
+
+void net_toeplitz_add(uint32_t *result, uint8_t *input, uint32_t len,
+                      net_toeplitz_key *key)
+{
+    *result ^= toeplitz_accel(input, len, key->window);
+    key->window += len;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -323,6 +323,7 @@ void net_hub_check_clients(void)
             case NET_CLIENT_DRIVER_SOCKET:
             case NET_CLIENT_DRIVER_VDE:
             case NET_CLIENT_DRIVER_VHOST_USER:
+            case NET_CLIENT_DRIVER_AF_PACKET:
                 has_host_dev = 1;
                 break;
             default:
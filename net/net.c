@@ -66,6 +66,9 @@ const char *host_net_devices[] = {
 #ifdef CONFIG_NETMAP
     "netmap",
 #endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet",
+#endif
 #ifdef CONFIG_SLIRP
     "user",
 #endif
@@ -520,6 +523,25 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/* Filters run their own timers and handlers in the main loop, so a client
+ * with filters attached stays there.
+ */
+bool qemu_net_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context && QTAILQ_EMPTY(&nc->filters);
+}
+
+/* Move the client's fd handlers to @ctx, or back to the main loop if @ctx
+ * is NULL.  Once moved, the client's handlers run with @ctx acquired and
+ * everything else touching the client must acquire it as well.
+ */
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_net_can_set_aio_context(nc));
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -667,6 +689,55 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/**
+ * qemu_send_packet_batch_async: send several packets to the peer
+ *
+ * Each element of @pkts holds one whole packet.  If the peer can take
+ * them in one go (NetClientInfo.receive_batch), they are delivered
+ * together; otherwise, or for whatever the peer couldn't take, they
+ * are sent one by one as with qemu_sendv_packet_async().
+ *
+ * Returns @count if every packet was delivered or discarded, or the
+ * index of the first packet that had to be queued.  In that case all
+ * the following packets were queued as well, and the sender should
+ * stop until @sent_cb is called.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int done = 0, queued = count;
+    int i;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    /* Filters look at each packet on its own */
+    if (peer->info->receive_batch &&
+        QTAILQ_EMPTY(&sender->filters) && QTAILQ_EMPTY(&peer->filters)) {
+        done = qemu_net_queue_send_batch(peer->incoming_queue, sender,
+                                         QEMU_NET_PACKET_FLAG_NONE,
+                                         pkts, count,
+                                         qemu_deliver_packet_batch);
+    }
+
+    for (i = done; i < count; i++) {
+        if (qemu_sendv_packet_async(sender, &pkts[i], 1, sent_cb) == 0 &&
+            queued == count) {
+            queued = i;
+        }
+    }
+
+    return queued;
+}
+
+bool qemu_peer_has_receive_batch(NetClientState *nc)
+{
+    return nc->peer && nc->peer->info->receive_batch;
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -739,9 +810,33 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    /* Whatever is left over goes through qemu_deliver_packet_iov(),
+     * which disables reception if the peer is really out of room.
+     */
+    return nc->info->receive_batch(nc, pkts, count);
+}
+
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     int ret;
@@ -752,24 +847,50 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/**
+ * qemu_sendv_packet_zerocopy: send a packet without copying it
+ *
+ * Like qemu_sendv_packet_async(), but if the packet has to be queued,
+ * the queue refers to the memory described by @iov rather than to a
+ * copy of it.  When this returns 0, the sender must keep that memory
+ * valid and mapped until @sent_cb is called, which is also when guest
+ * buffers can be completed.
+ */
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *sender,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -961,6 +1082,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_L2TPV3
         [NET_CLIENT_DRIVER_L2TPV3]    = net_init_l2tpv3,
 #endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_DRIVER_AF_PACKET] = net_init_af_packet,
+#endif
 };
 
 
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -46,6 +47,8 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    struct iovec *iov;          /* QEMU_NET_PACKET_FLAG_ZEROCOPY only */
+    int iovcnt;
     uint8_t data[0];
 };
 
@@ -107,6 +110,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -127,6 +131,23 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
+
+    if ((flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) && sent_cb) {
+        /* Only the iovec is copied; the sender keeps the data around */
+        packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(struct iovec));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->iov = (struct iovec *)packet->data;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->iov, iov, iovcnt * sizeof(struct iovec));
+        packet->size = iov_size(iov, iovcnt);
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
@@ -134,7 +155,8 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     packet = g_malloc(sizeof(NetPacket) + max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
-    packet->flags = flags;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY;
+    packet->iov = NULL;
     packet->size = 0;
 
     for (i = 0; i < iovcnt; i++) {
@@ -232,6 +254,31 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Hands the packets to @deliver_batch if nothing is queued ahead of
+ * them.  Returns the number of packets it consumed; the caller must
+ * send the rest (if any) one at a time, so that they get queued.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetQueueDeliverBatchFunc *deliver_batch)
+{
+    int ret;
+
+    if (queue->delivering || !QTAILQ_EMPTY(&queue->packets) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    queue->delivering = 1;
+    ret = deliver_batch(sender, flags, pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -258,11 +305,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
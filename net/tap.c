@@ -40,22 +40,30 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Packets read from the tap device before they are handed to the peer,
+ * when the peer can receive them in batches
+ */
+#define TAP_BATCH_SIZE 32
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
     uint8_t buf[NET_BUFSIZE];
+    uint8_t *batch_buf;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
     bool has_ufo;
     bool enabled;
+    AioContext *ctx;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
@@ -66,9 +74,18 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+static void tap_send_aio(void *opaque);
+static void tap_writable_aio(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false,
+                           s->read_poll && s->enabled ? tap_send_aio : NULL,
+                           s->write_poll && s->enabled ? tap_writable_aio : NULL,
+                           NULL, s);
+        return;
+    }
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -96,6 +113,34 @@ static void tap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
+/* fd handlers used while the tap device is serviced by an IOThread; the
+ * peer's state is protected by the AioContext lock.
+ */
+static void tap_send_aio(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    /* We may have been moved elsewhere while waiting for the lock */
+    if (s->ctx == ctx) {
+        tap_send(s);
+    }
+    aio_context_release(ctx);
+}
+
+static void tap_writable_aio(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    if (s->ctx == ctx) {
+        tap_writable(s);
+    }
+    aio_context_release(ctx);
+}
+
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
@@ -179,12 +224,69 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Drains the tap device into batch_buf and hands the packets to the
+ * peer a batch at a time, so that it can fill its receive ring and
+ * notify the guest once per batch rather than once per packet.
+ */
+static void tap_send_batch(TAPState *s)
+{
+    struct iovec pkts[TAP_BATCH_SIZE];
+    int packets = 0;
+    int count, sent;
+
+    if (!s->batch_buf) {
+        s->batch_buf = g_malloc(TAP_BATCH_SIZE * NET_BUFSIZE);
+    }
+
+    /* Same limit on the work done per callback as tap_send() */
+    while (packets < 50) {
+        int max = MIN(TAP_BATCH_SIZE, 50 - packets);
+        bool drained = false;
+
+        for (count = 0; count < max; count++) {
+            uint8_t *buf = s->batch_buf + count * NET_BUFSIZE;
+            int size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+
+            if (size <= 0) {
+                drained = true;
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+            pkts[count].iov_base = buf;
+            pkts[count].iov_len = size;
+        }
+        if (!count) {
+            break;
+        }
+
+        sent = qemu_send_packet_batch_async(&s->nc, pkts, count,
+                                            tap_send_completed);
+        if (sent < count) {
+            tap_read_poll(s, false);
+            break;
+        }
+        if (drained) {
+            break;
+        }
+        packets += count;
+    }
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
+    if (qemu_peer_has_receive_batch(&s->nc)) {
+        tap_send_batch(s);
+        return;
+    }
+
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -325,6 +427,30 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
+}
+
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    AioContext *old_ctx = s->ctx;
+
+    if (old_ctx == ctx) {
+        return;
+    }
+
+    if (old_ctx) {
+        aio_context_acquire(old_ctx);
+        aio_set_fd_handler(old_ctx, s->fd, false, NULL, NULL, NULL, NULL);
+        s->ctx = NULL;
+        aio_context_release(old_ctx);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -359,6 +485,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
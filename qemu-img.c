@@ -603,6 +603,13 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
     }
 }
 
+static void check_status_cb(BlockDriverState *bs,
+                            int64_t offset, int64_t total_work_size,
+                            void *opaque)
+{
+    qemu_progress_print(100.f * offset / total_work_size, 0);
+}
+
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
@@ -612,7 +619,11 @@ static int collect_image_check(BlockDriverState *bs,
     int ret;
     BdrvCheckResult result;
 
-    ret = bdrv_check(bs, &result, fix);
+    /* In case the driver does not call check_status_cb() */
+    qemu_progress_print(0.f, 0);
+    ret = bdrv_check(bs, &result, fix, &check_status_cb, NULL);
+    qemu_progress_print(100.f, 0);
+    qemu_progress_end();
     if (ret < 0) {
         return ret;
     }
@@ -662,7 +673,7 @@ static int img_check(int argc, char **argv)
     int flags = BDRV_O_CHECK;
     bool writethrough;
     ImageCheck *check;
-    bool quiet = false;
+    bool quiet = false, progress = false;
     bool image_opts = false;
     bool force_share = false;
 
@@ -682,7 +693,7 @@ static int img_check(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:r:T:qU",
+        c = getopt_long(argc, argv, ":hf:r:T:pqU",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -718,6 +729,9 @@ static int img_check(int argc, char **argv)
         case 'T':
             cache = optarg;
             break;
+        case 'p':
+            progress = true;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -751,6 +765,12 @@ static int img_check(int argc, char **argv)
         return 1;
     }
 
+    /* The progress bar would end up in the middle of the JSON output */
+    if (quiet || output_format == OFORMAT_JSON) {
+        progress = false;
+    }
+    qemu_progress_init(progress, 1.0);
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -1122,6 +1142,33 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Like is_allocated_sectors, but works on whole clusters of 'cluster_sectors'
+ * sectors (the last one may be shorter), as needed for compressed images.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    bool is_zero;
+    int i, len;
+
+    if (n <= 0) {
+        *pnum = 0;
+        return 0;
+    }
+    len = MIN(n, cluster_sectors);
+    is_zero = buffer_is_zero(buf, len * BDRV_SECTOR_SIZE);
+    for (i = len; i < n; i += len) {
+        len = MIN(n - i, cluster_sectors);
+        if (is_zero != buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                      len * BDRV_SECTOR_SIZE)) {
+            break;
+        }
+    }
+    *pnum = i;
+    return !is_zero;
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first sector of both
  * buffers matches, non-zero otherwise.
@@ -1692,13 +1739,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write of completely zeroed clusters;
+             * the others are passed on together so that the driver can
+             * compress them in parallel. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 iov.iov_base = buf;
                 iov.iov_len = n << BDRV_SECTOR_BITS;
@@ -1862,14 +1910,14 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, it must hold
+     * whole clusters. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
 
     while (sector_num < s->total_sectors) {
@@ -35,6 +35,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring-size=n collect dirty pages through per-vCPU KVM rings of n entries\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -65,6 +66,13 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Collect the pages dirtied by the guest through a ring of @var{n} entries
+per vCPU, rather than through a dirty bitmap per memory slot.  @var{n}
+must be a power of 2.  Each synchronization of the dirty log then costs
+time proportional to the number of dirtied pages instead of the size of
+guest memory, which helps live migration of large guests.  The default
+is 0, which uses the dirty bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -612,7 +620,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -655,7 +664,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -1802,6 +1811,11 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "-netdev af-packet,id=str,ifname=name[,rx-block-size=n][,rx-blocks=n][,tx-frames=n]\n"
+    "                attach to the host network interface 'name' through\n"
+    "                memory-mapped AF_PACKET receive and transmit rings\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2229,6 +2243,28 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,rx-block-size=@var{n}][,rx-blocks=@var{n}][,tx-frames=@var{n}]
+Attach to the host network interface @var{name} with a raw AF_PACKET socket.
+Frames received on the interface are read from a memory-mapped TPACKET_V3
+ring and handed to the guest without an intermediate copy; frames sent by the
+guest are written to a memory-mapped transmit ring, and the kernel is kicked
+once per batch.  The interface is put in promiscuous mode.  @option{rx-block-size}
+(a multiple of the page size) and @option{rx-blocks} size the receive ring,
+@option{tx-frames} sizes the transmit ring.  QEMU needs the CAP_NET_RAW
+capability.  This option is only available on Linux.
+
+Example:
+@example
+# create a veth pair and bring it up
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+# launch QEMU instance
+qemu-system-x86_64 linux.img \
+                   -netdev af-packet,id=n1,ifname=veth0 \
+                   -device virtio-net-pci,netdev=n1
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
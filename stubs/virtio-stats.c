@@ -0,0 +1,10 @@
+#include "qemu/osdep.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+
+VirtioStatsInfoList *qmp_query_virtio_stats(bool has_path, const char *path,
+                                            Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
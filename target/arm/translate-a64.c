@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -531,6 +532,21 @@ static inline int vec_reg_offset(DisasContext *s, int regno,
     return offs;
 }
 
+/* Return the offset into CPUARMState of the whole vector register Qn,
+ * for use with the generic vector expanders.
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
+/* Return the byte size of the whole vector register.  */
+static inline int vec_full_reg_size(DisasContext *s)
+{
+    return 128 / 8;
+}
+
 /* Return the offset into CPUARMState of a slice (from
  * the least significant end) of FP register Qn (ie
  * Dn, Sn, Hn or Bn).
@@ -9034,6 +9050,35 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         return;
     }
 
+    if (!is_u || size == 0) {
+        int dofs = vec_full_reg_offset(s, rd);
+        int nofs = vec_full_reg_offset(s, rn);
+        int mofs = vec_full_reg_offset(s, rm);
+        int oprsz = is_q ? 16 : 8;
+        int maxsz = vec_full_reg_size(s);
+
+        switch (size + 4 * is_u) {
+        case 0: /* AND */
+            tcg_gen_gvec_and(dofs, nofs, mofs, oprsz, maxsz);
+            break;
+        case 1: /* BIC */
+            tcg_gen_gvec_andc(dofs, nofs, mofs, oprsz, maxsz);
+            break;
+        case 2: /* ORR */
+            tcg_gen_gvec_or(dofs, nofs, mofs, oprsz, maxsz);
+            break;
+        case 3: /* ORN */
+            tcg_gen_gvec_orc(dofs, nofs, mofs, oprsz, maxsz);
+            break;
+        case 4: /* EOR */
+            tcg_gen_gvec_xor(dofs, nofs, mofs, oprsz, maxsz);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -9043,47 +9088,25 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         read_vec_element(s, tcg_op1, rn, pass, MO_64);
         read_vec_element(s, tcg_op2, rm, pass, MO_64);
 
-        if (!is_u) {
-            switch (size) {
-            case 0: /* AND */
-                tcg_gen_and_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BIC */
-                tcg_gen_andc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 2: /* ORR */
-                tcg_gen_or_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 3: /* ORN */
-                tcg_gen_orc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            }
-        } else {
-            if (size != 0) {
-                /* B* ops need res loaded to operate on */
-                read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
-            }
+        /* B* ops need res loaded to operate on */
+        read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
 
-            switch (size) {
-            case 0: /* EOR */
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BSL bitwise select */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
-                break;
-            case 2: /* BIT, bitwise insert if true */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            case 3: /* BIF, bitwise insert if false */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            }
+        switch (size) {
+        case 1: /* BSL bitwise select */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
+            break;
+        case 2: /* BIT, bitwise insert if true */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
+        case 3: /* BIF, bitwise insert if false */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
         }
     }
 
@@ -9346,6 +9369,17 @@ static void disas_simd_3same_float(DisasContext *s, uint32_t insn)
     }
 }
 
+/* Expand a lane-wise AdvSIMD comparison, setting each element of Vd
+ * to all ones if COND holds between the elements of Vn and Vm.
+ */
+static void gen_gvec_cmp3(DisasContext *s, bool is_q, int size,
+                          TCGCond cond, int rd, int rn, int rm)
+{
+    tcg_gen_gvec_cmp(cond, size, vec_full_reg_offset(s, rd),
+                     vec_full_reg_offset(s, rn), vec_full_reg_offset(s, rm),
+                     is_q ? 16 : 8, vec_full_reg_size(s));
+}
+
 /* Integer op subgroup of C3.6.16. */
 static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
 {
@@ -9396,6 +9430,39 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    /* Operations that treat every lane alike go through the generic
+     * vector expanders, for all element sizes.
+     */
+    switch (opcode) {
+    case 0x10: /* ADD, SUB */
+        if (u) {
+            tcg_gen_gvec_sub(size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm),
+                             is_q ? 16 : 8, vec_full_reg_size(s));
+        } else {
+            tcg_gen_gvec_add(size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm),
+                             is_q ? 16 : 8, vec_full_reg_size(s));
+        }
+        return;
+    case 0x11: /* CMTST, CMEQ */
+        if (!u) {
+            break;
+        }
+        gen_gvec_cmp3(s, is_q, size, TCG_COND_EQ, rd, rn, rm);
+        return;
+    case 0x06: /* CMGT, CMHI */
+        gen_gvec_cmp3(s, is_q, size, u ? TCG_COND_GTU : TCG_COND_GT,
+                      rd, rn, rm);
+        return;
+    case 0x07: /* CMGE, CMHS */
+        gen_gvec_cmp3(s, is_q, size, u ? TCG_COND_GEU : TCG_COND_GE,
+                      rd, rn, rm);
+        return;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
@@ -9476,26 +9543,6 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
                 genenvfn = fns[size][u];
                 break;
             }
-            case 0x6: /* CMGT, CMHI */
-            {
-                static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_cgt_s8, gen_helper_neon_cgt_u8 },
-                    { gen_helper_neon_cgt_s16, gen_helper_neon_cgt_u16 },
-                    { gen_helper_neon_cgt_s32, gen_helper_neon_cgt_u32 },
-                };
-                genfn = fns[size][u];
-                break;
-            }
-            case 0x7: /* CMGE, CMHS */
-            {
-                static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_cge_s8, gen_helper_neon_cge_u8 },
-                    { gen_helper_neon_cge_s16, gen_helper_neon_cge_u16 },
-                    { gen_helper_neon_cge_s32, gen_helper_neon_cge_u32 },
-                };
-                genfn = fns[size][u];
-                break;
-            }
             case 0x8: /* SSHL, USHL */
             {
                 static NeonGenTwoOpFn * const fns[3][2] = {
@@ -9568,24 +9615,14 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
                 genfn = fns[size][u];
                 break;
             }
-            case 0x10: /* ADD, SUB */
-            {
-                static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_add_u8, gen_helper_neon_sub_u8 },
-                    { gen_helper_neon_add_u16, gen_helper_neon_sub_u16 },
-                    { tcg_gen_add_i32, tcg_gen_sub_i32 },
-                };
-                genfn = fns[size][u];
-                break;
-            }
-            case 0x11: /* CMTST, CMEQ */
+            case 0x11: /* CMTST */
             {
-                static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_tst_u8, gen_helper_neon_ceq_u8 },
-                    { gen_helper_neon_tst_u16, gen_helper_neon_ceq_u16 },
-                    { gen_helper_neon_tst_u32, gen_helper_neon_ceq_u32 },
+                static NeonGenTwoOpFn * const fns[3] = {
+                    gen_helper_neon_tst_u8,
+                    gen_helper_neon_tst_u16,
+                    gen_helper_neon_tst_u32,
                 };
-                genfn = fns[size][u];
+                genfn = fns[size];
                 break;
             }
             case 0x13: /* MUL, PMUL */
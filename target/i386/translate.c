@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -2957,6 +2958,76 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Offset of the legacy 128-bit XMM part within a ZMMReg.  */
+#ifdef HOST_WORDS_BIGENDIAN
+#define XMM_LOW_OFFSET  offsetof(ZMMReg, ZMM_Q(1))
+#else
+#define XMM_LOW_OFFSET  0
+#endif
+
+/* Expand the MMX/SSE integer and logic operations that act on every
+   lane alike with the generic vector expanders, instead of calling
+   the per-instruction helper.  Return false if B is not one of them.  */
+static bool gen_sse_gvec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    int sz = is_xmm ? 16 : 8;
+
+    if (is_xmm) {
+        op1_offset += XMM_LOW_OFFSET;
+        op2_offset += XMM_LOW_OFFSET;
+    }
+
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(op1_offset, op2_offset, op1_offset, sz, sz);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset,
+                         sz, sz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+        tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset,
+                         sz, sz);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    case 0x64: /* pcmpgtb */
+    case 0x65: /* pcmpgtw */
+    case 0x66: /* pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4381,6 +4452,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -8305,7 +8379,7 @@ void tcg_x86_init(void)
     initialized = true;
 
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
-    tcg_ctx.tcg_env = cpu_env;
+    tcg_ctx->tcg_env = cpu_env;
     cpu_cc_op = tcg_global_mem_new_i32(cpu_env,
                                        offsetof(CPUX86State, cc_op), "cc_op");
     cpu_cc_dst = tcg_global_mem_new(cpu_env, offsetof(CPUX86State, cc_dst),
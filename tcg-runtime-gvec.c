@@ -0,0 +1,179 @@
+/*
+ *  Generic vector operation helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "tcg-gvec-desc.h"
+
+/*
+ * The bulk of each operation is done 16 bytes at a time using the
+ * compiler's generic vector extension, which turns into SSE2/AVX2,
+ * NEON, AltiVec, ... as the host allows; this is both simpler and
+ * more reliable than coaxing the compiler into autovectorizing.
+ * An odd trailing 8 bytes (and everything, for compilers without
+ * vector support) is done one element at a time.
+ *
+ * The operands are only guaranteed to be 8-byte aligned, since they
+ * live in CPUArchState, so the vector types are under-aligned on
+ * purpose.
+ */
+#ifdef CONFIG_VECTOR16
+#define VEC16(T) T __attribute__((vector_size(16), aligned(8)))
+typedef VEC16(uint8_t) vec8;
+typedef VEC16(uint16_t) vec16;
+typedef VEC16(uint32_t) vec32;
+typedef VEC16(uint64_t) vec64;
+typedef VEC16(int8_t) svec8;
+typedef VEC16(int16_t) svec16;
+typedef VEC16(int32_t) svec32;
+typedef VEC16(int64_t) svec64;
+#endif
+
+static inline void clear_high(void *d, intptr_t oprsz, uint32_t desc)
+{
+    intptr_t maxsz = simd_maxsz(desc);
+
+    if (unlikely(maxsz > oprsz)) {
+        memset(d + oprsz, 0, maxsz - oprsz);
+    }
+}
+
+#ifdef CONFIG_VECTOR16
+#define VEC_LOOP_2(VT, EXPR)                                  \
+    for (; i + 16 <= oprsz; i += 16) {                        \
+        VT aa = *(VT *)(a + i);                               \
+        *(VT *)(d + i) = (VT)(EXPR);                          \
+    }
+#define VEC_LOOP_3(VT, EXPR)                                  \
+    for (; i + 16 <= oprsz; i += 16) {                        \
+        VT aa = *(VT *)(a + i), bb = *(VT *)(b + i);          \
+        *(VT *)(d + i) = (VT)(EXPR);                          \
+    }
+#else
+#define VEC_LOOP_2(VT, EXPR)
+#define VEC_LOOP_3(VT, EXPR)
+#endif
+
+/* Define a helper computing D = EXPR(aa) element-wise, with ET the
+   scalar element type and VT the matching vector type.  */
+#define DO_2(NAME, ET, VT, EXPR)                              \
+void HELPER(NAME)(void *d, void *a, uint32_t desc)            \
+{                                                             \
+    intptr_t oprsz = simd_oprsz(desc);                        \
+    intptr_t i = 0;                                           \
+                                                              \
+    VEC_LOOP_2(VT, EXPR)                                      \
+    for (; i < oprsz; i += sizeof(ET)) {                      \
+        ET aa = *(ET *)(a + i);                               \
+        *(ET *)(d + i) = (ET)(EXPR);                          \
+    }                                                         \
+    clear_high(d, oprsz, desc);                               \
+}
+
+/* Likewise for D = EXPR(aa, bb).  */
+#define DO_3(NAME, ET, VT, EXPR)                              \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)   \
+{                                                             \
+    intptr_t oprsz = simd_oprsz(desc);                        \
+    intptr_t i = 0;                                           \
+                                                              \
+    VEC_LOOP_3(VT, EXPR)                                      \
+    for (; i < oprsz; i += sizeof(ET)) {                      \
+        ET aa = *(ET *)(a + i), bb = *(ET *)(b + i);          \
+        *(ET *)(d + i) = (ET)(EXPR);                          \
+    }                                                         \
+    clear_high(d, oprsz, desc);                               \
+}
+
+void HELPER(gvec_mov)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+
+    memcpy(d, a, oprsz);
+    clear_high(d, oprsz, desc);
+}
+
+void HELPER(gvec_dup64)(void *d, uint32_t desc, uint64_t c)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    if (c == 0) {
+        oprsz = 0;
+    } else {
+        for (i = 0; i < oprsz; i += sizeof(uint64_t)) {
+            *(uint64_t *)(d + i) = c;
+        }
+    }
+    clear_high(d, oprsz, desc);
+}
+
+DO_2(gvec_not, uint64_t, vec64, ~aa)
+
+DO_2(gvec_neg8, uint8_t, vec8, -aa)
+DO_2(gvec_neg16, uint16_t, vec16, -aa)
+DO_2(gvec_neg32, uint32_t, vec32, -aa)
+DO_2(gvec_neg64, uint64_t, vec64, -aa)
+
+DO_3(gvec_add8, uint8_t, vec8, aa + bb)
+DO_3(gvec_add16, uint16_t, vec16, aa + bb)
+DO_3(gvec_add32, uint32_t, vec32, aa + bb)
+DO_3(gvec_add64, uint64_t, vec64, aa + bb)
+
+DO_3(gvec_sub8, uint8_t, vec8, aa - bb)
+DO_3(gvec_sub16, uint16_t, vec16, aa - bb)
+DO_3(gvec_sub32, uint32_t, vec32, aa - bb)
+DO_3(gvec_sub64, uint64_t, vec64, aa - bb)
+
+DO_3(gvec_and, uint64_t, vec64, aa & bb)
+DO_3(gvec_or, uint64_t, vec64, aa | bb)
+DO_3(gvec_xor, uint64_t, vec64, aa ^ bb)
+DO_3(gvec_andc, uint64_t, vec64, aa & ~bb)
+DO_3(gvec_orc, uint64_t, vec64, aa | ~bb)
+
+/* Vector comparisons already produce all-ones for true; the scalar
+   comparisons produce 1, so negate those.  The signedness of the
+   comparison comes from the element and vector types.  */
+
+#define DO_CMP_1(NAME, ET, VT, OP)                            \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)   \
+{                                                             \
+    intptr_t oprsz = simd_oprsz(desc);                        \
+    intptr_t i = 0;                                           \
+                                                              \
+    VEC_LOOP_3(VT, aa OP bb)                                  \
+    for (; i < oprsz; i += sizeof(ET)) {                      \
+        ET aa = *(ET *)(a + i), bb = *(ET *)(b + i);          \
+        *(ET *)(d + i) = -(ET)(aa OP bb);                     \
+    }                                                         \
+    clear_high(d, oprsz, desc);                               \
+}
+
+#define DO_CMP_2(SZ)                                                \
+    DO_CMP_1(gvec_eq##SZ, uint##SZ##_t, vec##SZ, ==)                \
+    DO_CMP_1(gvec_ne##SZ, uint##SZ##_t, vec##SZ, !=)                \
+    DO_CMP_1(gvec_lt##SZ, int##SZ##_t, svec##SZ, <)                 \
+    DO_CMP_1(gvec_le##SZ, int##SZ##_t, svec##SZ, <=)                \
+    DO_CMP_1(gvec_ltu##SZ, uint##SZ##_t, vec##SZ, <)                \
+    DO_CMP_1(gvec_leu##SZ, uint##SZ##_t, vec##SZ, <=)
+
+DO_CMP_2(8)
+DO_CMP_2(16)
+DO_CMP_2(32)
+DO_CMP_2(64)
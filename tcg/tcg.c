@@ -58,6 +58,9 @@
 
 #include "elf.h"
 #include "exec/log.h"
+#ifndef CONFIG_USER_ONLY
+#include "sysemu/sysemu.h"
+#endif
 
 /* Forward declarations for functions declared in tcg-target.inc.c and
    used here. */
@@ -120,6 +123,42 @@ static bool tcg_out_tb_finalize(TCGContext *s);
 static TCGRegSet tcg_target_available_regs[2];
 static TCGRegSet tcg_target_call_clobber_regs;
 
+/* The context set up by tcg_context_init, which the per-thread contexts
+   are copied from.  */
+TCGContext tcg_init_ctx;
+__thread TCGContext *tcg_ctx;
+
+/* All the contexts that own a region; protected by region.lock */
+static TCGContext **tcg_ctxs;
+static unsigned int n_tcg_ctxs;
+
+/*
+ * The code buffer is split into regions, each of which is used by at most
+ * one TCGContext at a time.  A thread whose region fills up moves on to
+ * the next free one; the buffer only needs to be flushed when all of them
+ * are in use.
+ */
+struct tcg_region_state {
+    QemuMutex lock;
+
+    /* fields set at init time */
+    void *start;
+    void *end;
+    size_t n;
+    size_t size; /* size of one region */
+
+    /* fields protected by the lock */
+    size_t current; /* current region index */
+    size_t agg_size_full; /* aggregate size of full regions */
+};
+
+static struct tcg_region_state region;
+
+/* Space kept free at the end of each region.  The size is arbitrary,
+   significantly larger than we expect the code generation for any one
+   opcode to require.  */
+#define TCG_HIGHWATER 1024
+
 #if TCG_TARGET_INSN_UNIT_SIZE == 1
 static __attribute__((unused)) inline void tcg_out8(TCGContext *s, uint8_t v)
 {
@@ -242,7 +281,7 @@ static void tcg_out_label(TCGContext *s, TCGLabel *l, tcg_insn_unit *ptr)
 
 TCGLabel *gen_new_label(void)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     TCGLabel *l = tcg_malloc(sizeof(TCGLabel));
 
     *l = (TCGLabel){
@@ -307,6 +346,239 @@ void tcg_pool_reset(TCGContext *s)
     s->pool_current = NULL;
 }
 
+static void tcg_region_bounds(size_t curr_region, void **pstart, void **pend)
+{
+    void *start, *end;
+
+    start = region.start + curr_region * region.size;
+    end = start + region.size;
+
+    /* The last region also takes what the division left over */
+    if (curr_region == region.n - 1) {
+        end = region.end;
+    }
+
+    *pstart = start;
+    *pend = end;
+}
+
+static void tcg_region_assign(TCGContext *s, size_t curr_region)
+{
+    void *start, *end;
+
+    tcg_region_bounds(curr_region, &start, &end);
+
+    s->code_gen_buffer = start;
+    s->code_gen_ptr = start;
+    s->code_gen_buffer_size = end - start;
+    s->code_gen_highwater = end - TCG_HIGHWATER;
+}
+
+/* Called with region.lock held.  Returns true if no region is left.  */
+static bool tcg_region_alloc__(TCGContext *s)
+{
+    if (region.current == region.n) {
+        return true;
+    }
+    tcg_region_assign(s, region.current);
+    region.current++;
+    return false;
+}
+
+/*
+ * Request a new region once the one in use has filled up.
+ * Returns true if there are none left, in which case the caller
+ * must flush the code buffer.
+ */
+bool tcg_region_alloc(TCGContext *s)
+{
+    size_t size_used = s->code_gen_ptr - s->code_gen_buffer;
+    bool err;
+
+    qemu_mutex_lock(&region.lock);
+    err = tcg_region_alloc__(s);
+    if (!err) {
+        region.agg_size_full += size_used;
+    }
+    qemu_mutex_unlock(&region.lock);
+    return err;
+}
+
+/*
+ * Give each context a fresh region, dropping all the translated code.
+ * Called from tb_flush, while no vCPU is executing or translating code.
+ */
+void tcg_region_reset_all(void)
+{
+    unsigned int i;
+
+    qemu_mutex_lock(&region.lock);
+    region.current = 0;
+    region.agg_size_full = 0;
+
+    for (i = 0; i < n_tcg_ctxs; i++) {
+        bool err = tcg_region_alloc__(tcg_ctxs[i]);
+
+        g_assert(!err);
+    }
+    qemu_mutex_unlock(&region.lock);
+}
+
+#ifdef CONFIG_USER_ONLY
+static size_t tcg_n_regions(void)
+{
+    /* All the threads share tcg_init_ctx, see tcg_register_thread.  */
+    return 1;
+}
+#else
+/*
+ * It is likely that some vCPUs will translate more code than others, so
+ * we first try to set more regions than max_cpus, with those regions
+ * being of reasonable size.  If that's not possible we make do by evenly
+ * dividing the code buffer among the vCPUs.
+ */
+static size_t tcg_n_regions(void)
+{
+    size_t i;
+
+    /* Use a single region if all we have is one vCPU thread */
+    if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
+        return 1;
+    }
+
+    /* Try to have more regions than max_cpus, with each region >= 2 MB */
+    for (i = 8; i > 0; i--) {
+        size_t regions_per_thread = i;
+        size_t region_size;
+
+        region_size = tcg_init_ctx.code_gen_buffer_size;
+        region_size /= max_cpus * regions_per_thread;
+
+        if (region_size >= 2 * 1024u * 1024) {
+            return max_cpus * regions_per_thread;
+        }
+    }
+    /* If we can't, then just allocate one region per vCPU thread */
+    return max_cpus;
+}
+#endif
+
+/*
+ * Split the code buffer left after the prologue into regions.  In user
+ * mode this is called right after tcg_prologue_init; in system mode it
+ * is called once the number of vCPUs and whether they run in parallel
+ * are known, before any vCPU thread calls tcg_register_thread.
+ */
+void tcg_region_init(void)
+{
+    void *buf = tcg_init_ctx.code_gen_buffer;
+    size_t size = tcg_init_ctx.code_gen_buffer_size;
+    size_t n_regions = tcg_n_regions();
+    unsigned int i;
+
+    region.n = n_regions;
+    region.start = buf;
+    region.end = buf + size;
+    region.size = QEMU_ALIGN_DOWN(size / n_regions, CODE_GEN_ALIGN);
+    g_assert(region.size > TCG_HIGHWATER);
+
+    qemu_mutex_init(&region.lock);
+
+    /* In user mode, tcg_init_ctx is ready to translate */
+    for (i = 0; i < n_tcg_ctxs; i++) {
+        bool err = tcg_region_alloc__(tcg_ctxs[i]);
+
+        g_assert(!err);
+    }
+}
+
+/*
+ * All TCG threads except the parent (i.e. the one that called
+ * tcg_context_init and registered the target's TCG globals) must
+ * register with this function before translating any code.
+ *
+ * In user mode we just point tcg_ctx to tcg_init_ctx.  Threads there
+ * share a single context, and translate under tb_lock.
+ *
+ * In system mode each caller gets its own copy of tcg_init_ctx, and
+ * its own region of the code buffer; the copies share the TCG globals
+ * (which are the same indices in every copy).
+ */
+#ifdef CONFIG_USER_ONLY
+void tcg_register_thread(void)
+{
+    tcg_ctx = &tcg_init_ctx;
+}
+#else
+void tcg_register_thread(void)
+{
+    TCGContext *s = g_malloc(sizeof(*s));
+    unsigned int i, n;
+    bool err;
+
+    *s = tcg_init_ctx;
+
+    /* Relink the pointers to temps into the copy */
+    for (i = 0; i < tcg_init_ctx.nb_globals; i++) {
+        if (tcg_init_ctx.temps[i].mem_base) {
+            ptrdiff_t b = tcg_init_ctx.temps[i].mem_base - tcg_init_ctx.temps;
+
+            tcg_debug_assert(b >= 0 && b < tcg_init_ctx.nb_globals);
+            s->temps[i].mem_base = &s->temps[b];
+        }
+    }
+    s->frame_temp = &s->temps[tcg_init_ctx.frame_temp - tcg_init_ctx.temps];
+
+    /* The memory pools are per-context */
+    s->pool_cur = s->pool_end = NULL;
+    s->pool_first = s->pool_current = s->pool_first_large = NULL;
+
+    /* Claim an entry in tcg_ctxs, and a region */
+    qemu_mutex_lock(&region.lock);
+    n = n_tcg_ctxs++;
+    g_assert(n < max_cpus);
+    tcg_ctxs[n] = s;
+    err = tcg_region_alloc__(s);
+    g_assert(!err);
+    qemu_mutex_unlock(&region.lock);
+
+    tcg_ctx = s;
+}
+#endif /* !CONFIG_USER_ONLY */
+
+/*
+ * Returns the size (in bytes) of all translated code (i.e. from all regions)
+ * currently in the cache.
+ * See also: tcg_code_capacity()
+ * Do not confuse with tcg_current_code_size(); that one applies to a single
+ * TCG context.
+ */
+size_t tcg_code_size(void)
+{
+    unsigned int i;
+    size_t total;
+
+    qemu_mutex_lock(&region.lock);
+    total = region.agg_size_full;
+    for (i = 0; i < n_tcg_ctxs; i++) {
+        const TCGContext *s = tcg_ctxs[i];
+
+        total += atomic_read(&s->code_gen_ptr) - s->code_gen_buffer;
+    }
+    qemu_mutex_unlock(&region.lock);
+    return total;
+}
+
+/*
+ * Returns the code capacity (in bytes) of the entire cache, i.e. including all
+ * regions, minus the space kept free at the end of each of them.
+ * See also: tcg_code_size()
+ */
+size_t tcg_code_capacity(void)
+{
+    return (region.end - region.start) - region.n * TCG_HIGHWATER;
+}
+
 typedef struct TCGHelperInfo {
     void *func;
     const char *name;
@@ -381,6 +653,20 @@ void tcg_context_init(TCGContext *s)
     for (; i < ARRAY_SIZE(tcg_target_reg_alloc_order); ++i) {
         indirect_reg_alloc_order[i] = tcg_target_reg_alloc_order[i];
     }
+
+    tcg_ctx = s;
+    /*
+     * In user mode the threads share the init context, and with it a
+     * single region.  In system mode each vCPU thread registers its own
+     * context, and there are at most max_cpus of them.
+     */
+#ifdef CONFIG_USER_ONLY
+    tcg_ctxs = g_new(TCGContext *, 1);
+    tcg_ctxs[0] = s;
+    n_tcg_ctxs = 1;
+#else
+    tcg_ctxs = g_new(TCGContext *, max_cpus);
+#endif
 }
 
 void tcg_prologue_init(TCGContext *s)
@@ -408,9 +694,8 @@ void tcg_prologue_init(TCGContext *s)
     s->code_gen_buffer_size = total_size;
 
     /* Compute a high-water mark, at which we voluntarily flush the buffer
-       and start over.  The size here is arbitrary, significantly larger
-       than we expect the code generation for any one opcode to require.  */
-    s->code_gen_highwater = s->code_gen_buffer + (total_size - 1024);
+       and start over.  This is refined by tcg_region_init.  */
+    s->code_gen_highwater = s->code_gen_buffer + (total_size - TCG_HIGHWATER);
 
     tcg_register_jit(s->code_gen_buffer, total_size);
 
@@ -436,6 +721,7 @@ void tcg_func_start(TCGContext *s)
 
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->uses_host_ptr = false;
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -501,7 +787,7 @@ void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size)
 
 TCGv_i32 tcg_global_reg_new_i32(TCGReg reg, const char *name)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     int idx;
 
     if (tcg_regset_test_reg(s->reserved_regs, reg)) {
@@ -513,7 +799,7 @@ TCGv_i32 tcg_global_reg_new_i32(TCGReg reg, const char *name)
 
 TCGv_i64 tcg_global_reg_new_i64(TCGReg reg, const char *name)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     int idx;
 
     if (tcg_regset_test_reg(s->reserved_regs, reg)) {
@@ -526,7 +812,7 @@ TCGv_i64 tcg_global_reg_new_i64(TCGReg reg, const char *name)
 int tcg_global_mem_new_internal(TCGType type, TCGv_ptr base,
                                 intptr_t offset, const char *name)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     TCGTemp *base_ts = &s->temps[GET_TCGV_PTR(base)];
     TCGTemp *ts = tcg_global_alloc(s);
     int indirect_reg = 0, bigendian = 0;
@@ -581,7 +867,7 @@ int tcg_global_mem_new_internal(TCGType type, TCGv_ptr base,
 
 static int tcg_temp_new_internal(TCGType type, int temp_local)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     TCGTemp *ts;
     int idx, k;
 
@@ -643,7 +929,7 @@ TCGv_i64 tcg_temp_new_internal_i64(int temp_local)
 
 static void tcg_temp_free_internal(int idx)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     TCGTemp *ts;
     int k;
 
@@ -708,13 +994,13 @@ TCGv_i64 tcg_const_local_i64(int64_t val)
 #if defined(CONFIG_DEBUG_TCG)
 void tcg_clear_temp_count(void)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     s->temps_in_use = 0;
 }
 
 int tcg_check_temp_count(void)
 {
-    TCGContext *s = &tcg_ctx;
+    TCGContext *s = tcg_ctx;
     if (s->temps_in_use) {
         /* Clear the count so that we don't give another
          * warning immediately next time around.
@@ -1314,7 +1600,7 @@ void tcg_op_remove(TCGContext *s, TCGOp *op)
     memset(op, 0, sizeof(*op));
 
 #ifdef CONFIG_PROFILER
-    s->del_op_count++;
+    s->prof.del_op_count++;
 #endif
 }
 
@@ -2513,15 +2799,15 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
         int n;
 
         n = s->gen_op_buf[0].prev + 1;
-        s->op_count += n;
-        if (n > s->op_count_max) {
-            s->op_count_max = n;
+        s->prof.op_count += n;
+        if (n > s->prof.op_count_max) {
+            s->prof.op_count_max = n;
         }
 
         n = s->nb_temps;
-        s->temp_count += n;
-        if (n > s->temp_count_max) {
-            s->temp_count_max = n;
+        s->prof.temp_count += n;
+        if (n > s->prof.temp_count_max) {
+            s->prof.temp_count_max = n;
         }
     }
 #endif
@@ -2538,7 +2824,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #endif
 
 #ifdef CONFIG_PROFILER
-    s->opt_time -= profile_getclock();
+    s->prof.opt_time -= profile_getclock();
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
@@ -2546,8 +2832,8 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #endif
 
 #ifdef CONFIG_PROFILER
-    s->opt_time += profile_getclock();
-    s->la_time -= profile_getclock();
+    s->prof.opt_time += profile_getclock();
+    s->prof.la_time -= profile_getclock();
 #endif
 
     {
@@ -2575,7 +2861,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
 
 #ifdef CONFIG_PROFILER
-    s->la_time += profile_getclock();
+    s->prof.la_time += profile_getclock();
 #endif
 
 #ifdef DEBUG_DISAS
@@ -2680,12 +2966,52 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 }
 
 #ifdef CONFIG_PROFILER
+/* Sum up the profiling counters of all the contexts.  The counters are
+   updated without synchronization, so the result is approximate.  */
+static void tcg_profile_snapshot(TCGProfile *prof)
+{
+    unsigned int i;
+
+    memset(prof, 0, sizeof(*prof));
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < n_tcg_ctxs; i++) {
+        const TCGProfile *orig = &tcg_ctxs[i]->prof;
+
+#define PROF_ADD(field) prof->field += orig->field
+#define PROF_MAX(field) prof->field = MAX(prof->field, orig->field)
+        PROF_ADD(tb_count1);
+        PROF_ADD(tb_count);
+        PROF_ADD(op_count);
+        PROF_MAX(op_count_max);
+        PROF_ADD(temp_count);
+        PROF_MAX(temp_count_max);
+        PROF_ADD(del_op_count);
+        PROF_ADD(code_in_len);
+        PROF_ADD(code_out_len);
+        PROF_ADD(search_out_len);
+        PROF_ADD(interm_time);
+        PROF_ADD(code_time);
+        PROF_ADD(la_time);
+        PROF_ADD(opt_time);
+        PROF_ADD(restore_count);
+        PROF_ADD(restore_time);
+#undef PROF_ADD
+#undef PROF_MAX
+    }
+    qemu_mutex_unlock(&region.lock);
+}
+
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    TCGContext *s = &tcg_ctx;
-    int64_t tb_count = s->tb_count;
-    int64_t tb_div_count = tb_count ? tb_count : 1;
-    int64_t tot = s->interm_time + s->code_time;
+    TCGProfile prof_snapshot, *s = &prof_snapshot;
+    int64_t tb_count;
+    int64_t tb_div_count;
+    int64_t tot;
+
+    tcg_profile_snapshot(s);
+    tb_count = s->tb_count;
+    tb_div_count = tb_count ? tb_count : 1;
+    tot = s->interm_time + s->code_time;
 
     cpu_fprintf(f, "JIT cycles          %" PRId64 " (%0.3f s at 2.4 GHz)\n",
                 tot, tot / 2.4e9);
@@ -0,0 +1,195 @@
+/*
+ * Benchmark for the Internet checksum and Toeplitz hash in net/checksum.c
+ *
+ * Each implementation selected at run time is compared with the
+ * byte-at-a-time code that net/checksum.c used before, and its results
+ * are checked against it.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+#define RSS_KEY_SIZE 40
+
+static unsigned int pkt_size = 1500;
+static unsigned int rss_len = 36;
+static unsigned int duration_ms = 1000;
+
+static const char commands_string[] =
+    " -s = checksummed length in bytes (default 1500)\n"
+    " -r = hashed length in bytes, at most 36 (default 36)\n"
+    " -d = duration of each run in milliseconds (default 1000)";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/* What net/checksum.c did before it had vectorized versions */
+static uint32_t ref_checksum_add(int len, const uint8_t *buf)
+{
+    uint32_t sum1 = 0, sum2 = 0;
+    int i;
+
+    for (i = 0; i < len - 1; i += 2) {
+        sum1 += (uint32_t)buf[i];
+        sum2 += (uint32_t)buf[i + 1];
+    }
+    if (i < len) {
+        sum1 += (uint32_t)buf[i];
+    }
+    return sum2 + (sum1 << 8);
+}
+
+static uint32_t ref_toeplitz(const uint8_t *input, uint32_t len,
+                             const uint8_t *key)
+{
+    uint32_t accumulator = 0;
+    uint32_t leftmost_32_bits = ldl_be_p(key);
+    const uint8_t *next_byte = key + 4;
+    uint32_t byte;
+
+    for (byte = 0; byte < len; byte++) {
+        uint8_t input_byte = input[byte];
+        uint8_t key_byte = *(next_byte++);
+        uint8_t bit;
+
+        for (bit = 0; bit < 8; bit++) {
+            if (input_byte & (1 << 7)) {
+                accumulator ^= leftmost_32_bits;
+            }
+            leftmost_32_bits =
+                (leftmost_32_bits << 1) | ((key_byte & (1 << 7)) >> 7);
+            input_byte <<= 1;
+            key_byte <<= 1;
+        }
+    }
+    return accumulator;
+}
+
+static uint32_t new_toeplitz(uint8_t *input, uint32_t len, uint8_t *key)
+{
+    net_toeplitz_key key_data;
+    uint32_t hash = 0;
+
+    net_toeplitz_key_init(&key_data, key);
+    net_toeplitz_add(&hash, input, len, &key_data);
+    return hash;
+}
+
+static void check(uint8_t *buf, uint8_t *key)
+{
+    unsigned int len, off;
+
+    for (off = 0; off < 8; off++) {
+        for (len = 0; len <= pkt_size; len++) {
+            if (net_checksum_finish(ref_checksum_add(len, buf + off)) !=
+                net_checksum_finish(net_checksum_add(len, buf + off))) {
+                fprintf(stderr, "checksum mismatch, offset %u length %u\n",
+                        off, len);
+                exit(1);
+            }
+        }
+    }
+    for (len = 0; len <= rss_len; len++) {
+        if (ref_toeplitz(buf, len, key) != new_toeplitz(buf, len, key)) {
+            fprintf(stderr, "Toeplitz hash mismatch, length %u\n", len);
+            exit(1);
+        }
+    }
+}
+
+/* Returns operations per second */
+#define BENCH(expr)                                                     \
+    ({                                                                  \
+        int64_t start_ = g_get_monotonic_time(), now_;                  \
+        uint64_t ops_ = 0;                                              \
+        do {                                                            \
+            unsigned int i_;                                            \
+            for (i_ = 0; i_ < 1024; i_++) {                             \
+                sink += (expr);                                         \
+            }                                                           \
+            ops_ += 1024;                                               \
+            now_ = g_get_monotonic_time();                              \
+        } while (now_ - start_ < duration_ms * 1000);                   \
+        ops_ * 1e6 / (now_ - start_);                                   \
+    })
+
+static volatile uint32_t sink;
+
+static void run(const char *name, uint8_t *buf, uint8_t *key, bool ref)
+{
+    double csum, hash;
+
+    if (ref) {
+        csum = BENCH(ref_checksum_add(pkt_size, buf));
+        hash = BENCH(ref_toeplitz(buf, rss_len, key));
+    } else {
+        csum = BENCH(net_checksum_add(pkt_size, buf));
+        hash = BENCH(new_toeplitz(buf, rss_len, key));
+    }
+    printf("%-12s checksum %8.2f Gbit/s   Toeplitz %8.2f Mhash/s\n",
+           name, csum * pkt_size * 8 / 1e9, hash / 1e6);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hs:r:d:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 's':
+            /* the reference code overflows beyond 64k */
+            pkt_size = MIN(atoi(optarg), 65535);
+            break;
+        case 'r':
+            rss_len = MIN(atoi(optarg), RSS_KEY_SIZE - 4);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t key[RSS_KEY_SIZE];
+    uint8_t *buf;
+    char name[16];
+    unsigned int i;
+    int level = 0;
+
+    parse_args(argc, argv);
+
+    buf = g_malloc(pkt_size + 8);
+    for (i = 0; i < pkt_size + 8; i++) {
+        buf[i] = g_random_int();
+    }
+    for (i = 0; i < sizeof(key); i++) {
+        key[i] = g_random_int();
+    }
+
+    run("scalar", buf, key, true);
+    do {
+        check(buf, key);
+        snprintf(name, sizeof(name), "accel #%d", level++);
+        run(name, buf, key, false);
+    } while (test_net_checksum_next_accel());
+
+    g_free(buf);
+    return 0;
+}
@@ -174,6 +174,66 @@ static void test_encode_decode(void)
     }
 }
 
+/* Pages modified in @nruns runs of @run_len bytes, at random offsets */
+static void bench_encode(int nruns, int run_len)
+{
+    const int npages = 1024;
+    const int loops = 64;
+    uint8_t *old_buf = g_malloc0(npages * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(npages * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int64_t start, elapsed;
+    int i, j, k;
+
+    for (i = 0; i < npages; i++) {
+        uint8_t *page = new_buf + i * PAGE_SIZE;
+
+        for (j = 0; j < nruns; j++) {
+            int ofs = g_test_rand_int_range(0, PAGE_SIZE - run_len);
+
+            for (k = 0; k < run_len; k++) {
+                page[ofs + k] = g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < loops; i++) {
+        for (j = 0; j < npages; j++) {
+            xbzrle_encode_buffer(old_buf + j * PAGE_SIZE,
+                                 new_buf + j * PAGE_SIZE, PAGE_SIZE,
+                                 compressed, PAGE_SIZE);
+        }
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_test_message("encode %-8s %3d runs of %4d bytes: %.2f GB/s",
+                   test_xbzrle_accel_name(), nruns, run_len,
+                   (double)loops * npages * PAGE_SIZE / elapsed / 1000);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
+static void test_encode_decode_accel(void)
+{
+    do {
+        test_encode_decode_zero();
+        test_encode_decode_unchanged();
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode();
+
+        if (g_test_perf()) {
+            bench_encode(0, 0);
+            bench_encode(4, 16);
+            bench_encode(32, 32);
+            bench_encode(1, 1024);
+        }
+    } while (test_xbzrle_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +246,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Must come last, it steps through the accelerated encoders */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
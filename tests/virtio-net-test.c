@@ -21,6 +21,13 @@
 #include "standard-headers/linux/virtio_ids.h"
 #include "standard-headers/linux/virtio_ring.h"
 
+#ifdef CONFIG_LINUX
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <linux/if_packet.h>
+#include "net/tap-linux.h"
+#endif
+
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
@@ -237,6 +244,207 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+#ifdef CONFIG_LINUX
+#define RSC_RX_BUFS     4
+#define RSC_RX_BUF_SIZE 4096
+#define RSC_PAYLOAD     1000
+#define RSC_HDRS_LEN    (14 + 20 + 20)
+
+/* Creates a tap with a vnet header, and a packet socket that makes the
+ * host transmit frames to QEMU through it.  Both need CAP_NET_ADMIN.
+ */
+static int rsc_tap_open(int *pkt_sock, int *ifindex)
+{
+    struct ifreq ifr;
+    char *path;
+    FILE *f;
+    int fd, s;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* Keep the host from sending anything but the test frames */
+    path = g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6",
+                           ifr.ifr_name);
+    f = fopen(path, "w");
+    if (f) {
+        fputs("1", f);
+        fclose(f);
+    }
+    g_free(path);
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(s, >=, 0);
+    if (ioctl(s, SIOCGIFFLAGS, &ifr) < 0) {
+        goto fail;
+    }
+    ifr.ifr_flags |= IFF_UP | IFF_NOARP;
+    if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0 ||
+        ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+        goto fail;
+    }
+    close(s);
+    *ifindex = ifr.ifr_ifindex;
+
+    *pkt_sock = socket(AF_PACKET, SOCK_RAW, 0);
+    if (*pkt_sock < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+
+fail:
+    close(s);
+    close(fd);
+    return -1;
+}
+
+/* Sends a full-sized ACK segment of one TCP connection to the guest */
+static void rsc_send_segment(int pkt_sock, int ifindex, uint32_t seq)
+{
+    static const uint8_t macs[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+    };
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = ifindex,
+        .sll_halen = 6,
+    };
+    uint8_t frame[RSC_HDRS_LEN + RSC_PAYLOAD] = { 0 };
+    uint8_t *ip = frame + 14;
+    uint8_t *tcp = ip + 20;
+    ssize_t ret;
+
+    memcpy(frame, macs, sizeof(macs));
+    memcpy(addr.sll_addr, macs, 6);
+    stw_be_p(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + RSC_PAYLOAD);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, 0x0a000002);
+    stl_be_p(ip + 16, 0x0a00000f);
+
+    stw_be_p(tcp, 5001);
+    stw_be_p(tcp + 2, 40000);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x10;
+    stw_be_p(tcp + 14, 0xffff);
+
+    memset(tcp + 20, seq & 0xff, RSC_PAYLOAD);
+
+    ret = sendto(pkt_sock, frame, sizeof(frame), 0,
+                 (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+}
+
+/* Segments held for coalescing must reach the guest before the VM stops */
+static void rsc_stop_test(void)
+{
+    const char *arch = qtest_get_arch();
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *rx, *tx;
+    QDict *rsp;
+    uint64_t addr[RSC_RX_BUFS];
+    uint32_t head[RSC_RX_BUFS];
+    uint8_t buffer[RSC_PAYLOAD];
+    uint16_t used_idx, n;
+    bool found = false;
+    int tap, pkt_sock, ifindex, i;
+
+    if (strcmp(arch, "i386") != 0 && strcmp(arch, "x86_64") != 0) {
+        return;
+    }
+    tap = rsc_tap_open(&pkt_sock, &ifindex);
+    if (tap < 0) {
+        g_test_message("Skipping, a tap device could not be set up");
+        return;
+    }
+
+    qs = qtest_pc_boot("-netdev tap,fd=%d,id=hs0 "
+                       "-device virtio-net-pci,netdev=hs0,rsc=on", tap);
+    dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 1);
+    driver_init(&dev->vdev);
+
+    for (i = 0; i < RSC_RX_BUFS; i++) {
+        addr[i] = guest_alloc(qs->alloc, RSC_RX_BUF_SIZE);
+        head[i] = qvirtqueue_add(&rx->vq, addr[i], RSC_RX_BUF_SIZE,
+                                 true, false);
+        qvirtqueue_kick(&dev->vdev, &rx->vq, head[i]);
+    }
+
+    /* The virtual clock does not run under qtest, so the coalescing
+     * timer never delivers the flow on its own.
+     */
+    rsc_send_segment(pkt_sock, ifindex, 1000);
+    rsc_send_segment(pkt_sock, ifindex, 1000 + RSC_PAYLOAD);
+    rsp = qmp("{ 'execute' : 'query-status'}");
+    QDECREF(rsp);
+
+    rsp = qmp("{ 'execute' : 'stop'}");
+    QDECREF(rsp);
+
+    /* Anything else the host sent is in the ring as well */
+    used_idx = readw(rx->vq.used + 2);
+    for (n = 0; n < used_idx; n++) {
+        uint32_t id = readl(rx->vq.used + 4 + n * 8);
+        uint32_t len = readl(rx->vq.used + 8 + n * 8);
+
+        i = 0;
+        while (head[i] != id) {
+            g_assert_cmpint(++i, <, RSC_RX_BUFS);
+        }
+        if (readb(addr[i] + 1) != VIRTIO_NET_HDR_GSO_TCPV4) {
+            continue;
+        }
+
+        g_assert_cmpint(readw(addr[i] + 4), ==, RSC_PAYLOAD);
+        g_assert_cmpint(readw(addr[i] + 10), ==, 1);
+        g_assert_cmpint(len, ==, VNET_HDR_SIZE + RSC_HDRS_LEN +
+                                 2 * RSC_PAYLOAD);
+        memread(addr[i] + VNET_HDR_SIZE + RSC_HDRS_LEN, buffer,
+                RSC_PAYLOAD);
+        g_assert_cmpint(buffer[0], ==, 1000 & 0xff);
+        g_assert_cmpint(buffer[RSC_PAYLOAD - 1], ==, 1000 & 0xff);
+        memread(addr[i] + VNET_HDR_SIZE + RSC_HDRS_LEN + RSC_PAYLOAD,
+                buffer, RSC_PAYLOAD);
+        g_assert_cmpint(buffer[0], ==, (1000 + RSC_PAYLOAD) & 0xff);
+        found = true;
+    }
+    g_assert(found);
+
+    rsp = qmp("{ 'execute' : 'cont'}");
+    QDECREF(rsp);
+
+    close(pkt_sock);
+    for (i = 0; i < RSC_RX_BUFS; i++) {
+        guest_free(qs->alloc, addr[i]);
+    }
+    qvirtqueue_cleanup(dev->vdev.bus, &tx->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &rx->vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qtest_shutdown(qs);
+    close(tap);
+}
+#endif
 #endif
 
 static void hotplug(void)
@@ -261,6 +469,9 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+#ifdef CONFIG_LINUX
+    qtest_add_func("/virtio/net/pci/rsc_stop", rsc_stop_test);
+#endif
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 